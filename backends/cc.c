@@ -24,12 +24,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
 
 #include "../compiler-internals.h"
 #include "../compiler_types.h"
 
 static filter_code_t **filter_codes;
 
+/* In lane mode the non-constant code is emitted for a batch of
+   MATHMAP_VECTOR_WIDTH consecutive pixels.  Every statement becomes a
+   loop over the lanes, which the C compiler can vectorize, and every
+   value that isn't a permanent constant becomes an array. */
+static gboolean lane_mode = FALSE;
+
+/* In lane mode, the number of the mask array which says which lanes
+   execute the statements currently being emitted, or -1 if all of
+   them do.  Branches of if and bodies of while loops are executed for
+   all lanes at once, but only change the values of the lanes in their
+   mask.  Cheap statements are computed for all lanes and the result
+   is selected by the mask, which gcc can vectorize, because a branch
+   in the lane loop keeps it from doing so. */
+static int lane_mask = -1;
+static int next_lane_mask = 0;
+
+/* While the per-pixel code is emitted, the tuples which are stored on
+   the stack instead of in the pools.  See compiler_opt_find_local_tuples(). */
+static value_set_t *local_tuples = NULL;
+
 // defined in compiler-types.h
 MAKE_TYPE_C_TYPE_NAME
 
@@ -65,6 +87,31 @@ print_tree_vector (tree_vector_t *tree_vector)
     g_assert_not_reached();
 }
 
+static gboolean
+is_lane_value (value_t *value)
+{
+#ifndef NO_CONSTANTS_ANALYSIS
+    return lane_mode && !compiler_is_permanent_const_value(value);
+#else
+    return lane_mode;
+#endif
+}
+
+static void
+output_value_base_name (FILE *out, value_t *value)
+{
+    if (value->compvar->var != 0)
+	fprintf(out, "var_%d_%d_%d", value->compvar->index, value->compvar->n, value->index);
+    else
+	fprintf(out, "tmp_%d_%d", value->compvar->temp->number, value->index);
+}
+
+static gboolean
+is_local_tuple (value_t *value)
+{
+    return value != NULL && local_tuples != NULL && compiler_value_set_contains(local_tuples, value);
+}
+
 static void
 output_value_name (FILE *out, value_t *value, int for_decl)
 {
@@ -87,25 +134,38 @@ output_value_name (FILE *out, value_t *value, int for_decl)
 	}
 #endif
 
-	if (value->compvar->var != 0)
-	    fprintf(out, "var_%d_%d_%d", value->compvar->index, value->compvar->n, value->index);
-	else
-	    fprintf(out, "tmp_%d_%d", value->compvar->temp->number, value->index);
+	output_value_base_name(out, value);
+
+	if (is_lane_value(value))
+	    fputs(for_decl ? "[MATHMAP_VECTOR_WIDTH]" : "[__lane]", out);
+
+#ifndef NO_CONSTANTS_ANALYSIS
+	/* y_vars holds an array over the columns for each value. */
+	if (!for_decl && compiler_is_permanent_const_value(value)
+	    && (value->const_type | CONST_T) == (CONST_Y | CONST_T))
+	    fputs(lane_mode ? "[col + __lane]" : "[col]", out);
+#endif
     }
 }
 
 static void
-output_value_decl (FILE *out, value_t *value)
+output_value_decl_full (FILE *out, value_t *value, gboolean pointer)
 {
     if (!value->have_defined && value->index >= 0)
     {
-	fprintf(out, "%s ", type_c_type_name(value->compvar->type));
+	fprintf(out, "%s %s", type_c_type_name(value->compvar->type), pointer ? "*" : "");
 	output_value_name(out, value, 1);
 	fputs(";\n", out);
 	value->have_defined = 1;
     }
 }
 
+static void
+output_value_decl (FILE *out, value_t *value)
+{
+    output_value_decl_full(out, value, FALSE);
+}
+
 static void
 output_primary (FILE *out, primary_t *primary)
 {
@@ -189,8 +249,9 @@ output_make_mathmap_filter_closure (FILE *out, const char *var_name,
     fprintf(out, "image->pixel_width = __canvasPixelW; image->pixel_height = __canvasPixelH;\n");
 }
 
+/* lhs is the value the rhs is assigned to, or NULL. */
 static void
-output_rhs (FILE *out, rhs_t *rhs)
+output_rhs (FILE *out, rhs_t *rhs, value_t *lhs)
 {
     switch (rhs->kind)
     {
@@ -200,6 +261,8 @@ output_rhs (FILE *out, rhs_t *rhs)
 
 	case RHS_INTERNAL :
 	    fputs(rhs->v.internal->name, out);
+	    if (lane_mode && strcmp(rhs->v.internal->name, "x") == 0)
+		fputs("[__lane]", out);
 	    /* fprintf(out, "invocation->internals[%d].data[0]", rhs->v.internal->index); */
 	    break;
 
@@ -271,7 +334,14 @@ output_rhs (FILE *out, rhs_t *rhs)
 	    {
 		int i;
 
-		fprintf(out, "({ float *tuple = ALLOC_TUPLE(%d); ", rhs->v.tuple.length);
+		if (is_local_tuple(lhs))
+		{
+		    fputs("({ float *tuple = ", out);
+		    output_value_base_name(out, lhs);
+		    fputs(lane_mode ? "_storage[__lane]; " : "_storage; ", out);
+		}
+		else
+		    fprintf(out, "({ float *tuple = ALLOC_TUPLE(%d); ", rhs->v.tuple.length);
 
 		for (i = 0; i < rhs->v.tuple.length; ++i)
 		{
@@ -305,6 +375,96 @@ output_rhs (FILE *out, rhs_t *rhs)
     }
 }
 
+/* Whether rhs can be computed for lanes which are not in the mask.
+   Their values might be garbage, so only arithmetic that can't trap
+   or dereference anything qualifies. */
+static gboolean
+rhs_is_speculable (rhs_t *rhs)
+{
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	case RHS_INTERNAL :
+	    return TRUE;
+
+	case RHS_OP :
+	    switch (compiler_op_index(rhs->v.op.op))
+	    {
+		case OP_INT_TO_FLOAT :
+		case OP_FLOAT_TO_INT :
+		case OP_ADD :
+		case OP_SUB :
+		case OP_NEG :
+		case OP_MUL :
+		case OP_DIV :
+		case OP_ABS :
+		case OP_MIN :
+		case OP_MAX :
+		case OP_FLOOR :
+		case OP_CEIL :
+		case OP_EQ :
+		case OP_LESS :
+		case OP_LEQ :
+		case OP_NOT :
+		    return TRUE;
+
+		default :
+		    return FALSE;
+	    }
+
+	default :
+	    return FALSE;
+    }
+}
+
+static void
+output_lane_loop (FILE *out)
+{
+    fputs("for (__lane = 0; __lane < __num_lanes; ++__lane)\n", out);
+    if (lane_mask >= 0)
+	fprintf(out, "if (__mask_%d[__lane])\n", lane_mask);
+}
+
+static void
+output_lane_assign (FILE *out, value_t *lhs, rhs_t *rhs)
+{
+    if (lane_mask >= 0 && rhs_is_speculable(rhs) && is_lane_value(lhs))
+    {
+	fputs("for (__lane = 0; __lane < __num_lanes; ++__lane)\n{\n__typeof__(", out);
+	output_value_name(out, lhs, 0);
+	fputs(") __value = ", out);
+	output_rhs(out, rhs, lhs);
+	fputs(";\n", out);
+	output_value_name(out, lhs, 0);
+	fprintf(out, " = __mask_%d[__lane] ? __value : ", lane_mask);
+	output_value_name(out, lhs, 0);
+	fputs(";\n}\n", out);
+    }
+    else
+    {
+	output_lane_loop(out);
+	output_value_name(out, lhs, 0);
+	fputs(" = ", out);
+	output_rhs(out, rhs, lhs);
+	fputs(";\n", out);
+    }
+}
+
+/* Sets the lanes of mask which are active in the current mask and
+   for which condition is true, or false if negate is set. */
+static void
+output_lane_mask (FILE *out, int mask, rhs_t *condition, gboolean negate)
+{
+    gboolean speculable = rhs_is_speculable(condition);
+
+    fprintf(out, "for (__lane = 0; __lane < __num_lanes; ++__lane)\n__mask_%d[__lane] = ", mask);
+    if (lane_mask >= 0)
+	fprintf(out, "__mask_%d[__lane] %s ", lane_mask, speculable ? "&" : "&&");
+    fputs(negate ? "!(" : "((", out);
+    output_rhs(out, condition, NULL);
+    fputs(negate ? ");\n" : ") != 0);\n", out);
+}
+
 static void
 output_phis (FILE *out, statement_t *phis, int branch, unsigned int slice_flag)
 {
@@ -328,9 +488,14 @@ output_phis (FILE *out, statement_t *phis, int branch, unsigned int slice_flag)
 	    || rhs->v.primary.kind != PRIMARY_VALUE
 	    || rhs->v.primary.v.value != phis->v.assign.lhs)
 	{
+	    if (lane_mode)
+	    {
+		output_lane_assign(out, phis->v.assign.lhs, rhs);
+		goto next;
+	    }
 	    output_value_name(out, phis->v.assign.lhs, 0);
 	    fputs(" = ", out);
-	    output_rhs(out, rhs);
+	    output_rhs(out, rhs, phis->v.assign.lhs);
 	    fputs(";\n", out);
 	}
 
@@ -339,6 +504,59 @@ output_phis (FILE *out, statement_t *phis, int branch, unsigned int slice_flag)
     }
 }
 
+static void output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag);
+
+/* Both branches are emitted one after the other, each masked by the
+   lanes that take it.  A branch no lane takes is skipped. */
+static void
+output_lane_if_cond (FILE *out, statement_t *stmt, unsigned int slice_flag)
+{
+    int outer_mask = lane_mask;
+    int consequent_mask = next_lane_mask++;
+    int alternative_mask = next_lane_mask++;
+
+    fprintf(out, "{\nint __mask_%d[MATHMAP_VECTOR_WIDTH], __mask_%d[MATHMAP_VECTOR_WIDTH];\n",
+	    consequent_mask, alternative_mask);
+    output_lane_mask(out, consequent_mask, stmt->v.if_cond.condition, FALSE);
+    output_lane_mask(out, alternative_mask, stmt->v.if_cond.condition, TRUE);
+
+    lane_mask = consequent_mask;
+    fprintf(out, "if (mathmap_any_lane(__mask_%d, __num_lanes))\n{\n", consequent_mask);
+    output_stmts(out, stmt->v.if_cond.consequent, slice_flag);
+    output_phis(out, stmt->v.if_cond.exit, 0, slice_flag);
+    fputs("}\n", out);
+
+    lane_mask = alternative_mask;
+    fprintf(out, "if (mathmap_any_lane(__mask_%d, __num_lanes))\n{\n", alternative_mask);
+    output_stmts(out, stmt->v.if_cond.alternative, slice_flag);
+    output_phis(out, stmt->v.if_cond.exit, 1, slice_flag);
+    fputs("}\n}\n", out);
+
+    lane_mask = outer_mask;
+}
+
+/* The loop runs until its condition is false for every lane.  A lane
+   drops out of the mask as soon as its condition becomes false, so
+   its values stay what they were when it left the loop. */
+static void
+output_lane_while_loop (FILE *out, statement_t *stmt, unsigned int slice_flag)
+{
+    int outer_mask = lane_mask;
+    int loop_mask = next_lane_mask++;
+
+    fprintf(out, "{\nint __mask_%d[MATHMAP_VECTOR_WIDTH];\n", loop_mask);
+    output_lane_mask(out, loop_mask, stmt->v.while_loop.invariant, FALSE);
+    fprintf(out, "while (mathmap_any_lane(__mask_%d, __num_lanes))\n{\n", loop_mask);
+
+    lane_mask = loop_mask;
+    output_stmts(out, stmt->v.while_loop.body, slice_flag);
+    output_phis(out, stmt->v.while_loop.entry, 1, slice_flag);
+    output_lane_mask(out, loop_mask, stmt->v.while_loop.invariant, FALSE);
+    fputs("}\n}\n", out);
+
+    lane_mask = outer_mask;
+}
+
 static void
 output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 {
@@ -356,9 +574,14 @@ output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 		    break;
 
 		case STMT_ASSIGN :
+		    if (lane_mode)
+		    {
+			output_lane_assign(out, stmt->v.assign.lhs, stmt->v.assign.rhs);
+			break;
+		    }
 		    output_value_name(out, stmt->v.assign.lhs, 0);
 		    fputs(" = ", out);
-		    output_rhs(out, stmt->v.assign.rhs);
+		    output_rhs(out, stmt->v.assign.rhs, stmt->v.assign.lhs);
 		    fputs(";\n", out);
 		    break;
 
@@ -367,8 +590,13 @@ output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 		    break;
 
 		case STMT_IF_COND :
+		    if (lane_mode)
+		    {
+			output_lane_if_cond(out, stmt, slice_flag);
+			break;
+		    }
 		    fputs("if (", out);
-		    output_rhs(out, stmt->v.if_cond.condition);
+		    output_rhs(out, stmt->v.if_cond.condition, NULL);
 		    fputs(")\n{\n", out);
 		    output_stmts(out, stmt->v.if_cond.consequent, slice_flag);
 		    output_phis(out, stmt->v.if_cond.exit, 0, slice_flag);
@@ -380,8 +608,13 @@ output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 
 		case STMT_WHILE_LOOP :
 		    output_phis(out, stmt->v.while_loop.entry, 0, slice_flag);
+		    if (lane_mode)
+		    {
+			output_lane_while_loop(out, stmt, slice_flag);
+			break;
+		    }
 		    fputs("while (", out);
-		    output_rhs(out, stmt->v.while_loop.invariant);
+		    output_rhs(out, stmt->v.while_loop.invariant, NULL);
 		    fputs(")\n{\n", out);
 		    output_stmts(out, stmt->v.while_loop.body, slice_flag);
 		    output_phis(out, stmt->v.while_loop.entry, 1, slice_flag);
@@ -401,18 +634,59 @@ _output_value_if_needed_decl (value_t *value, statement_t *stmt, void *info)
 {
     CLOSURE_VAR(FILE*, out, 0);
     CLOSURE_VAR(int, const_type, 1);
+    CLOSURE_VAR(gboolean, pointer, 2);
 
     if ((value->const_type | CONST_T) == (const_type | CONST_T)
 	&& compiler_is_permanent_const_value(value))
-	output_value_decl(out, value);
+	output_value_decl_full(out, value, pointer);
 }
 
 static void
-output_permanent_const_declarations (filter_code_t *code, FILE *out, int const_type)
+output_permanent_const_declarations (filter_code_t *code, FILE *out, int const_type, gboolean pointer)
 {
     compiler_reset_have_defined(code->first_stmt);
 
-    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_value_if_needed_decl, out, (void*)const_type);
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_value_if_needed_decl, out,
+					  (void*)const_type, (void*)pointer);
+}
+
+static void
+_output_y_const_value_setup (value_t *value, statement_t *stmt, void *info)
+{
+    CLOSURE_VAR(FILE*, out, 0);
+    CLOSURE_VAR(gboolean, alloc, 1);
+
+    if ((value->const_type | CONST_T) != (CONST_Y | CONST_T)
+	|| !compiler_is_permanent_const_value(value)
+	|| value->have_defined || value->index < 0)
+	return;
+
+    fputs("y_vars->", out);
+    output_value_name(out, value, 1);
+    if (alloc)
+    {
+	fputs(" = mathmap_pools_alloc(pools, sizeof(*y_vars->", out);
+	output_value_name(out, value, 1);
+	fputs(") * num_y_vars);\n", out);
+    }
+    else
+    {
+	fputs(" = &y_values.", out);
+	output_value_name(out, value, 1);
+	fputs(";\n", out);
+    }
+    value->have_defined = 1;
+}
+
+/* Points the column arrays of the y-const values in y_vars either to
+   new arrays of num_y_vars elements or to the single values in
+   y_values. */
+static void
+output_y_const_setup (filter_code_t *code, FILE *out, gboolean alloc)
+{
+    compiler_reset_have_defined(code->first_stmt);
+
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_y_const_value_setup, out, (void*)alloc);
 }
 
 static void
@@ -426,6 +700,32 @@ _output_value_if_needed_code (value_t *value, statement_t *stmt, void *info)
 	output_value_decl(out, value);
 }
 
+static void
+output_local_tuple_storage (FILE *out, statement_t *stmt, unsigned int slice_flag)
+{
+    for (; stmt != NULL; stmt = stmt->next)
+    {
+#ifndef NO_CONSTANTS_ANALYSIS
+	if ((stmt->slice_flags & slice_flag) == 0)
+	    continue;
+#endif
+
+	if (stmt->kind == STMT_ASSIGN && stmt->v.assign.rhs->kind == RHS_TUPLE
+	    && is_local_tuple(stmt->v.assign.lhs))
+	{
+	    fputs("float ", out);
+	    output_value_base_name(out, stmt->v.assign.lhs);
+	    fprintf(out, "_storage%s[%d];\n", lane_mode ? "[MATHMAP_VECTOR_WIDTH]" : "",
+		    stmt->v.assign.rhs->v.tuple.length);
+	}
+	else if (stmt->kind == STMT_IF_COND)
+	{
+	    output_local_tuple_storage(out, stmt->v.if_cond.consequent, slice_flag);
+	    output_local_tuple_storage(out, stmt->v.if_cond.alternative, slice_flag);
+	}
+    }
+}
+
 static void
 output_permanent_const_code (filter_code_t *code, FILE *out, int const_type)
 {
@@ -435,11 +735,143 @@ output_permanent_const_code (filter_code_t *code, FILE *out, int const_type)
     compiler_reset_have_defined(code->first_stmt);
     COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_value_if_needed_code, out, (void*)const_type);
 
-    /* code */
     compiler_slice_code_for_const(code->first_stmt, const_type);
+
+    /* Local tuples must live until the end of the pixel, so their
+       storage is declared at the top. */
+    if (local_tuples != NULL)
+	output_local_tuple_storage(out, code->first_stmt, slice_flag);
+
+    /* code */
     output_stmts(out, code->first_stmt, slice_flag);
 }
 
+/* Whether the per-pixel code might allocate from the pools, in which
+   case they have to be reset for every pixel. */
+static gboolean
+does_pixel_code_allocate (filter_code_t *code)
+{
+    unsigned int slice_flag = compiler_slice_flag_for_const_type(0);
+    value_set_t *tuples = compiler_opt_find_local_tuples(code->first_stmt, FALSE);
+    gboolean result;
+
+    compiler_slice_code_for_const(code->first_stmt, 0);
+    result = compiler_code_allocates(code->first_stmt, slice_flag, tuples);
+
+    compiler_free_value_set(tuples);
+
+    return result;
+}
+
+static gboolean
+rhs_is_vectorizable (rhs_t *rhs)
+{
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	case RHS_INTERNAL :
+	case RHS_TUPLE :
+	    return TRUE;
+
+	case RHS_OP :
+	    /* OUTPUT_TUPLE only sets the lane's return tuple. */
+	    return rhs->v.op.op->is_pure || rhs->v.op.op->index == OP_OUTPUT_TUPLE;
+
+	default :
+	    return FALSE;
+    }
+}
+
+/* Within if and while, where not all lanes might be executing, every
+   assigned value must have its own element for each lane. */
+static gboolean
+is_assign_vectorizable (value_t *lhs, rhs_t *rhs, gboolean masked)
+{
+#ifndef NO_CONSTANTS_ANALYSIS
+    if (masked && compiler_is_permanent_const_value(lhs))
+	return FALSE;
+#endif
+    return rhs_is_vectorizable(rhs);
+}
+
+static gboolean
+are_phis_vectorizable (statement_t *phis, unsigned int slice_flag)
+{
+    for (; phis != 0; phis = phis->next)
+    {
+	if (phis->kind == STMT_NIL)
+	    continue;
+#ifndef NO_CONSTANTS_ANALYSIS
+	if ((phis->slice_flags & slice_flag) == 0)
+	    continue;
+#endif
+
+	if (!is_assign_vectorizable(phis->v.assign.lhs, phis->v.assign.rhs, TRUE)
+	    || !is_assign_vectorizable(phis->v.assign.lhs, phis->v.assign.rhs2, TRUE))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+are_stmts_vectorizable (statement_t *stmt, unsigned int slice_flag, gboolean masked)
+{
+    for (; stmt != 0; stmt = stmt->next)
+    {
+#ifndef NO_CONSTANTS_ANALYSIS
+	if ((stmt->slice_flags & slice_flag) == 0)
+	    continue;
+#endif
+
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		if (!is_assign_vectorizable(stmt->v.assign.lhs, stmt->v.assign.rhs, masked))
+		    return FALSE;
+		break;
+
+	    case STMT_IF_COND :
+		if (!rhs_is_vectorizable(stmt->v.if_cond.condition)
+		    || !are_stmts_vectorizable(stmt->v.if_cond.consequent, slice_flag, TRUE)
+		    || !are_stmts_vectorizable(stmt->v.if_cond.alternative, slice_flag, TRUE)
+		    || !are_phis_vectorizable(stmt->v.if_cond.exit, slice_flag))
+		    return FALSE;
+		break;
+
+	    case STMT_WHILE_LOOP :
+		if (!rhs_is_vectorizable(stmt->v.while_loop.invariant)
+		    || !are_phis_vectorizable(stmt->v.while_loop.entry, slice_flag)
+		    || !are_stmts_vectorizable(stmt->v.while_loop.body, slice_flag, TRUE))
+		    return FALSE;
+		break;
+
+	    default :
+		return FALSE;
+	}
+    }
+
+    return TRUE;
+}
+
+/* Control flow is emitted with masks, see lane_mask. */
+static gboolean
+is_non_const_code_vectorizable (filter_code_t *code)
+{
+#ifdef NO_VECTORIZED_PIXEL_LOOP
+    return FALSE;
+#else
+    unsigned int slice_flag = compiler_slice_flag_for_const_type(0);
+
+    compiler_slice_code_for_const(code->first_stmt, 0);
+
+    return are_stmts_vectorizable(code->first_stmt, slice_flag, FALSE);
+#endif
+}
+
 static void
 output_all_code (filter_code_t *code, FILE *out)
 {
@@ -475,24 +907,65 @@ filter_template_processor (mathmap_t *mathmap, const char *directive, const char
     }
     else if (strcmp(directive, "name") == 0)
 	fputs(code->filter->name, out);
-    else if (strcmp(directive, "m") == 0)
+    else if (strcmp(directive, "m") == 0 || strcmp(directive, "pixel_m") == 0)
+    {
+	/* With $pixel_m the output tuple is used within the pixel's
+	   block. */
+	local_tuples = compiler_opt_find_local_tuples(code->first_stmt, strcmp(directive, "m") == 0);
 	output_permanent_const_code(code, out, 0);
+	compiler_free_value_set(local_tuples);
+	local_tuples = NULL;
+    }
+    else if (strcmp(directive, "vectorizable") == 0)
+	putc(is_non_const_code_vectorizable(code) ? '1' : '0', out);
+    else if (strcmp(directive, "pixel_allocates") == 0)
+	putc(does_pixel_code_allocate(code) ? '1' : '0', out);
+    else if (strcmp(directive, "vector_m") == 0)
+    {
+	if (is_non_const_code_vectorizable(code))
+	{
+	    lane_mode = TRUE;
+	    local_tuples = compiler_opt_find_local_tuples(code->first_stmt, FALSE);
+	    output_permanent_const_code(code, out, 0);
+	    compiler_free_value_set(local_tuples);
+	    local_tuples = NULL;
+	    lane_mode = FALSE;
+	}
+    }
     else if (strcmp(directive, "xy_decls") == 0)
     {
 #ifndef NO_CONSTANTS_ANALYSIS
-	output_permanent_const_declarations(code, out, CONST_X | CONST_Y);
+	output_permanent_const_declarations(code, out, CONST_X | CONST_Y, FALSE);
 #endif
     }
     else if (strcmp(directive, "x_decls") == 0)
     {
 #ifndef NO_CONSTANTS_ANALYSIS
-	output_permanent_const_declarations(code, out, CONST_X);
+	output_permanent_const_declarations(code, out, CONST_X, FALSE);
 #endif
     }
     else if (strcmp(directive, "y_decls") == 0)
     {
 #ifndef NO_CONSTANTS_ANALYSIS
-	output_permanent_const_declarations(code, out, CONST_Y);
+	output_permanent_const_declarations(code, out, CONST_Y, TRUE);
+#endif
+    }
+    else if (strcmp(directive, "y_value_decls") == 0)
+    {
+#ifndef NO_CONSTANTS_ANALYSIS
+	output_permanent_const_declarations(code, out, CONST_Y, FALSE);
+#endif
+    }
+    else if (strcmp(directive, "y_alloc") == 0)
+    {
+#ifndef NO_CONSTANTS_ANALYSIS
+	output_y_const_setup(code, out, TRUE);
+#endif
+    }
+    else if (strcmp(directive, "y_bind") == 0)
+    {
+#ifndef NO_CONSTANTS_ANALYSIS
+	output_y_const_setup(code, out, FALSE);
 #endif
     }
     else if (strcmp(directive, "xy_code") == 0)
@@ -631,14 +1104,232 @@ exec_cmd (char *log_filename, char *format, ...)
 
 #define TMP_PREFIX		"/tmp/mathfunc"
 
+/* Compiled modules are kept in a cache directory, named by a hash of
+   the generated C code, the headers it includes, the compiler commands
+   and the MathMap version.  The directory can be set with
+   MATHMAP_MODULE_CACHE.  Setting it to the empty string disables the
+   cache.  Whenever a module is added, the least recently used ones are
+   removed until the cache is no larger than MODULE_CACHE_MAX_SIZE. */
+#define MODULE_CACHE_ENV	"MATHMAP_MODULE_CACHE"
+#define MODULE_CACHE_MAX_SIZE	(64 * 1024 * 1024)
+
+/* If the compiler can produce a loadable module directly we save
+   spawning the linker and writing the object file.  We still spawn
+   the compiler itself, though - compiling in-process needs the LLVM
+   backend ported to ORC (see the TODO file). */
+#ifdef CGEN_CC_LD
+#define CGEN_COMMANDS		CGEN_CC_LD
+#else
+#define CGEN_COMMANDS		CGEN_CC "\n" CGEN_LD
+#endif
+
+static char*
+module_cache_dir (void)
+{
+    const char *dir = g_getenv(MODULE_CACHE_ENV);
+
+    if (dir != NULL)
+    {
+	if (dir[0] == '\0')
+	    return NULL;
+	return g_strdup(dir);
+    }
+
+    return g_build_filename(g_get_user_cache_dir(), "mathmap", "modules", NULL);
+}
+
+#ifndef OPENSTEP
+/* Adds the names and contents of the files included with quotes by
+   the file with the given contents to the checksum, and so on for
+   their includes.  System headers are covered by the compiler
+   commands. */
+static void
+checksum_includes (GChecksum *checksum, const char *filename, const char *contents, GHashTable *seen)
+{
+    char *dir = g_path_get_dirname(filename);
+    const char *line, *next;
+
+    for (line = contents; line != NULL; line = next)
+    {
+	const char *newline = strchr(line, '\n');
+	const char *p = line, *end;
+	char *name, *include_filename, *include_contents;
+
+	next = newline != NULL ? newline + 1 : NULL;
+
+	while (*p == ' ' || *p == '\t')
+	    ++p;
+	if (*p++ != '#')
+	    continue;
+	while (*p == ' ' || *p == '\t')
+	    ++p;
+	if (strncmp(p, "include", 7) != 0)
+	    continue;
+	p += 7;
+	while (*p == ' ' || *p == '\t')
+	    ++p;
+	if (*p++ != '"' || (end = strchr(p, '"')) == NULL || (newline != NULL && end > newline))
+	    continue;
+
+	name = g_strndup(p, end - p);
+	if (g_path_is_absolute(name))
+	    include_filename = g_strdup(name);
+	else
+	{
+	    include_filename = g_build_filename(dir, name, NULL);
+	    if (!g_file_test(include_filename, G_FILE_TEST_EXISTS))
+	    {
+		g_free(include_filename);
+		include_filename = g_strdup(name);
+	    }
+	}
+	g_free(name);
+
+	if (g_hash_table_lookup(seen, include_filename) != NULL)
+	{
+	    g_free(include_filename);
+	    continue;
+	}
+	g_hash_table_insert(seen, include_filename, include_filename);
+
+	g_checksum_update(checksum, (const guchar*)include_filename, strlen(include_filename) + 1);
+	if (g_file_get_contents(include_filename, &include_contents, NULL, NULL))
+	{
+	    g_checksum_update(checksum, (const guchar*)include_contents, -1);
+	    checksum_includes(checksum, include_filename, include_contents, seen);
+	    g_free(include_contents);
+	}
+    }
+
+    g_free(dir);
+}
+
+typedef struct
+{
+    char *filename;
+    time_t mtime;
+    off_t size;
+} cached_module_t;
+
+static gint
+compare_cached_modules (gconstpointer a, gconstpointer b)
+{
+    time_t mtime_a = ((const cached_module_t*)a)->mtime;
+    time_t mtime_b = ((const cached_module_t*)b)->mtime;
+
+    return mtime_a < mtime_b ? -1 : (mtime_a > mtime_b ? 1 : 0);
+}
+
+/* Loading a module from the cache touches it, so the modules with the
+   oldest modification times are the least recently used. */
+static void
+trim_module_cache (const char *dir)
+{
+    GDir *gdir = g_dir_open(dir, 0, NULL);
+    GSList *modules = NULL, *l;
+    const char *name;
+    off_t total_size = 0;
+
+    if (gdir == NULL)
+	return;
+
+    while ((name = g_dir_read_name(gdir)) != NULL)
+    {
+	cached_module_t *module;
+	struct stat buf;
+	char *filename;
+
+	if (!g_str_has_suffix(name, ".so"))
+	    continue;
+
+	filename = g_build_filename(dir, name, NULL);
+	if (stat(filename, &buf) != 0)
+	{
+	    g_free(filename);
+	    continue;
+	}
+
+	module = g_new(cached_module_t, 1);
+	module->filename = filename;
+	module->mtime = buf.st_mtime;
+	module->size = buf.st_size;
+	modules = g_slist_prepend(modules, module);
+
+	total_size += buf.st_size;
+    }
+    g_dir_close(gdir);
+
+    modules = g_slist_sort(modules, compare_cached_modules);
+    for (l = modules; l != NULL; l = l->next)
+    {
+	cached_module_t *module = (cached_module_t*)l->data;
+
+	/* Processes which have the module loaded keep it. */
+	if (total_size > MODULE_CACHE_MAX_SIZE && unlink(module->filename) == 0)
+	    total_size -= module->size;
+
+	g_free(module->filename);
+	g_free(module);
+    }
+    g_slist_free(modules);
+}
+#endif
+
+static char*
+module_cache_filename (const char *c_filename)
+{
+#ifndef OPENSTEP
+    char *dir = module_cache_dir();
+    char *contents, *basename, *filename;
+    gsize length;
+    GChecksum *checksum;
+    GHashTable *seen;
+
+    if (dir == NULL)
+	return NULL;
+
+    if (g_mkdir_with_parents(dir, 0755) != 0
+	|| !g_file_get_contents(c_filename, &contents, &length, NULL))
+    {
+	g_free(dir);
+	return NULL;
+    }
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(checksum, (const guchar*)contents, length);
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    checksum_includes(checksum, c_filename, contents, seen);
+    g_hash_table_destroy(seen);
+
+    g_checksum_update(checksum, (const guchar*)("\n" CGEN_COMMANDS "\n" MATHMAP_VERSION), -1);
+
+    basename = g_strdup_printf("%s.so", g_checksum_get_string(checksum));
+    filename = g_build_filename(dir, basename, NULL);
+
+    g_checksum_free(checksum);
+    g_free(basename);
+    g_free(contents);
+    g_free(dir);
+
+    return filename;
+#else
+    /* We don't cache bundles. */
+    return NULL;
+#endif
+}
+
 initfunc_t
 gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_filename, char *include_path,
 		     filter_code_t **the_filter_codes)
 {
+    /* Like the other globals of the backend, this is only used under
+       the compiler lock, see lock_mathmap_compiler(). */
     static int last_mathfunc = 0;
 
     FILE *out;
-    char *c_filename, *o_filename, *so_filename, *log_filename;
+    char *c_filename, *o_filename = NULL, *so_filename, *log_filename, *cache_filename;
+    gboolean is_cached;
     int pid = getpid();
     initfunc_t initfunc;
 #ifndef OPENSTEP
@@ -667,28 +1358,70 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
 
     fclose(out);
 
-    o_filename = g_strdup_printf("%s%d_%d.o", TMP_PREFIX, pid, last_mathfunc);
     log_filename = g_strdup_printf("%s%d_%d.log", TMP_PREFIX, pid, last_mathfunc);
+    cache_filename = module_cache_filename(c_filename);
 
-    if (exec_cmd(log_filename, "%s %s %s", CGEN_CC, o_filename, c_filename) != 0)
+    if (cache_filename != NULL && g_file_test(cache_filename, G_FILE_TEST_EXISTS))
     {
-	sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
-	return 0;
+	so_filename = g_strdup(cache_filename);
+	utime(cache_filename, NULL);
     }
+    else
+    {
+	/* We link into the cache directory under a temporary name and
+	   then rename, so other processes never see a partially
+	   written module. */
+	if (cache_filename != NULL)
+	    so_filename = g_strdup_printf("%s.%d", cache_filename, pid);
+	else
+	    so_filename = g_strdup_printf("%s%d_%d.so", TMP_PREFIX, pid, last_mathfunc);
 
-    so_filename = g_strdup_printf("%s%d_%d.so", TMP_PREFIX, pid, last_mathfunc);
+#ifdef CGEN_CC_LD
+	if (exec_cmd(log_filename, "%s %s %s", CGEN_CC_LD, so_filename, c_filename) != 0)
+	{
+	    sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
+	    return 0;
+	}
+#else
+	o_filename = g_strdup_printf("%s%d_%d.o", TMP_PREFIX, pid, last_mathfunc);
 
-    if (exec_cmd(log_filename, "%s %s %s", CGEN_LD, so_filename, o_filename) != 0)
-    {
-	sprintf(error_string, _("Linker failed.  See logfile `%s'."), log_filename);
-	return 0;
+	if (exec_cmd(log_filename, "%s %s %s", CGEN_CC, o_filename, c_filename) != 0)
+	{
+	    sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
+	    return 0;
+	}
+
+	if (exec_cmd(log_filename, "%s %s %s", CGEN_LD, so_filename, o_filename) != 0)
+	{
+	    sprintf(error_string, _("Linker failed.  See logfile `%s'."), log_filename);
+	    return 0;
+	}
+#endif
+
+	if (cache_filename != NULL && rename(so_filename, cache_filename) == 0)
+	{
+	    char *dir = g_path_get_dirname(cache_filename);
+
+	    g_free(so_filename);
+	    so_filename = g_strdup(cache_filename);
+
+#ifndef OPENSTEP
+	    trim_module_cache(dir);
+#endif
+	    g_free(dir);
+	}
     }
 
+    is_cached = cache_filename != NULL && strcmp(so_filename, cache_filename) == 0;
+
 #ifndef OPENSTEP
     module = g_module_open(so_filename, 0);
     if (module == 0)
     {
 	sprintf(error_string, _("Could not load module `%s': %s."), so_filename, g_module_error());
+	/* Don't keep a broken module around in the cache. */
+	if (is_cached)
+	    unlink(so_filename);
 	return 0;
     }
 
@@ -739,12 +1472,17 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
 #endif
 
 #ifndef DONT_UNLINK_SO
-    unlink(so_filename);
+    if (!is_cached)
+	unlink(so_filename);
 #endif
     g_free(so_filename);
+    g_free(cache_filename);
 
-    unlink(o_filename);
-    g_free(o_filename);
+    if (o_filename != NULL)
+    {
+	unlink(o_filename);
+	g_free(o_filename);
+    }
 
 #ifndef DONT_UNLINK_C
     unlink(c_filename);
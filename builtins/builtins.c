@@ -160,88 +160,112 @@ get_orig_val_pixel (mathmap_invocation_t *invocation, float x, float y, image_t
     return get_pixel(invocation, floor(x), floor(y), drawable, frame);
 }
 
-CALLBACK_SYMBOL
-color_t
-get_orig_val_intersample_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame)
+typedef float float4_t __attribute__ ((vector_size (16)));
+
+static inline float4_t
+color_to_float4 (color_t c)
 {
-    int x1,
-	x2,
-	y1,
-	y2;
-    float x2fact,
-	y2fact,
-	x1fact,
-	y1fact,
-	p1fact,
-	p2fact,
-	p3fact,
-	p4fact;
-    color_t pixel1, pixel2, pixel3, pixel4, result;
-    float_color_t fpixel1, fpixel2, fpixel3, fpixel4, fresult;
-    input_drawable_t *drawable = get_image_drawable(invocation, image, &x, &y);
-    int pixel_inc_x, pixel_inc_y;
+    return (float4_t){ RED(c), GREEN(c), BLUE(c), ALPHA(c) };
+}
 
-    drawable_get_pixel_inc(invocation, drawable, &pixel_inc_x, &pixel_inc_y);
+static inline float4_t
+float4_splat (float f)
+{
+    return (float4_t){ f, f, f, f };
+}
 
-    if (pixel_inc_x > 1)
+static inline void
+intersample_coords (float x, int pixel_inc, int *x1, int *x2, float *x2fact)
+{
+    if (pixel_inc > 1)
     {
-	x -= pixel_inc_x / 2.0;
+	x -= pixel_inc / 2.0;
 
-	x1 = floor(x / pixel_inc_x) * pixel_inc_x;
-	x2 = x1 + pixel_inc_x;
+	*x1 = floor(x / pixel_inc) * pixel_inc;
+	*x2 = *x1 + pixel_inc;
 
-	x2fact = (x - x1) / pixel_inc_x;
+	*x2fact = (x - *x1) / pixel_inc;
     }
     else
     {
-	x1 = floor(x);
-	x2 = x1 + 1;
+	*x1 = floor(x);
+	*x2 = *x1 + 1;
 
-	x2fact = x - x1;
+	*x2fact = x - *x1;
     }
+}
 
-    if (pixel_inc_y > 1)
-    {
-	y -= pixel_inc_y / 2.0;
+/* x and y must already be in drawable coordinates. */
+static color_t
+intersample_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+		   int pixel_inc_x, int pixel_inc_y, float x, float y)
+{
+    int x1, x2, y1, y2;
+    float x1fact, x2fact, y1fact, y2fact;
+    color_t pixels[4];
+    float4_t fresult;
 
-	y1 = floor(y / pixel_inc_y) * pixel_inc_y;
-	y2 = y1 + pixel_inc_y;
+    intersample_coords(x, pixel_inc_x, &x1, &x2, &x2fact);
+    intersample_coords(y, pixel_inc_y, &y1, &y2, &y2fact);
 
-	y2fact = (y - y1) / pixel_inc_y;
-    }
+    x1fact = 1.0 - x2fact;
+    y1fact = 1.0 - y2fact;
+
+    /* Edge behaviour only matters if the quad isn't completely inside
+       the image, so we check that once instead of for every pixel. */
+    if (drawable != NULL
+	&& x1 >= 0 && x2 < drawable->image.pixel_width
+	&& y1 >= 0 && y2 < drawable->image.pixel_height)
+	mathmap_get_pixel_quad(invocation, drawable, frame, x1, y1, x2, y2, pixels);
     else
     {
-	y1 = floor(y);
-	y2 = y1 + 1;
-
-	y2fact = y - y1;
+	pixels[0] = get_pixel(invocation, x1, y1, drawable, frame);
+	pixels[1] = get_pixel(invocation, x1, y2, drawable, frame);
+	pixels[2] = get_pixel(invocation, x2, y1, drawable, frame);
+	pixels[3] = get_pixel(invocation, x2, y2, drawable, frame);
     }
 
-    x1fact = 1.0 - x2fact;
-    y1fact = 1.0 - y2fact;
+    fresult = color_to_float4(pixels[0]) * float4_splat(x1fact * y1fact)
+	+ color_to_float4(pixels[1]) * float4_splat(x1fact * y2fact)
+	+ color_to_float4(pixels[2]) * float4_splat(x2fact * y1fact)
+	+ color_to_float4(pixels[3]) * float4_splat(x2fact * y2fact);
+
+    return MAKE_RGBA_COLOR(rintf(fresult[0]), rintf(fresult[1]), rintf(fresult[2]), rintf(fresult[3]));
+}
+
+CALLBACK_SYMBOL
+color_t
+get_orig_val_intersample_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame)
+{
+    input_drawable_t *drawable = get_image_drawable(invocation, image, &x, &y);
+    int pixel_inc_x, pixel_inc_y;
 
-    p1fact = x1fact * y1fact;
-    p2fact = x1fact * y2fact;
-    p3fact = x2fact * y1fact;
-    p4fact = x2fact * y2fact;
+    drawable_get_pixel_inc(invocation, drawable, &pixel_inc_x, &pixel_inc_y);
+
+    return intersample_pixel(invocation, drawable, frame, pixel_inc_x, pixel_inc_y, x, y);
+}
 
-    pixel1 = get_pixel(invocation, x1, y1, drawable, frame);
-    pixel2 = get_pixel(invocation, x1, y2, drawable, frame);
-    pixel3 = get_pixel(invocation, x2, y1, drawable, frame);
-    pixel4 = get_pixel(invocation, x2, y2, drawable, frame);
+CALLBACK_SYMBOL
+void
+get_orig_val_intersample_row (mathmap_invocation_t *invocation, const float *xs, const float *ys, int n,
+			      image_t *image, int frame, color_t *colors)
+{
+    input_drawable_t *drawable;
+    int pixel_inc_x, pixel_inc_y;
+    int i;
 
-    fpixel1 = COLOR_MUL_FLOAT(pixel1, p1fact);
-    fpixel2 = COLOR_MUL_FLOAT(pixel2, p2fact);
-    fpixel3 = COLOR_MUL_FLOAT(pixel3, p3fact);
-    fpixel4 = COLOR_MUL_FLOAT(pixel4, p4fact);
+    g_assert(image->type == IMAGE_DRAWABLE);
 
-    fresult = FLOAT_COLOR_ADD(fpixel1, fpixel2);
-    fresult = FLOAT_COLOR_ADD(fresult, fpixel3);
-    fresult = FLOAT_COLOR_ADD(fresult, fpixel4);
+    drawable = image->v.drawable;
+    drawable_get_pixel_inc(invocation, drawable, &pixel_inc_x, &pixel_inc_y);
 
-    result = FLOAT_COLOR_TO_COLOR(fresult);
+    for (i = 0; i < n; ++i)
+    {
+	float x = xs[i], y = ys[i];
 
-    return result;
+	get_image_drawable(invocation, image, &x, &y);
+	colors[i] = intersample_pixel(invocation, drawable, frame, pixel_inc_x, pixel_inc_y, x, y);
+    }
 }
 
 CALLBACK_SYMBOL
@@ -264,11 +288,85 @@ get_floatmap_pixel (mathmap_invocation_t *invocation, image_t *image, float x, f
     return image->v.floatmap.data + (iy * image->pixel_width + ix) * 4;
 }
 
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    image_t *image;
+    image_t *new_image;
+    mathmap_frame_t *frame;	/* only for closures */
+    int width, height;
+    int tile_height;
+} render_image_job_t;
+
+static void
+render_closure_tile (parallel_job_t *job, int tile)
+{
+    render_image_job_t *data = (render_image_job_t*)job->data;
+    int first_row = tile * data->tile_height;
+    int last_row = MIN(first_row + data->tile_height, data->height);
+    mathmap_slice_t slice;
+
+    invocation_init_slice(&slice, data->image, data->frame, 0, 0, data->width, data->height, 0.0, 0.0);
+
+    data->image->v.closure.funcs->calc_lines(&slice, data->image, first_row, last_row,
+					     data->new_image->v.floatmap.data + first_row * data->width * 4, 1);
+
+    invocation_deinit_slice(&slice);
+}
+
+static void
+render_orig_val_tile (parallel_job_t *job, int tile)
+{
+    render_image_job_t *data = (render_image_job_t*)job->data;
+    mathmap_invocation_t *invocation = data->invocation;
+    image_t *image = data->image;
+    image_t *new_image = data->new_image;
+    int first_row = tile * data->tile_height;
+    int last_row = MIN(first_row + data->tile_height, data->height);
+    float ax, bx, ay, by;
+    color_t (*get_orig_val_pixel_func) (mathmap_invocation_t*, float, float, image_t*, int) = get_orig_val_pixel;
+    int x, y;
+    float *p;
+    mathmap_pools_t filter_pools;
+    mathmap_pools_t *pools;
+
+    ax = new_image->v.floatmap.ax;
+    bx = new_image->v.floatmap.bx;
+    ay = new_image->v.floatmap.ay;
+    by = new_image->v.floatmap.by;
+
+    mathmap_pools_init_local(&filter_pools);
+    pools = &filter_pools;
+
+    p = new_image->v.floatmap.data + first_row * data->width * 4;
+    for (y = first_row; y < last_row; ++y)
+    {
+	float fy = ((float)y - by) / ay;
+
+	for (x = 0; x < data->width; ++x)
+	{
+	    float fx = ((float)x - bx) / ax;
+	    float *tuple;
+
+	    mathmap_pools_reset(&filter_pools);
+	    tuple = ORIG_VAL(fx, fy, image, 0.0);
+
+	    memcpy(p, tuple, sizeof(float) * 4);
+
+	    p += 4;
+	}
+    }
+
+    mathmap_pools_free(&filter_pools);
+}
+
 CALLBACK_SYMBOL
 image_t*
 render_image (mathmap_invocation_t *invocation, image_t *image, int width, int height, mathmap_pools_t *pools, int force)
 {
     image_t *new_image;
+    render_image_job_t data;
+    parallel_job_t job;
 
     if (!force && image->type == IMAGE_FLOATMAP)
 	return image;
@@ -279,67 +377,40 @@ render_image (mathmap_invocation_t *invocation, image_t *image, int width, int h
     g_print("rendering %dx%d\n", width, height);
 #endif
 
+    data.invocation = invocation;
+    data.image = image;
+    data.new_image = new_image;
+    data.frame = NULL;
+    data.width = width;
+    data.height = height;
+    data.tile_height = MAX(1, invocation->tile_height);
+
+    job.data = &data;
+    job.num_tiles = (height + data.tile_height - 1) / data.tile_height;
+
     if (image->type == IMAGE_CLOSURE)
     {
-	mathmap_frame_t *frame;
-	mathmap_slice_t slice;
-
 #ifdef DEBUG_OUTPUT
 	g_print("image is closure\n");
 #endif
 
-	frame = invocation_new_frame(invocation, image, 0, 0.0);
-	frame->frame_render_width = width;
-	frame->frame_render_height = height;
-
-	invocation_init_slice(&slice, image, frame, 0, 0, width, height, 0.0, 0.0);
-
-	image->v.closure.funcs->calc_lines(&slice, image, 0, height, new_image->v.floatmap.data, 1);
+	data.frame = invocation_new_frame(invocation, image, 0, 0.0);
+	data.frame->frame_render_width = width;
+	data.frame->frame_render_height = height;
 
-	invocation_deinit_slice(&slice);
+	job.func = render_closure_tile;
+	invocation_run_parallel_job(invocation, &job);
 
-	invocation_free_frame(frame);
+	invocation_free_frame(data.frame);
     }
     else
     {
-	float ax, bx, ay, by;
-	color_t (*get_orig_val_pixel_func) (mathmap_invocation_t*, float, float, image_t*, int) = get_orig_val_pixel;
-	int x, y;
-	float *p;
-	mathmap_pools_t filter_pools;
-
 #ifdef DEBUG_OUTPUT
 	g_print("image is not closure: %d\n", image->type);
 #endif
 
-	ax = new_image->v.floatmap.ax;
-	bx = new_image->v.floatmap.bx;
-	ay = new_image->v.floatmap.ay;
-	by = new_image->v.floatmap.by;
-
-	mathmap_pools_init_local(&filter_pools);
-	pools = &filter_pools;
-
-	p = new_image->v.floatmap.data;
-	for (y = 0; y < height; ++y)
-	{
-	    float fy = ((float)y - by) / ay;
-
-	    for (x = 0; x < width; ++x)
-	    {
-		float fx = ((float)x - bx) / ax;
-		float *tuple;
-
-		mathmap_pools_reset(&filter_pools);
-		tuple = ORIG_VAL(fx, fy, image, 0.0);
-
-		memcpy(p, tuple, sizeof(float) * 4);
-
-		p += 4;
-	    }
-	}
-
-	mathmap_pools_free(&filter_pools);
+	job.func = render_orig_val_tile;
+	invocation_run_parallel_job(invocation, &job);
     }
 
     return new_image;
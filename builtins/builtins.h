@@ -41,6 +41,8 @@ typedef void (*generator_function_t) (struct _filter_t*, struct _compvar_t***, i
 /* TEMPLATE builtins */
 color_t get_orig_val_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image, int frame);
 color_t get_orig_val_intersample_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image, int frame);
+void get_orig_val_intersample_row (struct _mathmap_invocation_t *invocation, const float *xs, const float *ys, int n,
+				   struct _image_t *image, int frame, color_t *colors);
 
 float* get_floatmap_pixel (struct _mathmap_invocation_t *invocation, struct _image_t *image, float x, float y, float frame);
 
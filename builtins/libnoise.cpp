@@ -20,6 +20,7 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <math.h>
 #include <noise.h>
 
 #include "../mathmap.h"
@@ -28,18 +29,408 @@
 
 using namespace noise;
 
+namespace noise
+{
+    extern double g_randomVectors[256 * 4];
+}
+
+/* TRUE if the noise builtins use the float engine below instead of
+   libnoise. */
+static volatile int use_fast_noise = 0;
+
+void
+libnoise_set_fast_noise (int fast)
+{
+    use_fast_noise = fast;
+}
+
+/* A float version of libnoise's gradient noise at QUALITY_BESTEST and
+   of its Voronoi cells.  Lattice hashes and gradient dot products are
+   computed four lanes at a time.  Results differ from libnoise only by
+   float rounding, which matters for large coordinates, and in that the
+   value noise hash doesn't depend on how signed overflow is
+   compiled. */
+
+typedef float fnoise_vec_t __attribute__ ((vector_size (16)));
+typedef int fnoise_ivec_t __attribute__ ((vector_size (16)));
+typedef unsigned int fnoise_uvec_t __attribute__ ((vector_size (16)));
+
+#define X_NOISE_GEN		1619
+#define Y_NOISE_GEN		31337
+#define Z_NOISE_GEN		6971
+#define SEED_NOISE_GEN		1013
+
+/* 5x5x5 Voronoi candidates, padded to a multiple of four. */
+#define NUM_VORONOI_CANDIDATES	128
+
+static struct fnoise_tables
+{
+    /* libnoise's gradient vectors, as floats. */
+    fnoise_vec_t gradients[256];
+
+    /* Lattice offsets of the Voronoi candidates in libnoise's order,
+       and their contribution to the hash. */
+    fnoise_vec_t candidate_x[NUM_VORONOI_CANDIDATES / 4];
+    fnoise_vec_t candidate_y[NUM_VORONOI_CANDIDATES / 4];
+    fnoise_vec_t candidate_z[NUM_VORONOI_CANDIDATES / 4];
+    fnoise_uvec_t candidate_hash[NUM_VORONOI_CANDIDATES / 4];
+
+    fnoise_tables ()
+    {
+	int i;
+
+	for (i = 0; i < 256; ++i)
+	{
+	    fnoise_vec_t g = { (float)noise::g_randomVectors[i * 4], (float)noise::g_randomVectors[i * 4 + 1],
+			       (float)noise::g_randomVectors[i * 4 + 2], 0.0f };
+
+	    gradients[i] = g;
+	}
+
+	for (i = 0; i < NUM_VORONOI_CANDIDATES; ++i)
+	{
+	    /* The padding lanes are far away, so they never win. */
+	    int dx = i < 125 ? i % 5 - 2 : 1000;
+	    int dy = i < 125 ? i / 5 % 5 - 2 : 1000;
+	    int dz = i < 125 ? i / 25 - 2 : 1000;
+
+	    candidate_x[i / 4][i % 4] = (float)dx;
+	    candidate_y[i / 4][i % 4] = (float)dy;
+	    candidate_z[i / 4][i % 4] = (float)dz;
+	    candidate_hash[i / 4][i % 4] = (unsigned int)dx * X_NOISE_GEN + (unsigned int)dy * Y_NOISE_GEN
+		+ (unsigned int)dz * Z_NOISE_GEN;
+	}
+    }
+} fnoise_tables;
+
+static inline fnoise_vec_t
+fnoise_splat (float f)
+{
+    fnoise_vec_t v = { f, f, f, f };
+    return v;
+}
+
+static inline fnoise_uvec_t
+fnoise_usplat (unsigned int u)
+{
+    fnoise_uvec_t v = { u, u, u, u };
+    return v;
+}
+
+static inline int
+fnoise_floor (float x)
+{
+    return x > 0.0f ? (int)x : (int)x - 1;
+}
+
+static inline float
+fnoise_int32_range (float n)
+{
+    if (n >= 1073741824.0f)
+	return 2.0f * fmodf(n, 1073741824.0f) - 1073741824.0f;
+    else if (n <= -1073741824.0f)
+	return 2.0f * fmodf(n, 1073741824.0f) + 1073741824.0f;
+    return n;
+}
+
+static inline float
+fnoise_scurve7 (float a)
+{
+    float a2 = a * a;
+    float a4 = a2 * a2;
+    float a5 = a4 * a;
+    float a6 = a4 * a2;
+    float a7 = a5 * a2;
+
+    return -20.0f * a7 + 70.0f * a6 - 84.0f * a5 + 35.0f * a4;
+}
+
+static inline float
+fnoise_lerp (float n0, float n1, float a)
+{
+    return n0 + a * (n1 - n0);
+}
+
+/* Gradient noise of the four corners of one z face of a lattice cell,
+   lane i being the corner at offset (i & 1, i >> 1).  hash is
+   libnoise's unmasked vector index of corner 0. */
+static inline fnoise_vec_t
+fnoise_gradient_face (unsigned int hash, float fx, float fy, float fz)
+{
+    static const fnoise_uvec_t corner_hash = { 0, X_NOISE_GEN, Y_NOISE_GEN, X_NOISE_GEN + Y_NOISE_GEN };
+    static const fnoise_vec_t corner_x = { 0.0f, 1.0f, 0.0f, 1.0f };
+    static const fnoise_vec_t corner_y = { 0.0f, 0.0f, 1.0f, 1.0f };
+    static const fnoise_ivec_t lo = { 0, 4, 1, 5 }, hi = { 2, 6, 3, 7 };
+    static const fnoise_ivec_t evens = { 0, 1, 4, 5 }, odds = { 2, 3, 6, 7 };
+    const fnoise_vec_t *gradients = fnoise_tables.gradients;
+    fnoise_uvec_t index = fnoise_usplat(hash) + corner_hash;
+    fnoise_vec_t g0, g1, g2, g3, t0, t1, t2, t3, gx, gy, gz;
+
+    /* The arithmetic shift in libnoise doesn't matter for the low 8
+       bits. */
+    index = (index ^ (index >> 8)) & fnoise_usplat(0xff);
+
+    g0 = gradients[index[0]];
+    g1 = gradients[index[1]];
+    g2 = gradients[index[2]];
+    g3 = gradients[index[3]];
+
+    /* Transpose the gradients into x, y and z vectors. */
+    t0 = __builtin_shuffle(g0, g1, lo);
+    t1 = __builtin_shuffle(g2, g3, lo);
+    t2 = __builtin_shuffle(g0, g1, hi);
+    t3 = __builtin_shuffle(g2, g3, hi);
+    gx = __builtin_shuffle(t0, t1, evens);
+    gy = __builtin_shuffle(t0, t1, odds);
+    gz = __builtin_shuffle(t2, t3, evens);
+
+    return (gx * (fnoise_splat(fx) - corner_x)
+	    + gy * (fnoise_splat(fy) - corner_y)
+	    + gz * fnoise_splat(fz)) * fnoise_splat(2.12f);
+}
+
+static float
+fnoise_gradient_coherent (float x, float y, float z, int seed)
+{
+    int x0 = fnoise_floor(x), y0 = fnoise_floor(y), z0 = fnoise_floor(z);
+    float fx = x - (float)x0, fy = y - (float)y0, fz = z - (float)z0;
+    unsigned int hash = (unsigned int)x0 * X_NOISE_GEN + (unsigned int)y0 * Y_NOISE_GEN
+	+ (unsigned int)z0 * Z_NOISE_GEN + (unsigned int)seed * SEED_NOISE_GEN;
+    fnoise_vec_t n0 = fnoise_gradient_face(hash, fx, fy, fz);
+    fnoise_vec_t n1 = fnoise_gradient_face(hash + Z_NOISE_GEN, fx, fy, fz - 1.0f);
+    float xs = fnoise_scurve7(fx), ys = fnoise_scurve7(fy), zs = fnoise_scurve7(fz);
+    float ix0, ix1, iy0, iy1;
+
+    ix0 = fnoise_lerp(n0[0], n0[1], xs);
+    ix1 = fnoise_lerp(n0[2], n0[3], xs);
+    iy0 = fnoise_lerp(ix0, ix1, ys);
+    ix0 = fnoise_lerp(n1[0], n1[1], xs);
+    ix1 = fnoise_lerp(n1[2], n1[3], xs);
+    iy1 = fnoise_lerp(ix0, ix1, ys);
+
+    return fnoise_lerp(iy0, iy1, zs);
+}
+
+static float
+fast_perlin (int num_octaves, float persistence, float lacunarity,
+	     float x, float y, float z, int billow)
+{
+    float value = 0.0f;
+    float cur_persistence = 1.0f;
+    int octave;
+
+    for (octave = 0; octave < num_octaves; ++octave)
+    {
+	float signal = fnoise_gradient_coherent(fnoise_int32_range(x), fnoise_int32_range(y),
+						fnoise_int32_range(z), octave);
+
+	if (billow)
+	    signal = 2.0f * fabsf(signal) - 1.0f;
+	value += signal * cur_persistence;
+
+	x *= lacunarity;
+	y *= lacunarity;
+	z *= lacunarity;
+	cur_persistence *= persistence;
+    }
+
+    if (billow)
+	value += 0.5f;
+
+    return value;
+}
+
+static float
+fast_ridged_multi (int num_octaves, float lacunarity, float x, float y, float z)
+{
+    float value = 0.0f;
+    float weight = 1.0f;
+    float frequency = 1.0f;
+    int octave;
+
+    for (octave = 0; octave < num_octaves; ++octave)
+    {
+	float signal = fnoise_gradient_coherent(fnoise_int32_range(x), fnoise_int32_range(y),
+						fnoise_int32_range(z), octave);
+
+	signal = 1.0f - fabsf(signal);
+	signal *= signal;
+	signal *= weight;
+
+	weight = signal * 2.0f;
+	if (weight > 1.0f)
+	    weight = 1.0f;
+	if (weight < 0.0f)
+	    weight = 0.0f;
+
+	/* The spectral weight of an octave is 1 / frequency. */
+	value += signal / frequency;
+
+	x *= lacunarity;
+	y *= lacunarity;
+	z *= lacunarity;
+	frequency *= lacunarity;
+    }
+
+    return value * 1.25f - 1.0f;
+}
+
+/* libnoise's ValueNoise3D, given X/Y/Z_NOISE_GEN times the lattice
+   point. */
+static inline fnoise_vec_t
+fnoise_value (fnoise_uvec_t hash, unsigned int seed)
+{
+    fnoise_uvec_t n = (hash + fnoise_usplat(seed * SEED_NOISE_GEN)) & fnoise_usplat(0x7fffffff);
+    fnoise_ivec_t i;
+    fnoise_vec_t f;
+
+    n = (n >> 13) ^ n;
+    n = (n * (n * n * fnoise_usplat(60493) + fnoise_usplat(19990303)) + fnoise_usplat(1376312589))
+	& fnoise_usplat(0x7fffffff);
+    i = (fnoise_ivec_t)n;
+    f = __builtin_convertvector(i, fnoise_vec_t);
+
+    return fnoise_splat(1.0f) - f * fnoise_splat(1.0f / 1073741824.0f);
+}
+
+static float
+fast_voronoi (float displacement, float x, float y, float z)
+{
+    int x_int = fnoise_floor(x), y_int = fnoise_floor(y), z_int = fnoise_floor(z);
+    fnoise_uvec_t hash = fnoise_usplat((unsigned int)x_int * X_NOISE_GEN + (unsigned int)y_int * Y_NOISE_GEN
+					+ (unsigned int)z_int * Z_NOISE_GEN);
+    fnoise_vec_t base_x = fnoise_splat((float)x_int);
+    fnoise_vec_t base_y = fnoise_splat((float)y_int);
+    fnoise_vec_t base_z = fnoise_splat((float)z_int);
+    fnoise_vec_t min_dist = fnoise_splat(2147483647.0f);
+    fnoise_vec_t best_x = fnoise_splat(0.0f), best_y = best_x, best_z = best_x;
+    fnoise_ivec_t best_index = { 0, 0, 0, 0 };
+    float best;
+    unsigned int n;
+    int i, lane;
+
+    for (i = 0; i < NUM_VORONOI_CANDIDATES / 4; ++i)
+    {
+	fnoise_uvec_t h = hash + fnoise_tables.candidate_hash[i];
+	fnoise_vec_t px = base_x + fnoise_tables.candidate_x[i] + fnoise_value(h, 0);
+	fnoise_vec_t py = base_y + fnoise_tables.candidate_y[i] + fnoise_value(h, 1);
+	fnoise_vec_t pz = base_z + fnoise_tables.candidate_z[i] + fnoise_value(h, 2);
+	fnoise_vec_t dx = px - fnoise_splat(x);
+	fnoise_vec_t dy = py - fnoise_splat(y);
+	fnoise_vec_t dz = pz - fnoise_splat(z);
+	fnoise_vec_t dist = dx * dx + dy * dy + dz * dz;
+	/* Strictly closer, so the earliest candidate wins ties, like in
+	   libnoise. */
+	fnoise_ivec_t closer = dist < min_dist;
+	fnoise_ivec_t index = { i, i, i, i };
+
+	min_dist = closer ? dist : min_dist;
+	best_x = closer ? px : best_x;
+	best_y = closer ? py : best_y;
+	best_z = closer ? pz : best_z;
+	best_index = closer ? index : best_index;
+    }
+
+    /* Across lanes, ties go to the earliest candidate as well. */
+    lane = 0;
+    best = min_dist[0];
+    for (i = 1; i < 4; ++i)
+	if (min_dist[i] < best || (min_dist[i] == best && best_index[i] < best_index[lane]))
+	{
+	    best = min_dist[i];
+	    lane = i;
+	}
+
+    n = ((unsigned int)(int)floorf(best_x[lane]) * X_NOISE_GEN
+	 + (unsigned int)(int)floorf(best_y[lane]) * Y_NOISE_GEN
+	 + (unsigned int)(int)floorf(best_z[lane]) * Z_NOISE_GEN) & 0x7fffffff;
+    n = (n >> 13) ^ n;
+    n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
+
+    return displacement * (1.0f - (float)(int)n / 1073741824.0f);
+}
+
+typedef struct
+{
+    module::Perlin perlin;
+    int perlin_octaves;
+    float perlin_persistence, perlin_lacunarity;
+
+    module::Billow billow;
+    int billow_octaves;
+    float billow_persistence, billow_lacunarity;
+
+    module::RidgedMulti ridged_multi;
+    int ridged_multi_octaves;
+    float ridged_multi_lacunarity;
+
+    module::Voronoi voronoi;
+    float voronoi_displacement;
+} noise_modules_t;
+
+static GStaticPrivate modules_key = G_STATIC_PRIVATE_INIT;
+
+static void
+free_modules (gpointer data)
+{
+    delete (noise_modules_t*)data;
+}
+
+static noise_modules_t*
+get_modules (void)
+{
+    noise_modules_t *modules = (noise_modules_t*)g_static_private_get(&modules_key);
+
+    if (modules == NULL)
+    {
+	modules = new noise_modules_t;
+
+	modules->perlin.SetNoiseQuality(QUALITY_BESTEST);
+	modules->billow.SetNoiseQuality(QUALITY_BESTEST);
+	modules->ridged_multi.SetNoiseQuality(QUALITY_BESTEST);
+
+	/* Invalid parameters, so that the first call sets them all. */
+	modules->perlin_octaves = modules->billow_octaves = modules->ridged_multi_octaves = 0;
+	modules->perlin_persistence = modules->perlin_lacunarity = NAN;
+	modules->billow_persistence = modules->billow_lacunarity = NAN;
+	modules->ridged_multi_lacunarity = NAN;
+	modules->voronoi_displacement = NAN;
+
+	g_static_private_set(&modules_key, modules, free_modules);
+    }
+
+    return modules;
+}
+
 extern "C"
 CALLBACK_SYMBOL
 float
 libnoise_perlin (int num_octaves, float persistence, float lacunarity,
 		 float x, float y, float z)
 {
-    module::Perlin p;
+    noise_modules_t *modules;
+
+    if (use_fast_noise)
+	return fast_perlin(num_octaves, persistence, lacunarity, x, y, z, 0);
+
+    modules = get_modules();
+    module::Perlin &p = modules->perlin;
 
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
-    p.SetPersistence (persistence);
+    if (num_octaves != modules->perlin_octaves)
+    {
+	p.SetOctaveCount (num_octaves);
+	modules->perlin_octaves = num_octaves;
+    }
+    if (lacunarity != modules->perlin_lacunarity)
+    {
+	p.SetLacunarity (lacunarity);
+	modules->perlin_lacunarity = lacunarity;
+    }
+    if (persistence != modules->perlin_persistence)
+    {
+	p.SetPersistence (persistence);
+	modules->perlin_persistence = persistence;
+    }
 
     return p.GetValue (x, y, z);
 }
@@ -50,12 +441,29 @@ float
 libnoise_billow (int num_octaves, float persistence, float lacunarity,
 		 float x, float y, float z)
 {
-    module::Billow p;
+    noise_modules_t *modules;
 
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
-    p.SetPersistence (persistence);
+    if (use_fast_noise)
+	return fast_perlin(num_octaves, persistence, lacunarity, x, y, z, 1);
+
+    modules = get_modules();
+    module::Billow &p = modules->billow;
+
+    if (num_octaves != modules->billow_octaves)
+    {
+	p.SetOctaveCount (num_octaves);
+	modules->billow_octaves = num_octaves;
+    }
+    if (lacunarity != modules->billow_lacunarity)
+    {
+	p.SetLacunarity (lacunarity);
+	modules->billow_lacunarity = lacunarity;
+    }
+    if (persistence != modules->billow_persistence)
+    {
+	p.SetPersistence (persistence);
+	modules->billow_persistence = persistence;
+    }
 
     return p.GetValue (x, y, z);
 }
@@ -66,11 +474,25 @@ float
 libnoise_ridged_multi (int num_octaves, float lacunarity,
 		       float x, float y, float z)
 {
-    module::RidgedMulti p;
+    noise_modules_t *modules;
+
+    if (use_fast_noise)
+	return fast_ridged_multi(num_octaves, lacunarity, x, y, z);
 
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
+    modules = get_modules();
+    module::RidgedMulti &p = modules->ridged_multi;
+
+    if (num_octaves != modules->ridged_multi_octaves)
+    {
+	p.SetOctaveCount (num_octaves);
+	modules->ridged_multi_octaves = num_octaves;
+    }
+    /* Setting the lacunarity recomputes the spectral weights. */
+    if (lacunarity != modules->ridged_multi_lacunarity)
+    {
+	p.SetLacunarity (lacunarity);
+	modules->ridged_multi_lacunarity = lacunarity;
+    }
 
     return p.GetValue (x, y, z);
 }
@@ -80,9 +502,19 @@ CALLBACK_SYMBOL
 float
 libnoise_voronoi (float displacement, float x, float y, float z)
 {
-    module::Voronoi p;
+    noise_modules_t *modules;
+
+    if (use_fast_noise)
+	return fast_voronoi(displacement, x, y, z);
+
+    modules = get_modules();
+    module::Voronoi &p = modules->voronoi;
 
-    p.SetDisplacement (displacement);
+    if (displacement != modules->voronoi_displacement)
+    {
+	p.SetDisplacement (displacement);
+	modules->voronoi_displacement = displacement;
+    }
 
     return p.GetValue (x, y, z);
 }
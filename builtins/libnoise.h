@@ -37,6 +37,8 @@ extern float libnoise_ridged_multi (int num_octaves, float lacunarity,
 extern float libnoise_voronoi (float displacement, float x, float y, float z);
 /* END */
 
+extern void libnoise_set_fast_noise (int fast);
+
 #ifdef __cplusplus
 }
 #endif
@@ -59,6 +59,7 @@ typedef struct _compvar_t
     variable_t *var;		/* 0 if compvar is a temporary */
     temporary_t *temp;		/* 0 if compvar is a variable */
     int n;			/* n/a if compvar is a temporary */
+    int last_index;		/* n/a if compvar is a temporary */
     type_t type;
     struct _value_t *current;
     struct _value_t *values;
@@ -336,9 +337,12 @@ extern void compiler_slice_code_for_const (statement_t *stmt, int const_type);
 extern gboolean compiler_opt_remove_dead_assignments (statement_t *first_stmt);
 extern gboolean compiler_opt_orig_val_resize (statement_t **first_stmt);
 extern gboolean compiler_opt_strip_resize (statement_t **first_stmt);
-extern gboolean compiler_opt_loop_invariant_code_motion (statement_t **first_stmt);
+extern int compiler_opt_loop_invariant_code_motion (statement_t **first_stmt);
 extern gboolean compiler_opt_simplify (filter_t *filter, statement_t *first_stmt);
 
+extern value_set_t* compiler_opt_find_local_tuples (statement_t *first_stmt, gboolean output_escapes);
+extern gboolean compiler_code_allocates (statement_t *stmt, unsigned int slice_flag, value_set_t *local_tuples);
+
 #define COMPILER_FOR_EACH_VALUE_IN_RHS(rhs,func,...) do { long __clos[] = { __VA_ARGS__ }; compiler_for_each_value_in_rhs((rhs),(func),__clos); } while (0)
 #define COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(stmt,func,...) do { long __clos[] = { __VA_ARGS__ }; compiler_for_each_value_in_statements((stmt),(func),__clos); } while (0)
 #define COMPILER_FOR_EACH_VALUE_IN_STATEMENT(stmt,func,...) do { long __clos[] = { __VA_ARGS__ }; compiler_for_each_value_in_statement((stmt),(func),__clos); } while (0)
@@ -107,29 +107,82 @@ static type_t primary_type (primary_t *primary);
 
 #include "opfuncs.h"
 
-static pools_t compiler_pools;
-
 static operation_t ops[NUM_OPS];
 
-static int next_temp_number = 1;
-static int next_compvar_number = 1;
-
-static statement_t *first_stmt = NULL;
-static statement_t **emit_loc = &first_stmt;
 static statement_t dummy_stmt = { STMT_NIL };
 
-static inlining_history_t *inlining_history = NULL;
+#define STMT_STACK_SIZE            64
+
+/* Everything the compiler needs while generating and optimizing the
+   code for one filter.  Each filter gets its own context, so
+   independent filters can be compiled in parallel. */
+typedef struct _compiler_context_t
+{
+    pools_t pools;
 
-static binding_values_t *binding_values = NULL;
+    int next_temp_number;
+    int next_compvar_number;
 
-static GHashTable *vector_variables = NULL;
+    statement_t *first_stmt;
+    statement_t **emit_loc;
 
-#define STMT_STACK_SIZE            64
+    inlining_history_t *inlining_history;
+    binding_values_t *binding_values;
+
+    GHashTable *vector_variables;
+    /* maps variable_t* to an array of compvar_t*, one per element */
+    GHashTable *variable_compvars;
+
+    statement_t *stmt_stack[STMT_STACK_SIZE];
+    int stmt_stackp;
+
+    value_t **vn_leaders;
+
+    /* the statements whose operands changed since constant folding
+       last looked at them, or NULL if it has to look at all */
+    GHashTable *dirty_stmts;
+
+    struct _compiler_context_t *next;
+} compiler_context_t;
+
+/* What all the filters of one mathmap share.  Values are numbered
+   across all filters, so value sets work on the code of any of
+   them. */
+typedef struct
+{
+    volatile gint next_value_global_index;
+
+    GMutex *mutex;
+    compiler_context_t *contexts;
+
+    pools_t pools;
+} compilation_t;
+
+static GStaticPrivate compilation_key = G_STATIC_PRIVATE_INIT;
+static GStaticPrivate context_key = G_STATIC_PRIVATE_INIT;
 
-static statement_t *stmt_stack[STMT_STACK_SIZE];
-static int stmt_stackp = 0;
+static compilation_t*
+current_compilation (void)
+{
+    compilation_t *compilation = (compilation_t*)g_static_private_get(&compilation_key);
+
+    g_assert(compilation != NULL);
+
+    return compilation;
+}
+
+static compiler_context_t*
+current_context (void)
+{
+    compiler_context_t *context = (compiler_context_t*)g_static_private_get(&context_key);
+
+    g_assert(context != NULL);
+
+    return context;
+}
 
-#define CURRENT_STACK_TOP       ((stmt_stackp > 0) ? stmt_stack[stmt_stackp - 1] : 0)
+#define CURRENT_STACK_TOP       ((current_context()->stmt_stackp > 0) \
+				 ? current_context()->stmt_stack[current_context()->stmt_stackp - 1] : 0)
 #define UNSAFE_EMIT_STMT(s,l) \
     ({ (s)->parent = CURRENT_STACK_TOP; \
        (s)->next = (l); (l) = (s); })
@@ -157,14 +210,14 @@ direct_hash_table_copy (GHashTable *table)
 
 /*** value sets ***/
 
-/* This is updated by new_value.  We assume that no new values are generated
- * at the time value sets are used.  */
-static int next_value_global_index = 0;
+/* The compilation's next_value_global_index is updated by new_value.  We
+ * assume that no new values are generated at the time value sets are
+ * used.  */
 
 value_set_t*
 compiler_new_value_set (void)
 {
-    return new_bit_vector(next_value_global_index, 0);
+    return new_bit_vector(g_atomic_int_get(&current_compilation()->next_value_global_index), 0);
 }
 
 void
@@ -229,11 +282,11 @@ compiler_op_index (operation_t *op)
     return op - ops;
 }
 
-#define alloc_stmt()               ((statement_t*)pools_alloc(&compiler_pools, sizeof(statement_t)))
-#define alloc_value()              ((value_t*)pools_alloc(&compiler_pools, sizeof(value_t)))
-#define alloc_rhs()                ((rhs_t*)pools_alloc(&compiler_pools, sizeof(rhs_t)))
-#define alloc_compvar()            (compvar_t*)pools_alloc(&compiler_pools, sizeof(compvar_t))
-#define alloc_primary()            (primary_t*)pools_alloc(&compiler_pools, sizeof(primary_t))
+#define alloc_stmt()               ((statement_t*)pools_alloc(&current_context()->pools, sizeof(statement_t)))
+#define alloc_value()              ((value_t*)pools_alloc(&current_context()->pools, sizeof(value_t)))
+#define alloc_rhs()                ((rhs_t*)pools_alloc(&current_context()->pools, sizeof(rhs_t)))
+#define alloc_compvar()            (compvar_t*)pools_alloc(&current_context()->pools, sizeof(compvar_t))
+#define alloc_primary()            (primary_t*)pools_alloc(&current_context()->pools, sizeof(primary_t))
 
 static value_t*
 new_value (compvar_t *compvar)
@@ -241,7 +294,7 @@ new_value (compvar_t *compvar)
     value_t *val = alloc_value();
 
     val->compvar = compvar;	/* dummy value */
-    val->global_index = next_value_global_index++;
+    val->global_index = g_atomic_int_exchange_and_add(&current_compilation()->next_value_global_index, 1);
     val->index = -1;
     val->def = &dummy_stmt;
     val->uses = 0;
@@ -257,14 +310,14 @@ new_value (compvar_t *compvar)
 compvar_t*
 make_temporary (type_t type)
 {
-    temporary_t *temp = (temporary_t*)pools_alloc(&compiler_pools, sizeof(temporary_t));
+    temporary_t *temp = (temporary_t*)pools_alloc(&current_context()->pools, sizeof(temporary_t));
     compvar_t *compvar = alloc_compvar();
     value_t *val = new_value(compvar);
 
-    temp->number = next_temp_number++;
+    temp->number = current_context()->next_temp_number++;
     temp->last_index = 0;
 
-    compvar->index = next_compvar_number++;
+    compvar->index = current_context()->next_compvar_number++;
     compvar->var = 0;
     compvar->temp = temp;
     compvar->type = type;
@@ -288,10 +341,11 @@ make_variable (variable_t *var, int n)
     compvar_t *compvar = alloc_compvar();
     value_t *val = new_value(compvar);
 
-    compvar->index = next_compvar_number++;
+    compvar->index = current_context()->next_compvar_number++;
     compvar->var = var;
     compvar->temp = 0;
     compvar->n = n;
+    compvar->last_index = 0;
     compvar->type = compiler_type_from_tuple_info(&var->type);
     compvar->current = val;
     compvar->values = val;
@@ -305,10 +359,11 @@ make_tree_vector_variable (variable_t *var)
     compvar_t *compvar = alloc_compvar();
     value_t *val = new_value(compvar);
 
-    compvar->index = next_compvar_number++;
+    compvar->index = current_context()->next_compvar_number++;
     compvar->var = var;
     compvar->temp = 0;
     compvar->n = 0;
+    compvar->last_index = 0;
     compvar->type = TYPE_TREE_VECTOR;
     compvar->current = val;
     compvar->values = val;
@@ -330,7 +385,7 @@ make_lhs (compvar_t *compvar)
 statement_list_t*
 prepend_statement (statement_t *stmt, statement_list_t *rest)
 {
-    statement_list_t *lst = (statement_list_t*)pools_alloc(&compiler_pools, sizeof(statement_list_t));
+    statement_list_t *lst = (statement_list_t*)pools_alloc(&current_context()->pools, sizeof(statement_list_t));
 
     lst->stmt = stmt;
     lst->next = rest;
@@ -338,10 +393,34 @@ prepend_statement (statement_t *stmt, statement_list_t *rest)
     return lst;
 }
 
+/* Called whenever the operands of stmt change. */
+static void
+mark_stmt_dirty (statement_t *stmt)
+{
+    compiler_context_t *context = (compiler_context_t*)g_static_private_get(&context_key);
+
+    if (context != NULL && context->dirty_stmts != NULL)
+	g_hash_table_insert(context->dirty_stmts, stmt, stmt);
+}
+
+/* For changes that don't go through the def-use chains. */
+static void
+mark_all_stmts_dirty (void)
+{
+    compiler_context_t *context = current_context();
+
+    if (context->dirty_stmts != NULL)
+    {
+	g_hash_table_destroy(context->dirty_stmts);
+	context->dirty_stmts = NULL;
+    }
+}
+
 void
 add_use (value_t *val, statement_t *stmt)
 {
     val->uses = prepend_statement(stmt, val->uses);
+    mark_stmt_dirty(stmt);
 }
 
 void
@@ -356,6 +435,7 @@ remove_use (value_t *val, statement_t *stmt)
 	if (elem->stmt == stmt)
 	{
 	    *lst = elem->next;
+	    mark_stmt_dirty(stmt);
 
 	    return;
 	}
@@ -404,7 +484,7 @@ void
 assign_value_index_and_make_current (value_t *val)
 {
     if (val->compvar->var != 0)
-	val->index = ++val->compvar->var->last_index[val->compvar->n];
+	val->index = ++val->compvar->last_index;
     else
 	val->index = ++val->compvar->temp->last_index;
 
@@ -527,7 +607,7 @@ make_tuple_rhs_from_array (int length, primary_t *args)
 
     rhs->kind = RHS_TUPLE;
     rhs->v.tuple.length = length;
-    rhs->v.tuple.args = pools_alloc(&compiler_pools, sizeof(primary_t) * length);
+    rhs->v.tuple.args = pools_alloc(&current_context()->pools, sizeof(primary_t) * length);
 
     memcpy(rhs->v.tuple.args, args, sizeof(primary_t) * length);
 
@@ -556,7 +636,7 @@ make_tree_vector_rhs (int length, primary_t *args)
 
     rhs->kind = RHS_TREE_VECTOR;
     rhs->v.tuple.length = length;
-    rhs->v.tuple.args = pools_alloc(&compiler_pools, sizeof(primary_t) * length);
+    rhs->v.tuple.args = pools_alloc(&current_context()->pools, sizeof(primary_t) * length);
 
     memcpy(rhs->v.tuple.args, args, sizeof(primary_t) * length);
 
@@ -578,7 +658,7 @@ make_filter_rhs (filter_t *filter, primary_t *args)
     rhs->kind = RHS_FILTER;
     rhs->v.filter.filter = filter;
     rhs->v.filter.args = args;
-    rhs->v.filter.history = inlining_history;
+    rhs->v.filter.history = current_context()->inlining_history;
 
     return rhs;
 }
@@ -591,7 +671,7 @@ make_closure_rhs (filter_t *filter, primary_t *args)
     rhs->kind = RHS_CLOSURE;
     rhs->v.closure.filter = filter;
     rhs->v.closure.args = args;
-    rhs->v.closure.history = inlining_history;
+    rhs->v.closure.history = current_context()->inlining_history;
 
     return rhs;
 }
@@ -959,6 +1039,7 @@ rewrite_use (statement_t *stmt, value_t *old, primary_t new)
 
     /* rewrite */
     *primary = new;
+    mark_stmt_dirty(stmt);
 
     /* add to new use list */
     if (new.kind == PRIMARY_VALUE)
@@ -1012,11 +1093,12 @@ rewrite_uses_to_value (value_t *old, value_t *new, statement_t *limit)
 static void
 commit_assign (statement_t *stmt)
 {
+    compiler_context_t *context = current_context();
     statement_t *tos;
 
-    if (stmt_stackp > 0)
+    if (context->stmt_stackp > 0)
     {
-	tos = stmt_stack[stmt_stackp - 1];
+	tos = context->stmt_stack[context->stmt_stackp - 1];
 
 	switch (tos->kind)
 	{
@@ -1167,8 +1249,8 @@ emit_stmt (statement_t *stmt)
 {
     stmt->parent = CURRENT_STACK_TOP;
 
-    insert_stmt_before(stmt, emit_loc);
-    emit_loc = &stmt->next;
+    insert_stmt_before(stmt, current_context()->emit_loc);
+    current_context()->emit_loc = &stmt->next;
 
     record_stmt_def_uses(stmt);
 }
@@ -1224,6 +1306,7 @@ emit_assign (value_t *lhs, rhs_t *rhs)
 void
 start_if_cond (rhs_t *condition)
 {
+    compiler_context_t *context = current_context();
     statement_t *stmt = alloc_stmt();
 
     stmt->kind = STMT_IF_COND;
@@ -1235,9 +1318,9 @@ start_if_cond (rhs_t *condition)
     stmt->v.if_cond.exit = 0;
 
     emit_stmt(stmt);
-    stmt_stack[stmt_stackp++] = stmt;
+    context->stmt_stack[context->stmt_stackp++] = stmt;
 
-    emit_loc = &stmt->v.if_cond.consequent;
+    context->emit_loc = &stmt->v.if_cond.consequent;
 }
 
 static void
@@ -1257,11 +1340,12 @@ reset_values_for_phis (statement_t *phi, int delete)
 void
 switch_if_branch (void)
 {
+    compiler_context_t *context = current_context();
     statement_t *stmt;
 
-    assert(stmt_stackp > 0);
+    assert(context->stmt_stackp > 0);
 
-    stmt = stmt_stack[stmt_stackp - 1];
+    stmt = context->stmt_stack[context->stmt_stackp - 1];
 
     assert(stmt->kind == STMT_IF_COND && stmt->v.if_cond.alternative == 0);
 
@@ -1270,17 +1354,18 @@ switch_if_branch (void)
 
     reset_values_for_phis(stmt->v.if_cond.exit, 0);
 
-    emit_loc = &stmt->v.if_cond.alternative;
+    context->emit_loc = &stmt->v.if_cond.alternative;
 }
 
 void
 end_if_cond (void)
 {
+    compiler_context_t *context = current_context();
     statement_t *stmt, *phi;
 
-    assert(stmt_stackp > 0);
+    assert(context->stmt_stackp > 0);
 
-    stmt = stmt_stack[stmt_stackp - 1];
+    stmt = context->stmt_stack[context->stmt_stackp - 1];
 
     assert(stmt->kind == STMT_IF_COND && stmt->v.if_cond.consequent != 0);
 
@@ -1296,7 +1381,7 @@ end_if_cond (void)
 	UNSAFE_EMIT_STMT(nil, stmt->v.if_cond.exit);
     }
 
-    --stmt_stackp;
+    --context->stmt_stackp;
 
     reset_values_for_phis(stmt->v.if_cond.exit, 1);
 
@@ -1307,12 +1392,13 @@ end_if_cond (void)
 	commit_assign(phi);
     }
 
-    emit_loc = &stmt->next;
+    context->emit_loc = &stmt->next;
 }
 
 void
 start_while_loop (rhs_t *invariant)
 {
+    compiler_context_t *context = current_context();
     statement_t *stmt = alloc_stmt();
     value_t *value;
     statement_t *phi_assign;
@@ -1344,21 +1430,22 @@ start_while_loop (rhs_t *invariant)
     stmt->v.while_loop.invariant = make_value_rhs(current_value(value->compvar));
 
     emit_stmt(stmt);
-    stmt_stack[stmt_stackp++] = stmt;
+    context->stmt_stack[context->stmt_stackp++] = stmt;
 
     UNSAFE_EMIT_STMT(phi_assign, stmt->v.while_loop.entry);
 
-    emit_loc = &stmt->v.while_loop.body;
+    context->emit_loc = &stmt->v.while_loop.body;
 }
 
 void
 end_while_loop (void)
 {
+    compiler_context_t *context = current_context();
     statement_t *stmt, *phi;
 
-    assert(stmt_stackp > 0);
+    assert(context->stmt_stackp > 0);
 
-    stmt = stmt_stack[--stmt_stackp];
+    stmt = context->stmt_stack[--context->stmt_stackp];
 
     assert(stmt->kind == STMT_WHILE_LOOP);
 
@@ -1374,7 +1461,7 @@ end_while_loop (void)
 	commit_assign(phi);
     }
 
-    emit_loc = &stmt->next;
+    context->emit_loc = &stmt->next;
 }
 
 /*** inline history ***/
@@ -1382,7 +1469,7 @@ end_while_loop (void)
 static inlining_history_t*
 push_inlined_filter (filter_t *filter, inlining_history_t *old)
 {
-    inlining_history_t *new = (inlining_history_t*)pools_alloc(&compiler_pools, sizeof(inlining_history_t));
+    inlining_history_t *new = (inlining_history_t*)pools_alloc(&current_context()->pools, sizeof(inlining_history_t));
 
     new->filter = filter;
     new->next = old;
@@ -1420,7 +1507,7 @@ lookup_binding_values (int kind, gpointer key)
 {
     binding_values_t *bv;
 
-    for (bv = binding_values; bv != NULL; bv = bv->next)
+    for (bv = current_context()->binding_values; bv != NULL; bv = bv->next)
 	if (bv->kind == kind && bv->key == key)
 	    return bv;
     return NULL;
@@ -1772,21 +1859,47 @@ resize_image_if_necessary (primary_t image, int flags)
     return current_value(resized_image);
 }
 
+/* The compvars of a variable are per context, because the same
+   filter might be inlined into filters compiled in parallel. */
+static compvar_t**
+variable_compvars (variable_t *var)
+{
+    GHashTable *table = current_context()->variable_compvars;
+    compvar_t **compvars = (compvar_t**)g_hash_table_lookup(table, var);
+
+    if (compvars == NULL)
+    {
+	compvars = (compvar_t**)pools_alloc(&current_context()->pools, sizeof(compvar_t*) * var->type.length);
+	memset(compvars, 0, sizeof(compvar_t*) * var->type.length);
+	g_hash_table_insert(table, var, compvars);
+    }
+
+    return compvars;
+}
+
+static void
+reset_variable_compvars (variable_t *vars)
+{
+    for (; vars != NULL; vars = vars->next)
+	g_hash_table_remove(current_context()->variable_compvars, vars);
+}
+
 static void
 alloc_var_compvars_if_needed (variable_t *var)
 {
+    compvar_t **compvars = variable_compvars(var);
     int i;
 
-    if (g_hash_table_lookup(vector_variables, var))
+    if (g_hash_table_lookup(current_context()->vector_variables, var))
     {
-	if (var->compvar[0] == NULL)
-	    var->compvar[0] = make_tree_vector_variable(var);
+	if (compvars[0] == NULL)
+	    compvars[0] = make_tree_vector_variable(var);
 	return;
     }
 
     for (i = 0; i < var->type.length; ++i)
-	if (var->compvar[i] == NULL)
-	    var->compvar[i] = make_variable(var, i);
+	if (compvars[i] == NULL)
+	    compvars[i] = make_variable(var, i);
 }
 
 static void gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced);
@@ -1803,13 +1916,13 @@ gen_args (filter_t *filter, exprtree *arg_trees, int **_arglengths, int **_argnu
     for (arg = arg_trees; arg != 0; arg = arg->next)
 	++num_args;
 
-    args = (compvar_t***)pools_alloc(&compiler_pools, num_args * sizeof(compvar_t**));
-    arglengths = (int*)pools_alloc(&compiler_pools, num_args * sizeof(int));
-    argnumbers = (int*)pools_alloc(&compiler_pools, num_args * sizeof(int));
+    args = (compvar_t***)pools_alloc(&current_context()->pools, num_args * sizeof(compvar_t**));
+    arglengths = (int*)pools_alloc(&current_context()->pools, num_args * sizeof(int));
+    argnumbers = (int*)pools_alloc(&current_context()->pools, num_args * sizeof(int));
 
     for (i = 0, arg = arg_trees; i < num_args; ++i, arg = arg->next)
     {
-	args[i] = (compvar_t**)pools_alloc(&compiler_pools, arg->result.length * sizeof(compvar_t*));
+	args[i] = (compvar_t**)pools_alloc(&current_context()->pools, arg->result.length * sizeof(compvar_t*));
 	arglengths[i] = arg->result.length;
 	argnumbers[i] = arg->result.number;
 	gen_code(filter, arg, args[i], 0);
@@ -1839,9 +1952,9 @@ gen_deconstruct_color (compvar_t *color, compvar_t **dest, gboolean is_alloced)
 static compvar_t*
 gen_tree_vector (filter_t *filter, exprtree *tree, compvar_t **dest, gboolean is_alloced)
 {
-    if (tree->type == EXPR_VARIABLE && g_hash_table_lookup(vector_variables, tree->val.var))
+    if (tree->type == EXPR_VARIABLE && g_hash_table_lookup(current_context()->vector_variables, tree->val.var))
     {
-	compvar_t *tree_vector = tree->val.var->compvar[0];
+	compvar_t *tree_vector = variable_compvars(tree->val.var)[0];
 	int i;
 
 	for (i = 0; i < tree->result.length; ++i)
@@ -1916,7 +2029,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 		int i;
 		compvar_t *tree_vector = NULL;
 
-		if (g_hash_table_lookup(vector_variables, tree))
+		if (g_hash_table_lookup(current_context()->vector_variables, tree))
 		    tree_vector = gen_tree_vector(filter, tree->val.select.tuple, temps, FALSE);
 		else
 		    gen_code(filter, tree->val.select.tuple, temps, FALSE);
@@ -1959,21 +2072,21 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 	case EXPR_VARIABLE :
 	    alloc_var_compvars_if_needed(tree->val.var);
-	    if (g_hash_table_lookup(vector_variables, tree->val.var))
+	    if (g_hash_table_lookup(current_context()->vector_variables, tree->val.var))
 		for (i = 0; i < tree->val.var->type.length; ++i)
 		{
 		    if (!is_alloced)
 			dest[i] = make_temporary(TYPE_INT);
 		    emit_assign(make_lhs(dest[i]), make_op_rhs(OP_TREE_VECTOR_NTH,
 							       make_int_const_primary(i),
-							       make_compvar_primary(tree->val.var->compvar[0])));
+							       make_compvar_primary(variable_compvars(tree->val.var)[0])));
 		}
 	    else
 		for (i = 0; i < tree->val.var->type.length; ++i)
 		    if (!is_alloced)
-			dest[i] = tree->val.var->compvar[i];
+			dest[i] = variable_compvars(tree->val.var)[i];
 		    else
-			emit_assign(make_lhs(dest[i]), make_compvar_rhs(tree->val.var->compvar[i]));
+			emit_assign(make_lhs(dest[i]), make_compvar_rhs(variable_compvars(tree->val.var)[i]));
 	    break;
 
 	case EXPR_INTERNAL :
@@ -1992,19 +2105,19 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 	case EXPR_ASSIGNMENT :
 	    alloc_var_compvars_if_needed(tree->val.assignment.var);
-	    if (g_hash_table_lookup(vector_variables, tree->val.assignment.var))
+	    if (g_hash_table_lookup(current_context()->vector_variables, tree->val.assignment.var))
 	    {
 		compvar_t *tree_vector = gen_tree_vector(filter, tree->val.assignment.value, dest, is_alloced);
-		emit_assign(make_lhs(tree->val.assignment.var->compvar[0]), make_compvar_rhs(tree_vector));
+		emit_assign(make_lhs(variable_compvars(tree->val.assignment.var)[0]), make_compvar_rhs(tree_vector));
 	    }
 	    else
 	    {
-		gen_code(filter, tree->val.assignment.value, tree->val.assignment.var->compvar, TRUE);
+		gen_code(filter, tree->val.assignment.value, variable_compvars(tree->val.assignment.var), TRUE);
 		for (i = 0; i < tree->result.length; ++i)
 		    if (is_alloced)
-			emit_assign(make_lhs(dest[i]), make_compvar_rhs(tree->val.assignment.var->compvar[i]));
+			emit_assign(make_lhs(dest[i]), make_compvar_rhs(variable_compvars(tree->val.assignment.var)[i]));
 		    else
-			dest[i] = tree->val.assignment.var->compvar[i];
+			dest[i] = variable_compvars(tree->val.assignment.var)[i];
 	    }
 	    break;
 
@@ -2013,7 +2126,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 		compvar_t *temps[tree->val.sub_assignment.value->result.length];
 		exprtree *sub;
 		int i;
-		gboolean is_tree_vector = g_hash_table_lookup(vector_variables, tree->val.sub_assignment.var) != NULL;
+		gboolean is_tree_vector = g_hash_table_lookup(current_context()->vector_variables, tree->val.sub_assignment.var) != NULL;
 
 		alloc_var_compvars_if_needed(tree->val.sub_assignment.var);
 
@@ -2026,7 +2139,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 		    if (is_tree_vector)
 		    {
-			compvar_t *tree_vector = tree->val.sub_assignment.var->compvar[0];
+			compvar_t *tree_vector = variable_compvars(tree->val.sub_assignment.var)[0];
 			compvar_t *subscript;
 
 			gen_code(filter, sub, &subscript, FALSE);
@@ -2043,7 +2156,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 			if (subscript >= tree->val.sub_assignment.var->type.length)
 			    subscript = tree->val.sub_assignment.var->type.length - 1;
 
-			emit_assign(make_lhs(tree->val.sub_assignment.var->compvar[subscript]), make_compvar_rhs(temps[i]));
+			emit_assign(make_lhs(variable_compvars(tree->val.sub_assignment.var)[subscript]), make_compvar_rhs(temps[i]));
 		    }
 		    else
 			g_assert_not_reached ();
@@ -2176,7 +2289,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 		args = gen_args(filter, tree->val.filter_closure.args, &arglengths, &argnumbers);
 
-		arg_primaries = (primary_t*)pools_alloc(&compiler_pools, sizeof(primary_t) * num_args);
+		arg_primaries = (primary_t*)pools_alloc(&current_context()->pools, sizeof(primary_t) * num_args);
 
 		for (i = 0, info = infos;
 		     i < num_args;
@@ -2229,7 +2342,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 static binding_values_t*
 new_binding_values (int kind, gpointer key, binding_values_t *next, int num_values, int var_type)
 {
-    binding_values_t *bv = (binding_values_t*)pools_alloc(&compiler_pools, sizeof(binding_values_t)
+    binding_values_t *bv = (binding_values_t*)pools_alloc(&current_context()->pools, sizeof(binding_values_t)
 							  + num_values * sizeof(value_t*));
     int i;
 
@@ -2547,9 +2660,9 @@ find_all_vector_variables (exprtree *tree)
 		find_all_vector_variables(sub);
 		if (!is_exprtree_single_const(sub, NULL, NULL))
 		{
-		    g_hash_table_insert(vector_variables, tree, GINT_TO_POINTER(1));
+		    g_hash_table_insert(current_context()->vector_variables, tree, GINT_TO_POINTER(1));
 		    if (var)
-			g_hash_table_insert(vector_variables, var, GINT_TO_POINTER(1));
+			g_hash_table_insert(current_context()->vector_variables, var, GINT_TO_POINTER(1));
 		}
 	    }
 	    break;
@@ -2565,7 +2678,7 @@ find_all_vector_variables (exprtree *tree)
 	    {
 		find_all_vector_variables(sub);
 		if (!is_exprtree_single_const(sub, NULL, NULL))
-		    g_hash_table_insert(vector_variables, var, GINT_TO_POINTER(1));
+		    g_hash_table_insert(current_context()->vector_variables, var, GINT_TO_POINTER(1));
 	    }
 	    break;
 
@@ -2610,34 +2723,35 @@ find_all_vector_variables (exprtree *tree)
 static statement_t*
 gen_filter_code (filter_t *filter, compvar_t *tuple, primary_t *args, rhs_t **tuple_rhs, inlining_history_t *history)
 {
-    statement_t *first_stmt_save = first_stmt;
-    inlining_history_t *history_save = inlining_history;
+    compiler_context_t *context = current_context();
+    statement_t *first_stmt_save = context->first_stmt;
+    inlining_history_t *history_save = context->inlining_history;
     statement_t *stmt;
     compvar_t *result[filter->v.mathmap.decl->v.filter.body->result.length];
     rhs_t *rhs;
-    binding_values_t *binding_values_save = binding_values;
+    binding_values_t *binding_values_save = context->binding_values;
 
-    compiler_reset_variables(filter->v.mathmap.variables);
+    reset_variable_compvars(filter->v.mathmap.variables);
 
-    inlining_history = push_inlined_filter(filter, history);
+    context->inlining_history = push_inlined_filter(filter, history);
 
-    first_stmt = NULL;
-    emit_loc = &first_stmt;
-    binding_values = gen_binding_values_for_limits(filter, NULL);
+    context->first_stmt = NULL;
+    context->emit_loc = &context->first_stmt;
+    context->binding_values = gen_binding_values_for_limits(filter, NULL);
     if (args != NULL)
-	binding_values = gen_binding_values_from_filter_args(filter, args, binding_values);
+	context->binding_values = gen_binding_values_from_filter_args(filter, args, context->binding_values);
     else
     {
-	binding_values = gen_binding_values_from_userval_infos(filter->userval_infos, binding_values);
+	context->binding_values = gen_binding_values_from_userval_infos(filter->userval_infos, context->binding_values);
 	if (needs_xy_scaling(filter_flags(filter)))
-	    binding_values = gen_binding_values_for_xy(filter,
-						       get_internal_value(filter, "x", FALSE),
-						       get_internal_value(filter, "y", FALSE),
-						       binding_values);
+	    context->binding_values = gen_binding_values_for_xy(filter,
+								get_internal_value(filter, "x", FALSE),
+								get_internal_value(filter, "y", FALSE),
+								context->binding_values);
     }
 
     if (does_filter_use_ra(filter))
-	binding_values = gen_ra_binding_values(filter, binding_values);
+	context->binding_values = gen_ra_binding_values(filter, context->binding_values);
 
     find_all_vector_variables(filter->v.mathmap.decl->v.filter.body);
 
@@ -2652,13 +2766,13 @@ gen_filter_code (filter_t *filter, compvar_t *tuple, primary_t *args, rhs_t **tu
     if (tuple != NULL)
 	emit_assign(make_lhs(tuple), rhs);
 
-    stmt = first_stmt;
+    stmt = context->first_stmt;
 
-    first_stmt = first_stmt_save;
-    emit_loc = NULL;
-    binding_values = binding_values_save;
+    context->first_stmt = first_stmt_save;
+    context->emit_loc = NULL;
+    context->binding_values = binding_values_save;
 
-    inlining_history = history_save;
+    context->inlining_history = history_save;
 
     return stmt;
 }
@@ -2861,7 +2975,7 @@ propagate_types_worker (statement_t *stmt, statement_list_t *worklist, void *inf
 static void
 propagate_types (void)
 {
-    PERFORM_WORKLIST_DFA(first_stmt, &propagate_types_builder, &propagate_types_worker);
+    PERFORM_WORKLIST_DFA(current_context()->first_stmt, &propagate_types_builder, &propagate_types_worker);
 }
 
 /*** constants analysis ***/
@@ -3210,33 +3324,204 @@ analyze_constants (void)
 {
     int changed;
 
-    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(first_stmt, &_init_const_type);
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(current_context()->first_stmt, &_init_const_type);
 
     do
     {
 	changed = 0;
-	analyze_stmts_constants(first_stmt, &changed, CONST_MAX);
+	analyze_stmts_constants(current_context()->first_stmt, &changed, CONST_MAX);
     } while (changed);
 
-    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(first_stmt, &_init_least_const_types);
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(current_context()->first_stmt, &_init_least_const_types);
 
     do
     {
 	value_set_t *set = compiler_new_value_set();
 
 	changed = 0;
-	analyze_least_const_type_multiply_used_in(first_stmt, 0, set, &changed);
+	analyze_least_const_type_multiply_used_in(current_context()->first_stmt, 0, set, &changed);
 
 	compiler_free_value_set(set);
     } while (changed);
 
-    analyze_least_const_type_directly_used_in(first_stmt);
+    analyze_least_const_type_directly_used_in(current_context()->first_stmt);
+}
+
+/*** userval uses ***/
+
+static gboolean
+rhs_is_userval_op (rhs_t *rhs, int index)
+{
+    if (rhs->kind != RHS_OP)
+	return FALSE;
+
+    switch (compiler_op_index(rhs->v.op.op))
+    {
+	case OP_USERVAL_INT :
+	case OP_USERVAL_FLOAT :
+	case OP_USERVAL_BOOL :
+	case OP_USERVAL_COLOR :
+	case OP_USERVAL_CURVE :
+	case OP_USERVAL_GRADIENT :
+	case OP_USERVAL_IMAGE :
+	    break;
+
+	default :
+	    return FALSE;
+    }
+
+    return rhs->v.op.args[0].kind == PRIMARY_CONST
+	&& rhs->v.op.args[0].const_type == TYPE_INT
+	&& rhs->v.op.args[0].v.constant.int_value == index;
+}
+
+static void
+_note_if_in_set (value_t *value, void *info)
+{
+    CLOSURE_VAR(value_set_t*, set, 0);
+    CLOSURE_VAR(gboolean*, found, 1);
+
+    if (compiler_value_set_contains(set, value))
+	*found = TRUE;
+}
+
+static gboolean
+rhs_uses_value_in_set (rhs_t *rhs, value_set_t *set)
+{
+    gboolean found = FALSE;
+
+    COMPILER_FOR_EACH_VALUE_IN_RHS(rhs, &_note_if_in_set, set, &found);
+
+    return found;
+}
+
+static void
+add_dependent_value (value_t *value, value_set_t *set, gboolean *changed)
+{
+    if (!compiler_value_set_contains(set, value))
+    {
+	compiler_value_set_add(set, value);
+	*changed = TRUE;
+    }
+}
+
+/* Adds the values computed from the values in the set to it.  Values
+   assigned under a condition which depends on the set depend on it,
+   too. */
+static void
+add_dependent_values (statement_t *stmt, value_set_t *set, gboolean depends, int index, gboolean *changed)
+{
+    while (stmt != 0)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_PHI_ASSIGN :
+		if (rhs_uses_value_in_set(stmt->v.assign.rhs2, set))
+		    add_dependent_value(stmt->v.assign.lhs, set, changed);
+	    case STMT_ASSIGN :
+		if (depends
+		    || rhs_is_userval_op(stmt->v.assign.rhs, index)
+		    || rhs_uses_value_in_set(stmt->v.assign.rhs, set))
+		    add_dependent_value(stmt->v.assign.lhs, set, changed);
+		break;
+
+	    case STMT_IF_COND :
+	    {
+		gboolean sub_depends = depends || rhs_uses_value_in_set(stmt->v.if_cond.condition, set);
+
+		add_dependent_values(stmt->v.if_cond.consequent, set, sub_depends, index, changed);
+		add_dependent_values(stmt->v.if_cond.alternative, set, sub_depends, index, changed);
+		add_dependent_values(stmt->v.if_cond.exit, set, sub_depends, index, changed);
+		break;
+	    }
+
+	    case STMT_WHILE_LOOP :
+	    {
+		gboolean sub_depends = depends || rhs_uses_value_in_set(stmt->v.while_loop.invariant, set);
+
+		add_dependent_values(stmt->v.while_loop.entry, set, sub_depends, index, changed);
+		add_dependent_values(stmt->v.while_loop.body, set, sub_depends, index, changed);
+		break;
+	    }
+
+	    default :
+		g_assert_not_reached();
+	}
+
+	stmt = stmt->next;
+    }
+}
+
+static void
+_note_if_used (value_t *value, statement_t *stmt, void *info)
+{
+    CLOSURE_VAR(value_set_t*, set, 0);
+    CLOSURE_VAR(gboolean*, found, 1);
+
+    if (compiler_value_set_contains(set, value))
+	*found = TRUE;
+}
+
+static void
+_note_if_frame_value (value_t *value, statement_t *stmt, void *info)
+{
+    CLOSURE_VAR(value_set_t*, set, 0);
+    CLOSURE_VAR(gboolean*, found, 1);
+
+    if (compiler_value_set_contains(set, value)
+	&& compiler_is_permanent_const_value(value)
+	&& (value->const_type & (CONST_X | CONST_Y)) == (CONST_X | CONST_Y))
+	*found = TRUE;
+}
+
+/* A userval is used by the frame if a permanent x-y-constant, i.e.,
+   one computed by init_frame, depends on it. */
+static int
+analyze_userval_use (int index)
+{
+    value_set_t *set = compiler_new_value_set();
+    gboolean changed, in_frame = FALSE;
+    int use;
+
+    do
+    {
+	changed = FALSE;
+	add_dependent_values(current_context()->first_stmt, set, FALSE, index, &changed);
+    } while (changed);
+
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(current_context()->first_stmt, &_note_if_frame_value, set, &in_frame);
+
+    if (in_frame)
+	use = USERVAL_USE_FRAME;
+    else
+    {
+	gboolean used = FALSE;
+
+	COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(current_context()->first_stmt, &_note_if_used, set, &used);
+	use = used ? USERVAL_USE_PIXEL : USERVAL_USE_NONE;
+    }
+
+    compiler_free_value_set(set);
+
+    return use;
+}
+
+static void
+analyze_userval_uses (filter_t *filter)
+{
+    userval_info_t *info;
+
+    for (info = filter->userval_infos; info != 0; info = info->next)
+	info->use = analyze_userval_use(info->index);
 }
 
 /*** closure application ***/
 
 static void
-optimize_closure_application (statement_t *stmt)
+optimize_closure_application_recursively (statement_t *stmt, gboolean *changed)
 {
     while (stmt != 0)
     {
@@ -3259,7 +3544,7 @@ optimize_closure_application (statement_t *stmt)
 		    {
 			filter_t *filter = def->v.assign.rhs->v.filter.filter;
 			int num_args = compiler_num_filter_args(filter);
-			primary_t *args = (primary_t*)pools_alloc(&compiler_pools, sizeof(primary_t) * num_args);
+			primary_t *args = (primary_t*)pools_alloc(&current_context()->pools, sizeof(primary_t) * num_args);
 			int i;
 
 			for (i = 0; i < num_args - 3; ++i)
@@ -3278,17 +3563,18 @@ optimize_closure_application (statement_t *stmt)
 			    if (args[i].kind == PRIMARY_VALUE)
 				add_use(args[i].v.value, stmt);
 
+			*changed = TRUE;
 		    }
 		}
 		break;
 
 	    case STMT_IF_COND :
-		optimize_closure_application(stmt->v.if_cond.consequent);
-		optimize_closure_application(stmt->v.if_cond.alternative);
+		optimize_closure_application_recursively(stmt->v.if_cond.consequent, changed);
+		optimize_closure_application_recursively(stmt->v.if_cond.alternative, changed);
 		break;
 
 	    case STMT_WHILE_LOOP :
-		optimize_closure_application(stmt->v.while_loop.body);
+		optimize_closure_application_recursively(stmt->v.while_loop.body, changed);
 		break;
 
 	    default :
@@ -3299,6 +3585,16 @@ optimize_closure_application (statement_t *stmt)
     }
 }
 
+static gboolean
+optimize_closure_application (void)
+{
+    gboolean changed = FALSE;
+
+    optimize_closure_application_recursively(current_context()->first_stmt, &changed);
+
+    return changed;
+}
+
 /*** copy propagation ***/
 
 static void
@@ -3375,7 +3671,7 @@ copy_propagation (void)
 
     assert(copy_hash != 0);
 
-    copy_propagate_recursively(first_stmt, copy_hash, &changed);
+    copy_propagate_recursively(current_context()->first_stmt, copy_hash, &changed);
 
     return changed;
 }
@@ -3410,53 +3706,6 @@ fold_rhs_if_possible (rhs_t **rhs, int *changed)
     }
 }
 
-static void
-fold_constants_recursively (statement_t *stmt, int *changed)
-{
-    while (stmt != 0)
-    {
-	switch (stmt->kind)
-	{
-	    case STMT_NIL :
-		break;
-
-	    case STMT_PHI_ASSIGN :
-		fold_rhs_if_possible(&stmt->v.assign.rhs2, changed);
-	    case STMT_ASSIGN :
-		fold_rhs_if_possible(&stmt->v.assign.rhs, changed);
-		break;
-
-	    case STMT_IF_COND :
-		fold_rhs_if_possible(&stmt->v.if_cond.condition, changed);
-		fold_constants_recursively(stmt->v.if_cond.consequent, changed);
-		fold_constants_recursively(stmt->v.if_cond.alternative, changed);
-		fold_constants_recursively(stmt->v.if_cond.exit, changed);
-		break;
-
-	    case STMT_WHILE_LOOP :
-		fold_rhs_if_possible(&stmt->v.while_loop.invariant, changed);
-		fold_constants_recursively(stmt->v.while_loop.entry, changed);
-		fold_constants_recursively(stmt->v.while_loop.body, changed);
-		break;
-
-	    default :
-		g_assert_not_reached();
-	}
-
-	stmt = stmt->next;
-    }
-}
-
-static int
-constant_folding (void)
-{
-    int changed = 0;
-
-    fold_constants_recursively(first_stmt, &changed);
-
-    return changed;
-}
-
 /*** simplification ***/
 
 static void
@@ -3535,48 +3784,92 @@ simplify_rhs (rhs_t **rhsp, int *changed)
 }
 
 static void
-simplify_ops_recursively (statement_t *stmt, int *changed)
+fold_and_simplify_stmt (statement_t *stmt, int *changed)
+{
+    switch (stmt->kind)
+    {
+	case STMT_NIL :
+	    break;
+
+	case STMT_PHI_ASSIGN :
+	    fold_rhs_if_possible(&stmt->v.assign.rhs2, changed);
+	    simplify_rhs(&stmt->v.assign.rhs2, changed);
+	case STMT_ASSIGN :
+	    fold_rhs_if_possible(&stmt->v.assign.rhs, changed);
+	    simplify_rhs(&stmt->v.assign.rhs, changed);
+	    break;
+
+	case STMT_IF_COND :
+	    fold_rhs_if_possible(&stmt->v.if_cond.condition, changed);
+	    simplify_rhs(&stmt->v.if_cond.condition, changed);
+	    break;
+
+	case STMT_WHILE_LOOP :
+	    fold_rhs_if_possible(&stmt->v.while_loop.invariant, changed);
+	    simplify_rhs(&stmt->v.while_loop.invariant, changed);
+	    break;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static void
+fold_and_simplify_recursively (statement_t *stmt, int *changed)
 {
     while (stmt != 0)
     {
+	fold_and_simplify_stmt(stmt, changed);
+
 	switch (stmt->kind)
 	{
-	    case STMT_NIL :
-		break;
-
-	    case STMT_PHI_ASSIGN :
-		simplify_rhs(&stmt->v.assign.rhs2, changed);
-	    case STMT_ASSIGN :
-		simplify_rhs(&stmt->v.assign.rhs, changed);
-		break;
-
 	    case STMT_IF_COND :
-		simplify_rhs(&stmt->v.if_cond.condition, changed);
-		simplify_ops_recursively(stmt->v.if_cond.consequent, changed);
-		simplify_ops_recursively(stmt->v.if_cond.alternative, changed);
-		simplify_ops_recursively(stmt->v.if_cond.exit, changed);
+		fold_and_simplify_recursively(stmt->v.if_cond.consequent, changed);
+		fold_and_simplify_recursively(stmt->v.if_cond.alternative, changed);
+		fold_and_simplify_recursively(stmt->v.if_cond.exit, changed);
 		break;
 
 	    case STMT_WHILE_LOOP :
-		simplify_rhs(&stmt->v.while_loop.invariant, changed);
-		simplify_ops_recursively(stmt->v.while_loop.entry, changed);
-		simplify_ops_recursively(stmt->v.while_loop.body, changed);
+		fold_and_simplify_recursively(stmt->v.while_loop.entry, changed);
+		fold_and_simplify_recursively(stmt->v.while_loop.body, changed);
 		break;
 
 	    default :
-		g_assert_not_reached();
+		break;
 	}
 
 	stmt = stmt->next;
     }
 }
 
+static void
+_fold_and_simplify_dirty_stmt (gpointer key, gpointer value, gpointer user_data)
+{
+    fold_and_simplify_stmt((statement_t*)key, (int*)user_data);
+}
+
+/* Folding and simplifying a statement only depends on its own
+   operands, so after the first run only the statements whose operands
+   changed since have to be looked at.  Passes that update the def-use
+   chains for all their changes record those statements.  Statements
+   that were removed are either nil or not in the code anymore, so
+   looking at them does no harm. */
 static int
-simplify_ops (void)
+fold_and_simplify (void)
 {
+    compiler_context_t *context = current_context();
+    GHashTable *dirty_stmts = context->dirty_stmts;
     int changed = 0;
 
-    simplify_ops_recursively(first_stmt, &changed);
+    context->dirty_stmts = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (dirty_stmts == NULL)
+	fold_and_simplify_recursively(context->first_stmt, &changed);
+    else
+    {
+	g_hash_table_foreach(dirty_stmts, &_fold_and_simplify_dirty_stmt, &changed);
+	g_hash_table_destroy(dirty_stmts);
+    }
 
     return changed;
 }
@@ -3738,7 +4031,7 @@ remove_dead_branches (void)
 {
     int changed = 0;
 
-    remove_dead_branches_recursively(first_stmt, &changed);
+    remove_dead_branches_recursively(current_context()->first_stmt, &changed);
 
     return changed;
 }
@@ -3800,12 +4093,31 @@ remove_dead_controls (void)
 {
     int changed = 0;
 
-    remove_dead_controls_recursively(first_stmt, &changed);
+    remove_dead_controls_recursively(current_context()->first_stmt, &changed);
 
     return changed;
 }
 
-/*** common subexpression eliminiation ***/
+/*** value numbering ***/
+
+/* Pure operations and internals which compute the same thing as an
+   assignment that dominates them are replaced by its value.  Two
+   right hand sides compute the same thing if they are equal after
+   replacing each value by its leader, which is the value it is a copy
+   of, so chains of redundant computations are found in one pass.
+
+   The available assignments are kept in a hash table.  Since the code
+   is structured, walking it in order visits every assignment before
+   the code it dominates, and the assignments in a branch or loop body
+   are taken out again when the walk leaves it. */
+
+static value_t*
+vn_leader (value_t *value)
+{
+    value_t *leader = current_context()->vn_leaders[value->global_index];
+
+    return leader == NULL ? value : leader;
+}
 
 static int
 images_equal (image_t *i1, image_t *i2)
@@ -3872,6 +4184,15 @@ primaries_equal (primary_t *prim1, primary_t *prim2)
     return 0;
 }
 
+static int
+primaries_equivalent (primary_t *prim1, primary_t *prim2)
+{
+    if (prim1->kind == PRIMARY_VALUE && prim2->kind == PRIMARY_VALUE)
+	return vn_leader(prim1->v.value) == vn_leader(prim2->v.value);
+    return primaries_equal(prim1, prim2);
+}
+
+/* Compares modulo the value numbering leaders. */
 static int
 rhss_equal (rhs_t *rhs1, rhs_t *rhs2)
 {
@@ -3881,7 +4202,7 @@ rhss_equal (rhs_t *rhs1, rhs_t *rhs2)
     switch (rhs1->kind)
     {
 	case RHS_PRIMARY :
-	    return primaries_equal(&rhs1->v.primary, &rhs2->v.primary);
+	    return primaries_equivalent(&rhs1->v.primary, &rhs2->v.primary);
 
 	case RHS_INTERNAL :
 	    return rhs1->v.internal == rhs2->v.internal;
@@ -3894,7 +4215,7 @@ rhss_equal (rhs_t *rhs1, rhs_t *rhs2)
 		return 0;
 
 	    for (i = 0; i < rhs1->v.op.op->num_args; ++i)
-		if (!primaries_equal(&rhs1->v.op.args[i], &rhs2->v.op.args[i]))
+		if (!primaries_equivalent(&rhs1->v.op.args[i], &rhs2->v.op.args[i]))
 		    return 0;
 	    return 1;
 	}
@@ -3908,7 +4229,7 @@ rhss_equal (rhs_t *rhs1, rhs_t *rhs2)
 		return 0;
 
 	    for (i = 0; i < num_args; ++i)
-		if (!primaries_equal(&rhs1->v.filter.args[i], &rhs2->v.filter.args[i]))
+		if (!primaries_equivalent(&rhs1->v.filter.args[i], &rhs2->v.filter.args[i]))
 		    return 0;
 	    return 1;
 	}
@@ -3922,7 +4243,7 @@ rhss_equal (rhs_t *rhs1, rhs_t *rhs2)
 		return 0;
 
 	    for (i = 0; i < num_args - 3; ++i)
-		if (!primaries_equal(&rhs1->v.closure.args[i], &rhs2->v.closure.args[i]))
+		if (!primaries_equivalent(&rhs1->v.closure.args[i], &rhs2->v.closure.args[i]))
 		    return 0;
 	    return 1;
 	}
@@ -3936,7 +4257,7 @@ rhss_equal (rhs_t *rhs1, rhs_t *rhs2)
 		    return FALSE;
 
 		for (i = 0; i < rhs1->v.tuple.length; ++i)
-		    if (!primaries_equal(&rhs1->v.tuple.args[i], &rhs2->v.tuple.args[i]))
+		    if (!primaries_equivalent(&rhs1->v.tuple.args[i], &rhs2->v.tuple.args[i]))
 			return FALSE;
 		return TRUE;
 	    }
@@ -3954,6 +4275,7 @@ compiler_replace_rhs (rhs_t **rhs, rhs_t *new, statement_t *stmt)
     compiler_remove_uses_in_rhs(*rhs, stmt);
 
     *rhs = new;
+    mark_stmt_dirty(stmt);
 
     COMPILER_FOR_EACH_VALUE_IN_RHS(*rhs, &_add_use_in_stmt, stmt);
 }
@@ -3964,61 +4286,95 @@ replace_rhs_with_value (rhs_t **rhs, value_t *val, statement_t *stmt)
     compiler_replace_rhs(rhs, make_value_rhs(val), stmt);
 }
 
-static void
-replace_rhs_recursively (statement_t *stmt, rhs_t *rhs, value_t *val, int *changed)
+#define HASH_COMBINE(h,x)	((h) * 31 + (guint)(x))
+
+static guint
+hash_primary (primary_t *primary)
 {
-    while (stmt != 0)
+    if (primary->kind == PRIMARY_VALUE)
+	return GPOINTER_TO_UINT(vn_leader(primary->v.value));
+
+    g_assert(primary->kind == PRIMARY_CONST);
+
+    switch (primary->const_type)
     {
-	switch (stmt->kind)
-	{
-	    case STMT_NIL :
-		break;
+	case TYPE_INT :
+	    return HASH_COMBINE(TYPE_INT, primary->v.constant.int_value);
 
-	    case STMT_PHI_ASSIGN :
-		if (rhss_equal(rhs, stmt->v.assign.rhs2))
-		{
-		    replace_rhs_with_value(&stmt->v.assign.rhs2, val, stmt);
-		    *changed = 1;
-		}
-	    case STMT_ASSIGN :
-		if (rhss_equal(rhs, stmt->v.assign.rhs))
-		{
-		    replace_rhs_with_value(&stmt->v.assign.rhs, val, stmt);
-		    *changed = 1;
-		}
-		break;
+	case TYPE_FLOAT :
+	    {
+		union { float f; guint32 i; } u;
 
-	    case STMT_IF_COND :
-		if (rhss_equal(rhs, stmt->v.if_cond.condition))
-		{
-		    replace_rhs_with_value(&stmt->v.if_cond.condition, val, stmt);
-		    *changed = 1;
-		}
-		replace_rhs_recursively(stmt->v.if_cond.consequent, rhs, val, changed);
-		replace_rhs_recursively(stmt->v.if_cond.alternative, rhs, val, changed);
-		replace_rhs_recursively(stmt->v.if_cond.exit, rhs, val, changed);
-		break;
+		u.f = primary->v.constant.float_value;
+		return HASH_COMBINE(TYPE_FLOAT, u.i);
+	    }
 
-	    case STMT_WHILE_LOOP :
-		if (rhss_equal(rhs, stmt->v.while_loop.invariant))
-		{
-		    replace_rhs_with_value(&stmt->v.while_loop.invariant, val, stmt);
-		    *changed = 1;
-		}
-		replace_rhs_recursively(stmt->v.while_loop.entry, rhs, val, changed);
-		replace_rhs_recursively(stmt->v.while_loop.body, rhs, val, changed);
-		break;
+	default :
+	    return primary->const_type;
+    }
+}
 
-	    default :
-		g_assert_not_reached();
-	}
+static guint
+hash_rhs (gconstpointer key)
+{
+    rhs_t *rhs = (rhs_t*)key;
 
-	stmt = stmt->next;
+    switch (rhs->kind)
+    {
+	case RHS_INTERNAL :
+	    return GPOINTER_TO_UINT(rhs->v.internal);
+
+	case RHS_OP :
+	    {
+		guint hash = rhs->v.op.op->index;
+		int i;
+
+		for (i = 0; i < rhs->v.op.op->num_args; ++i)
+		    hash = HASH_COMBINE(hash, hash_primary(&rhs->v.op.args[i]));
+		return hash;
+	    }
+
+	default :
+	    g_assert_not_reached();
     }
 }
 
+static gboolean
+_rhss_equal (gconstpointer a, gconstpointer b)
+{
+    return rhss_equal((rhs_t*)a, (rhs_t*)b);
+}
+
+static gboolean
+rhs_is_numbered (rhs_t *rhs)
+{
+    return rhs->kind == RHS_INTERNAL
+	|| (rhs->kind == RHS_OP && rhs->v.op.op->is_pure);
+}
+
+/* Returns whether the rhs was replaced. */
+static gboolean
+replace_if_available (rhs_t **rhs, statement_t *stmt, GHashTable *available, int *changed)
+{
+    value_t *value;
+
+    if (!rhs_is_numbered(*rhs))
+	return FALSE;
+
+    value = g_hash_table_lookup(available, *rhs);
+    if (value == NULL)
+	return FALSE;
+
+    replace_rhs_with_value(rhs, value, stmt);
+    *changed = 1;
+
+    return TRUE;
+}
+
+static void number_values_in_scope (statement_t *stmt, GHashTable *available, int *changed);
+
 static void
-cse_recursively (statement_t *stmt, int *changed)
+number_values_recursively (statement_t *stmt, GHashTable *available, GSList **scope, int *changed)
 {
     while (stmt != 0)
     {
@@ -4027,23 +4383,39 @@ cse_recursively (statement_t *stmt, int *changed)
 	    case STMT_NIL :
 		break;
 
-	    case STMT_ASSIGN :
-		if (stmt->v.assign.rhs->kind == RHS_INTERNAL
-		    || (stmt->v.assign.rhs->kind == RHS_OP
-			&& stmt->v.assign.rhs->v.op.op->is_pure))
-		    replace_rhs_recursively(stmt->next, stmt->v.assign.rhs, stmt->v.assign.lhs, changed);
+	    case STMT_PHI_ASSIGN :
+		replace_if_available(&stmt->v.assign.rhs2, stmt, available, changed);
+		replace_if_available(&stmt->v.assign.rhs, stmt, available, changed);
 		break;
 
-	    case STMT_PHI_ASSIGN :
+	    case STMT_ASSIGN :
+		{
+		    value_t *lhs = stmt->v.assign.lhs;
+
+		    if (!replace_if_available(&stmt->v.assign.rhs, stmt, available, changed)
+			&& rhs_is_numbered(stmt->v.assign.rhs))
+		    {
+			g_hash_table_insert(available, stmt->v.assign.rhs, lhs);
+			*scope = g_slist_prepend(*scope, stmt->v.assign.rhs);
+		    }
+
+		    if (stmt->v.assign.rhs->kind == RHS_PRIMARY
+			&& stmt->v.assign.rhs->v.primary.kind == PRIMARY_VALUE)
+			current_context()->vn_leaders[lhs->global_index] = vn_leader(stmt->v.assign.rhs->v.primary.v.value);
+		}
 		break;
 
 	    case STMT_IF_COND :
-		cse_recursively(stmt->v.if_cond.consequent, changed);
-		cse_recursively(stmt->v.if_cond.alternative, changed);
+		replace_if_available(&stmt->v.if_cond.condition, stmt, available, changed);
+		number_values_in_scope(stmt->v.if_cond.consequent, available, changed);
+		number_values_in_scope(stmt->v.if_cond.alternative, available, changed);
+		number_values_recursively(stmt->v.if_cond.exit, available, scope, changed);
 		break;
 
 	    case STMT_WHILE_LOOP :
-		cse_recursively(stmt->v.while_loop.body, changed);
+		number_values_recursively(stmt->v.while_loop.entry, available, scope, changed);
+		replace_if_available(&stmt->v.while_loop.invariant, stmt, available, changed);
+		number_values_in_scope(stmt->v.while_loop.body, available, changed);
 		break;
 
 	    default :
@@ -4054,12 +4426,32 @@ cse_recursively (statement_t *stmt, int *changed)
     }
 }
 
+static void
+number_values_in_scope (statement_t *stmt, GHashTable *available, int *changed)
+{
+    GSList *scope = NULL;
+    GSList *l;
+
+    number_values_recursively(stmt, available, &scope, changed);
+
+    for (l = scope; l != NULL; l = l->next)
+	g_hash_table_remove(available, l->data);
+    g_slist_free(scope);
+}
+
 static int
-common_subexpression_elimination (void)
+value_numbering (void)
 {
+    GHashTable *available = g_hash_table_new(hash_rhs, _rhss_equal);
     int changed = 0;
 
-    cse_recursively(first_stmt, &changed);
+    current_context()->vn_leaders = g_new0(value_t*, g_atomic_int_get(&current_compilation()->next_value_global_index));
+
+    number_values_in_scope(current_context()->first_stmt, available, &changed);
+
+    g_free(current_context()->vn_leaders);
+    current_context()->vn_leaders = NULL;
+    g_hash_table_destroy(available);
 
     return changed;
 }
@@ -4123,7 +4515,7 @@ optimize_tuple_nth (void)
 {
     gboolean changed = FALSE;
 
-    optimize_tuple_nth_recursively(first_stmt, &changed);
+    optimize_tuple_nth_recursively(current_context()->first_stmt, &changed);
 
     return changed;
 }
@@ -4209,7 +4601,7 @@ optimize_make_tuple (void)
 {
     gboolean changed = FALSE;
 
-    optimize_make_tuple_recursively(first_stmt, &changed);
+    optimize_make_tuple_recursively(current_context()->first_stmt, &changed);
 
     return changed;
 }
@@ -4326,7 +4718,7 @@ do_inlining (void)
 {
     gboolean changed = FALSE;
 
-    do_inlining_recursively(&first_stmt, &changed);
+    do_inlining_recursively(&current_context()->first_stmt, &changed);
 
     return changed;
 }
@@ -4602,7 +4994,7 @@ compiler_slice_code_for_const (statement_t *stmt, int const_type)
 #endif
 
 #ifdef PEDANTIC_CHECK_SSA
-#define CHECK_SSA	check_ssa(first_stmt)
+#define CHECK_SSA	check_ssa(current_context()->first_stmt)
 #else
 #define CHECK_SSA	do ; while (0)
 #endif
@@ -4624,170 +5016,485 @@ optimization_time_out (struct timeval *start, int timeout)
     return FALSE;
 }
 
+/* The passes of the optimization loop return how many changes they
+   made to the code, or just whether they changed it.  Every change
+   starts a new generation of the code.  A pass which didn't change
+   the code can't change it before some other pass has, so it is
+   skipped until the generation changes. */
+
+static int
+pass_closure_application (filter_t *filter)
+{
+    return optimize_closure_application();
+}
+
+static int
+pass_inlining (filter_t *filter)
+{
+    return do_inlining();
+}
+
+static int
+pass_copy_propagation (filter_t *filter)
+{
+    return copy_propagation();
+}
+
+static int
+pass_tuple_nth (filter_t *filter)
+{
+    return optimize_tuple_nth();
+}
+
+static int
+pass_make_tuple (filter_t *filter)
+{
+    return optimize_make_tuple();
+}
+
+static int
+pass_loop_invariant_code_motion (filter_t *filter)
+{
+    return compiler_opt_loop_invariant_code_motion(&current_context()->first_stmt);
+}
+
+static int
+pass_value_numbering (filter_t *filter)
+{
+    return value_numbering();
+}
+
+static int
+pass_fold_and_simplify (filter_t *filter)
+{
+    return fold_and_simplify();
+}
+
+static int
+pass_orig_val_resize (filter_t *filter)
+{
+    return compiler_opt_orig_val_resize(&current_context()->first_stmt);
+}
+
+static int
+pass_strip_resize (filter_t *filter)
+{
+    return compiler_opt_strip_resize(&current_context()->first_stmt);
+}
+
+static int
+pass_simplify (filter_t *filter)
+{
+    return compiler_opt_simplify(filter, current_context()->first_stmt);
+}
+
+static int
+pass_dead_assignments (filter_t *filter)
+{
+    return compiler_opt_remove_dead_assignments(current_context()->first_stmt);
+}
+
+static int
+pass_dead_branches (filter_t *filter)
+{
+    return remove_dead_branches();
+}
+
+static int
+pass_dead_controls (filter_t *filter)
+{
+    return remove_dead_controls();
+}
+
+typedef struct
+{
+    const char *name;
+    int (*func) (filter_t *filter);
+    /* whether all changes the pass makes to operands go through the
+       def-use chains, so the dirty statements are known afterwards */
+    gboolean updates_uses;
+} optimization_pass_t;
+
+static optimization_pass_t optimization_passes[] = {
+    { "closure application", pass_closure_application, FALSE },
+    { "inlining", pass_inlining, FALSE },
+    { "copy propagation", pass_copy_propagation, TRUE },
+    { "tuple_nth", pass_tuple_nth, FALSE },
+    { "make_tuple", pass_make_tuple, FALSE },
+    { "loop invariant code motion", pass_loop_invariant_code_motion, FALSE },
+    { "value numbering", pass_value_numbering, TRUE },
+    { "copy propagation after vn", pass_copy_propagation, TRUE },
+    { "folding and op simplification", pass_fold_and_simplify, TRUE },
+    { "orig_val resize", pass_orig_val_resize, FALSE },
+    { "strip resize", pass_strip_resize, FALSE },
+    { "simplification", pass_simplify, FALSE },
+    { "dead assignment removal", pass_dead_assignments, TRUE },
+    { "dead branch removal", pass_dead_branches, FALSE },
+    { "dead control removal", pass_dead_controls, FALSE }
+};
+
+#define NUM_OPTIMIZATION_PASSES		(sizeof(optimization_passes) / sizeof(optimization_pass_t))
+
+typedef struct
+{
+    int clean_generation;	/* -1 if the pass hasn't come clean yet */
+    int num_runs;
+    int num_changes;
+    double time;		/* in seconds */
+} optimization_pass_stats_t;
+
+static double
+seconds_since (struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Runs each pass once, unless it is known not to change anything.
+   Returns whether the code was changed. */
+static gboolean
+run_optimization_passes (filter_t *filter, optimization_pass_stats_t *stats, int *generation, gboolean debug_output)
+{
+    gboolean changed = FALSE;
+    int i;
+
+    for (i = 0; i < NUM_OPTIMIZATION_PASSES; ++i)
+    {
+	struct timeval start;
+	int num_changes;
+
+	if (stats[i].clean_generation == *generation)
+	    continue;
+
+	gettimeofday(&start, NULL);
+	num_changes = optimization_passes[i].func(filter);
+	stats[i].time += seconds_since(&start);
+	++stats[i].num_runs;
+	CHECK_SSA;
+
+	if (num_changes > 0)
+	{
+	    stats[i].num_changes += num_changes;
+	    ++*generation;
+	    changed = TRUE;
+
+	    if (!optimization_passes[i].updates_uses)
+		mark_all_stmts_dirty();
+
+	    if (debug_output)
+	    {
+		printf("-------------------------------- after %s\n", optimization_passes[i].name);
+		dump_code(current_context()->first_stmt, 0);
+	    }
+	}
+	else
+	    stats[i].clean_generation = *generation;
+    }
+
+    return changed;
+}
+
+static void
+print_optimization_pass_stats (optimization_pass_stats_t *stats)
+{
+    int i;
+
+    printf("%-28s %6s %8s %10s\n", "pass", "runs", "changes", "time (s)");
+    for (i = 0; i < NUM_OPTIMIZATION_PASSES; ++i)
+	printf("%-28s %6d %8d %10.4f\n", optimization_passes[i].name,
+	       stats[i].num_runs, stats[i].num_changes, stats[i].time);
+}
+
+/*** compilations ***/
+
+static compilation_t*
+start_compilation (void)
+{
+    compilation_t *compilation = g_new0(compilation_t, 1);
+
+    g_assert(g_static_private_get(&compilation_key) == NULL);
+
+    if (!g_thread_supported())
+	g_thread_init (NULL);
+
+    compilation->next_value_global_index = 0;
+    compilation->mutex = g_mutex_new();
+    compilation->contexts = NULL;
+    init_pools(&compilation->pools);
+
+    g_static_private_set(&compilation_key, compilation, NULL);
+
+    return compilation;
+}
+
+static compiler_context_t*
+enter_new_context (compilation_t *compilation)
+{
+    compiler_context_t *context = g_new0(compiler_context_t, 1);
+
+    init_pools(&context->pools);
+
+    context->next_temp_number = 1;
+    context->next_compvar_number = 1;
+    context->vector_variables = g_hash_table_new(g_direct_hash, g_direct_equal);
+    context->variable_compvars = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    g_mutex_lock(compilation->mutex);
+    context->next = compilation->contexts;
+    compilation->contexts = context;
+    g_mutex_unlock(compilation->mutex);
+
+    g_static_private_set(&context_key, context, NULL);
+
+    return context;
+}
+
+static void
+leave_context (compiler_context_t *context)
+{
+    g_assert(current_context() == context);
+
+    g_static_private_set(&context_key, NULL, NULL);
+}
+
+static void
+free_context (compiler_context_t *context)
+{
+    if (context->dirty_stmts != NULL)
+	g_hash_table_destroy(context->dirty_stmts);
+    g_hash_table_unref(context->vector_variables);
+    g_hash_table_unref(context->variable_compvars);
+    free_pools(&context->pools);
+    g_free(context);
+}
+
+/* Generates the code for filter in a new context.  If this thread
+   doesn't take part in a compilation yet, one is started, which must
+   be finished with compiler_free_pools. */
 filter_code_t*
 compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_types, int timeout, gboolean debug_output)
 {
+    compilation_t *compilation = (compilation_t*)g_static_private_get(&compilation_key);
+    compiler_context_t *context;
     gboolean changed;
+    optimization_pass_stats_t pass_stats[NUM_OPTIMIZATION_PASSES];
+    int generation = 0;
     filter_code_t *code;
     compvar_t *tuple_tmp, *dummy;
     struct timeval tv;
+    int i;
 
     g_assert(filter->kind == FILTER_MATHMAP);
 
     gettimeofday(&tv, NULL);
 
-    next_temp_number = 1;
-    next_compvar_number = 1;
-    next_value_global_index = 0;
-    inlining_history = NULL;
+    if (compilation == NULL)
+	compilation = start_compilation();
+    context = enter_new_context(compilation);
 
     tuple_tmp = make_temporary(TYPE_TUPLE);
-    first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, inlining_history);
+    context->first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, context->inlining_history);
 
-    emit_loc = &(last_stmt_of_block(first_stmt)->next);
+    context->emit_loc = &(last_stmt_of_block(context->first_stmt)->next);
 
     dummy = make_temporary(TYPE_INT);
     emit_assign(make_lhs(dummy), make_op_rhs(OP_OUTPUT_TUPLE, make_compvar_primary(tuple_tmp)));
 
-    emit_loc = NULL;
+    context->emit_loc = NULL;
+
+    for (i = 0; i < NUM_OPTIMIZATION_PASSES; ++i)
+    {
+	pass_stats[i].clean_generation = -1;
+	pass_stats[i].num_runs = 0;
+	pass_stats[i].num_changes = 0;
+	pass_stats[i].time = 0.0;
+    }
 
     changed = TRUE;
     while (changed && !optimization_time_out(&tv, timeout))
     {
 #ifdef DEBUG_OUTPUT
-	check_ssa(first_stmt);
+	check_ssa(context->first_stmt);
 #endif
 
 	if (debug_output)
 	{
 	    printf("--------------------------------\n");
-	    dump_code(first_stmt, 0);
+	    dump_code(context->first_stmt, 0);
 	}
 
-	optimize_closure_application(first_stmt);
-	CHECK_SSA;
-
-	changed = FALSE;
-
-	changed = do_inlining() || changed;
-	CHECK_SSA;
-	changed = copy_propagation() || changed;
-	CHECK_SSA;
-	changed = optimize_tuple_nth() || changed;
-	CHECK_SSA;
-	changed = optimize_make_tuple() || changed;
-	CHECK_SSA;
-	/*
-	changed = compiler_opt_loop_invariant_code_motion(&first_stmt) || changed;
-	CHECK_SSA;
-	*/
-	changed = common_subexpression_elimination() || changed;
-	CHECK_SSA;
-	changed = copy_propagation() || changed;
-	CHECK_SSA;
-	changed = constant_folding() || changed;
-	CHECK_SSA;
-	changed = simplify_ops() || changed;
-	CHECK_SSA;
-
-	if (debug_output)
-	{
-	    printf("-------------------------------- before resize\n");
-	    dump_code(first_stmt, 0);
-	}
-	changed = compiler_opt_orig_val_resize(&first_stmt) || changed;
-	CHECK_SSA;
-	if (debug_output)
-	{
-	    printf("-------------------------------- after resize\n");
-	    dump_code(first_stmt, 0);
-	}
-
-	changed = compiler_opt_strip_resize(&first_stmt) || changed;
-	CHECK_SSA;
-	changed = compiler_opt_simplify(filter, first_stmt) || changed;
-	CHECK_SSA;
-
-	changed = compiler_opt_remove_dead_assignments(first_stmt) || changed;
-	CHECK_SSA;
-	changed = remove_dead_branches() || changed;
-	CHECK_SSA;
-	changed = remove_dead_controls() || changed;
+	changed = run_optimization_passes(filter, pass_stats, &generation, debug_output);
     }
 
+    if (debug_output)
+	print_optimization_pass_stats(pass_stats);
+
     CHECK_SSA;
     propagate_types();
 
 #ifdef DEBUG_OUTPUT
-    check_ssa(first_stmt);
+    check_ssa(context->first_stmt);
 #endif
 
 #ifndef NO_CONSTANTS_ANALYSIS
     if (constant_analysis)
+    {
 	analyze_constants();
+	analyze_userval_uses(filter);
+    }
 #endif
 
     if (debug_output)
     {
 	printf("----------- final ---------------------\n");
-	dump_code(first_stmt, 0);
+	dump_code(context->first_stmt, 0);
     }
-    check_ssa(first_stmt);
+    check_ssa(context->first_stmt);
 
     /* no statement reordering after this point */
 
-    code = (filter_code_t*)pools_alloc(&compiler_pools, sizeof(filter_code_t));
+    code = (filter_code_t*)pools_alloc(&context->pools, sizeof(filter_code_t));
 
     code->filter = filter;
-    code->first_stmt = first_stmt;
+    code->first_stmt = context->first_stmt;
+
+    context->first_stmt = 0;
 
-    first_stmt = 0;
+    leave_context(context);
 
     return code;
 }
 
+typedef struct
+{
+    compilation_t *compilation;
+    filter_t **filters;
+    filter_code_t **filter_codes;
+    int num_filters;
+    volatile gint next_filter;
+    int timeout;
+    filter_t *debug_filter;
+} compile_filters_job_t;
+
+static void
+compile_filters_from_job (compile_filters_job_t *job)
+{
+    int i;
+
+    while ((i = g_atomic_int_exchange_and_add(&job->next_filter, 1)) < job->num_filters)
+    {
+	filter_t *filter = job->filters[i];
+
+	if (filter->kind != FILTER_MATHMAP)
+	    continue;
+
+#ifdef DEBUG_OUTPUT
+	g_print("compiling filter %s\n", filter->name);
+#endif
+	job->filter_codes[i] = compiler_generate_ir_code(filter, 1, 0, job->timeout, filter == job->debug_filter);
+    }
+}
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+static void
+compile_filters_thread_func (gpointer data)
+{
+    compile_filters_job_t *job = (compile_filters_job_t*)data;
+
+    g_static_private_set(&compilation_key, job->compilation, NULL);
+    compile_filters_from_job(job);
+    g_static_private_set(&compilation_key, NULL, NULL);
+}
+#endif
+
+/* The filters don't depend on each other's code, so they are compiled
+   in parallel, each in its own context. */
 filter_code_t**
 compiler_compile_filters (mathmap_t *mathmap, int timeout)
 {
-    filter_code_t **filter_codes;
-    int num_filters, i;
+    compile_filters_job_t job;
+    int num_mathmap_filters, i;
     filter_t *filter;
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    thread_handle_t *threads;
+    int num_threads;
+#endif
+
+    job.compilation = start_compilation();
+    job.num_filters = 0;
+    job.next_filter = 0;
+    job.timeout = timeout;
 #ifdef DEBUG_OUTPUT
-    gboolean debug_output = TRUE;
+    job.debug_filter = mathmap->main_filter;
 #else
-    gboolean debug_output = FALSE;
+    job.debug_filter = NULL;
 #endif
 
-    init_pools(&compiler_pools);
-    vector_variables = g_hash_table_new(g_direct_hash, g_direct_equal);
-
-    num_filters = 0;
+    num_mathmap_filters = 0;
     for (filter = mathmap->filters; filter != 0; filter = filter->next)
-	++num_filters;
+    {
+	++job.num_filters;
+	if (filter->kind == FILTER_MATHMAP)
+	    ++num_mathmap_filters;
+    }
 
-    filter_codes = (filter_code_t**)pools_alloc(&compiler_pools, sizeof(filter_code_t*) * num_filters);
+    job.filters = (filter_t**)pools_alloc(&job.compilation->pools, sizeof(filter_t*) * job.num_filters);
+    job.filter_codes = (filter_code_t**)pools_alloc(&job.compilation->pools, sizeof(filter_code_t*) * job.num_filters);
 
     for (i = 0, filter = mathmap->filters;
 	 filter != 0;
 	 ++i, filter = filter->next)
     {
-	if (filter->kind != FILTER_MATHMAP)
-	    continue;
+	job.filters[i] = filter;
+	job.filter_codes[i] = NULL;
+    }
 
-#ifdef DEBUG_OUTPUT
-	g_print("compiling filter %s\n", filter->name);
-#endif
-	filter_codes[i] = compiler_generate_ir_code(filter, 1, 0, timeout, debug_output && filter == mathmap->main_filter);
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    /* this thread compiles, too */
+    num_threads = MIN(get_num_cpus(), num_mathmap_filters) - 1;
+    if (num_threads > 0)
+    {
+	threads = g_new(thread_handle_t, num_threads);
+	for (i = 0; i < num_threads; ++i)
+	    threads[i] = mathmap_thread_start(compile_filters_thread_func, &job);
     }
+    else
+	threads = NULL;
+#endif
+
+    compile_filters_from_job(&job);
 
-    return filter_codes;
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    for (i = 0; i < num_threads; ++i)
+	mathmap_thread_join(threads[i]);
+    g_free(threads);
+#endif
+
+    return job.filter_codes;
 }
 
+/* Frees the code of all filters compiled by this thread's compilation. */
 void
 compiler_free_pools (mathmap_t *mathmap)
 {
-    g_hash_table_unref(vector_variables);
-    free_pools(&compiler_pools);
+    compilation_t *compilation = current_compilation();
+
+    while (compilation->contexts != NULL)
+    {
+	compiler_context_t *next = compilation->contexts->next;
+
+	free_context(compilation->contexts);
+	compilation->contexts = next;
+    }
+
+    g_mutex_free(compilation->mutex);
+    free_pools(&compilation->pools);
+    g_free(compilation);
+
+    g_static_private_set(&compilation_key, NULL, NULL);
 }
 
 /*** inits ***/
@@ -0,0 +1,299 @@
+/*
+ * escape.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <glib.h>
+
+#include "../compiler-internals.h"
+
+/*** escape analysis ***/
+
+/* A tuple escapes if it is captured by a closure or passed to an
+   operation that might keep a pointer to it, which is any operation
+   with side effects or with a pointer result.  Everything else only
+   reads its elements.  The output tuple escapes unless it is used
+   before the end of the pixel's code. */
+
+static gboolean
+type_is_pointer (type_t type)
+{
+    return type == TYPE_CURVE || type == TYPE_GRADIENT || type == TYPE_IMAGE
+	|| type == TYPE_TUPLE || type == TYPE_TREE_VECTOR;
+}
+
+/* Operations without pointer results don't allocate. */
+static gboolean
+op_may_allocate (operation_t *op)
+{
+    return op->type_prop == TYPE_PROP_CONST && type_is_pointer(op->const_type);
+}
+
+static gboolean
+op_may_keep_args (operation_t *op, gboolean output_escapes)
+{
+    if (op->index == OP_OUTPUT_TUPLE)
+	return output_escapes;
+    return !op->is_pure || op_may_allocate(op);
+}
+
+static void
+_add_value (value_t *value, void *info)
+{
+    CLOSURE_VAR(value_set_t*, set, 0);
+
+    compiler_value_set_add(set, value);
+}
+
+static void
+add_escaping_values_in_rhs (rhs_t *rhs, value_set_t *escaping, gboolean output_escapes)
+{
+    switch (rhs->kind)
+    {
+	case RHS_OP :
+	    if (op_may_keep_args(rhs->v.op.op, output_escapes))
+		COMPILER_FOR_EACH_VALUE_IN_RHS(rhs, &_add_value, escaping);
+	    break;
+
+	case RHS_FILTER :
+	case RHS_CLOSURE :
+	    COMPILER_FOR_EACH_VALUE_IN_RHS(rhs, &_add_value, escaping);
+	    break;
+
+	default :
+	    break;
+    }
+}
+
+static void
+find_escaping_values_initially (statement_t *stmt, value_set_t *escaping, gboolean output_escapes)
+{
+    while (stmt != NULL)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_PHI_ASSIGN :
+		add_escaping_values_in_rhs(stmt->v.assign.rhs2, escaping, output_escapes);
+	    case STMT_ASSIGN :
+		add_escaping_values_in_rhs(stmt->v.assign.rhs, escaping, output_escapes);
+		break;
+
+	    case STMT_IF_COND :
+		add_escaping_values_in_rhs(stmt->v.if_cond.condition, escaping, output_escapes);
+		find_escaping_values_initially(stmt->v.if_cond.consequent, escaping, output_escapes);
+		find_escaping_values_initially(stmt->v.if_cond.alternative, escaping, output_escapes);
+		find_escaping_values_initially(stmt->v.if_cond.exit, escaping, output_escapes);
+		break;
+
+	    case STMT_WHILE_LOOP :
+		add_escaping_values_in_rhs(stmt->v.while_loop.invariant, escaping, output_escapes);
+		find_escaping_values_initially(stmt->v.while_loop.entry, escaping, output_escapes);
+		find_escaping_values_initially(stmt->v.while_loop.body, escaping, output_escapes);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+
+	stmt = stmt->next;
+    }
+}
+
+static void
+propagate_through_copy (value_t *lhs, rhs_t *rhs, value_set_t *escaping, gboolean *changed)
+{
+    value_t *value;
+
+    if (rhs->kind != RHS_PRIMARY || rhs->v.primary.kind != PRIMARY_VALUE)
+	return;
+
+    value = rhs->v.primary.v.value;
+    if (compiler_value_set_contains(escaping, lhs) && !compiler_value_set_contains(escaping, value))
+    {
+	compiler_value_set_add(escaping, value);
+	*changed = TRUE;
+    }
+}
+
+/* A copy of an escaping value makes the copied value escape, too. */
+static void
+propagate_escaping_values (statement_t *stmt, value_set_t *escaping, gboolean *changed)
+{
+    while (stmt != NULL)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_PHI_ASSIGN :
+		propagate_through_copy(stmt->v.assign.lhs, stmt->v.assign.rhs2, escaping, changed);
+	    case STMT_ASSIGN :
+		propagate_through_copy(stmt->v.assign.lhs, stmt->v.assign.rhs, escaping, changed);
+		break;
+
+	    case STMT_IF_COND :
+		propagate_escaping_values(stmt->v.if_cond.consequent, escaping, changed);
+		propagate_escaping_values(stmt->v.if_cond.alternative, escaping, changed);
+		propagate_escaping_values(stmt->v.if_cond.exit, escaping, changed);
+		break;
+
+	    case STMT_WHILE_LOOP :
+		propagate_escaping_values(stmt->v.while_loop.entry, escaping, changed);
+		propagate_escaping_values(stmt->v.while_loop.body, escaping, changed);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+
+	stmt = stmt->next;
+    }
+}
+
+static void
+collect_local_tuples (statement_t *stmt, value_set_t *escaping, value_set_t *local_tuples)
+{
+    while (stmt != NULL)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_ASSIGN :
+		if (stmt->v.assign.rhs->kind == RHS_TUPLE
+		    && !compiler_value_set_contains(escaping, stmt->v.assign.lhs))
+		    compiler_value_set_add(local_tuples, stmt->v.assign.lhs);
+		break;
+
+	    case STMT_IF_COND :
+		collect_local_tuples(stmt->v.if_cond.consequent, escaping, local_tuples);
+		collect_local_tuples(stmt->v.if_cond.alternative, escaping, local_tuples);
+		break;
+
+	    /* A tuple made in a loop could still be live when the next
+	       iteration makes it again, so it needs fresh memory every
+	       time. */
+	    case STMT_WHILE_LOOP :
+	    default :
+		break;
+	}
+
+	stmt = stmt->next;
+    }
+}
+
+/* Returns the set of values defined by tuple constructions that are
+   executed at most once per pixel and never escape it, so their
+   tuples can live on the stack instead of in the pools.
+   output_escapes says whether the output tuple is used after the
+   pixel's code. */
+value_set_t*
+compiler_opt_find_local_tuples (statement_t *first_stmt, gboolean output_escapes)
+{
+    value_set_t *escaping = compiler_new_value_set();
+    value_set_t *local_tuples = compiler_new_value_set();
+    gboolean changed;
+
+    find_escaping_values_initially(first_stmt, escaping, output_escapes);
+
+    do
+    {
+	changed = FALSE;
+	propagate_escaping_values(first_stmt, escaping, &changed);
+    } while (changed);
+
+    collect_local_tuples(first_stmt, escaping, local_tuples);
+
+    compiler_free_value_set(escaping);
+
+    return local_tuples;
+}
+
+static gboolean
+rhs_allocates (rhs_t *rhs, value_t *lhs, value_set_t *local_tuples)
+{
+    switch (rhs->kind)
+    {
+	case RHS_TUPLE :
+	    return lhs == NULL || !compiler_value_set_contains(local_tuples, lhs);
+
+	case RHS_TREE_VECTOR :
+	case RHS_FILTER :
+	case RHS_CLOSURE :
+	    return TRUE;
+
+	case RHS_OP :
+	    return op_may_allocate(rhs->v.op.op);
+
+	default :
+	    return FALSE;
+    }
+}
+
+/* Whether the statements in the slice given by slice_flag might
+   allocate from the pools, with the tuples in local_tuples kept on
+   the stack. */
+gboolean
+compiler_code_allocates (statement_t *stmt, unsigned int slice_flag, value_set_t *local_tuples)
+{
+    while (stmt != NULL)
+    {
+	if ((stmt->slice_flags & slice_flag) != 0)
+	{
+	    switch (stmt->kind)
+	    {
+		case STMT_NIL :
+		    break;
+
+		case STMT_PHI_ASSIGN :
+		    if (rhs_allocates(stmt->v.assign.rhs2, NULL, local_tuples))
+			return TRUE;
+		case STMT_ASSIGN :
+		    if (rhs_allocates(stmt->v.assign.rhs, stmt->v.assign.lhs, local_tuples))
+			return TRUE;
+		    break;
+
+		case STMT_IF_COND :
+		    if (rhs_allocates(stmt->v.if_cond.condition, NULL, local_tuples)
+			|| compiler_code_allocates(stmt->v.if_cond.consequent, slice_flag, local_tuples)
+			|| compiler_code_allocates(stmt->v.if_cond.alternative, slice_flag, local_tuples)
+			|| compiler_code_allocates(stmt->v.if_cond.exit, slice_flag, local_tuples))
+			return TRUE;
+		    break;
+
+		case STMT_WHILE_LOOP :
+		    if (rhs_allocates(stmt->v.while_loop.invariant, NULL, local_tuples)
+			|| compiler_code_allocates(stmt->v.while_loop.entry, slice_flag, local_tuples)
+			|| compiler_code_allocates(stmt->v.while_loop.body, slice_flag, local_tuples))
+			return TRUE;
+		    break;
+
+		default :
+		    g_assert_not_reached();
+	    }
+	}
+
+	stmt = stmt->next;
+    }
+
+    return FALSE;
+}
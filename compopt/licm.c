@@ -24,6 +24,18 @@
 
 #include "../compiler-internals.h"
 
+/*** loop invariant code motion ***/
+
+/* Assignments at the top level of a loop body whose right hand sides
+   only use values defined before the loop are moved in front of it.
+   The values defined by the loop's entry phis change with every
+   iteration, so they are not invariant.  Only assignments without side
+   effects are moved, and conditional code in the body is left alone.
+
+   Unless the loop's condition is known to be true on entry, the moved
+   code is executed even if the loop body is not, so then only cheap
+   operations are moved, which can't trap.  Integer division can. */
+
 static void
 add_values_from_phis (statement_t *stmt, value_set_t *set_values)
 {
@@ -46,42 +58,6 @@ add_values_from_phis (statement_t *stmt, value_set_t *set_values)
     }
 }
 
-static void
-add_values_from_stmt (statement_t *stmt, value_set_t *set_values)
-{
-    switch (stmt->kind)
-    {
-	case STMT_NIL :
-	    break;
-
-	case STMT_ASSIGN :
-	case STMT_PHI_ASSIGN :
-	    compiler_value_set_add(set_values, stmt->v.assign.lhs);
-	    break;
-
-	case STMT_IF_COND :
-	    add_values_from_phis(stmt->v.if_cond.exit, set_values);
-	    break;
-
-	case STMT_WHILE_LOOP :
-	    add_values_from_phis(stmt->v.while_loop.entry, set_values);
-	    break;
-
-	default :
-	    g_assert_not_reached();
-    }
-}
-
-static void
-add_values_from_stmts (statement_t *stmts, value_set_t *set_values)
-{
-    while (stmts != NULL)
-    {
-	add_values_from_stmt(stmts, set_values);
-	stmts = stmts->next;
-    }
-}
-
 static void
 _check_value_in_set (value_t *value, void *info)
 {
@@ -92,115 +68,163 @@ _check_value_in_set (value_t *value, void *info)
 	*all_values_in_set = FALSE;
 }
 
-static gboolean stmts_only_contain_values_in_set (statement_t *stmts, value_set_t *values);
-
 static gboolean
-stmt_only_contains_values_in_set (statement_t *stmt, value_set_t *values)
+rhs_is_pure (rhs_t *rhs)
 {
-    gboolean all_values_in_set = TRUE;
-
-    switch (stmt->kind)
+    switch (rhs->kind)
     {
-	case STMT_NIL :
+	case RHS_PRIMARY :
+	case RHS_INTERNAL :
 	    return TRUE;
 
-	case STMT_PHI_ASSIGN :
-	    COMPILER_FOR_EACH_VALUE_IN_RHS(stmt->v.assign.rhs2, &_check_value_in_set, values, &all_values_in_set);
-	case STMT_ASSIGN :
-	    if (all_values_in_set)
-		COMPILER_FOR_EACH_VALUE_IN_RHS(stmt->v.assign.rhs, &_check_value_in_set, values, &all_values_in_set);
-	    return all_values_in_set;
-
-	case STMT_IF_COND :
-	    {
-		value_set_t *values_copy;
-
-		COMPILER_FOR_EACH_VALUE_IN_RHS(stmt->v.if_cond.condition, &_check_value_in_set, values, &all_values_in_set);
-		if (!all_values_in_set)
-		    return FALSE;
-		if (!stmts_only_contain_values_in_set(stmt->v.if_cond.consequent, values))
-		    return FALSE;
-		if (!stmts_only_contain_values_in_set(stmt->v.if_cond.alternative, values))
-		    return FALSE;
+	case RHS_OP :
+	    return rhs->v.op.op->is_pure;
 
-		values_copy = compiler_value_set_copy(values);
-		add_values_from_stmts(stmt->v.if_cond.consequent, values_copy);
-		add_values_from_stmts(stmt->v.if_cond.alternative, values_copy);
-		all_values_in_set = stmts_only_contain_values_in_set(stmt->v.if_cond.exit, values_copy);
-		compiler_free_value_set(values_copy);
+	default :
+	    return FALSE;
+    }
+}
 
-		return all_values_in_set;
-	    }
+static gboolean
+rhs_is_cheap (rhs_t *rhs)
+{
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	case RHS_INTERNAL :
+	    return TRUE;
 
-	case STMT_WHILE_LOOP :
+	case RHS_OP :
+	    switch (compiler_op_index(rhs->v.op.op))
 	    {
-		value_set_t *values_copy;
-
-		values_copy = compiler_value_set_copy(values);
-		add_values_from_phis(stmt->v.while_loop.entry, values_copy);
-		COMPILER_FOR_EACH_VALUE_IN_RHS(stmt->v.while_loop.invariant, &_check_value_in_set, values, &all_values_in_set);
-		if (all_values_in_set)
-		    all_values_in_set = stmts_only_contain_values_in_set(stmt->v.while_loop.body, values_copy);
-		if (all_values_in_set)
-		{
-		    add_values_from_stmts(stmt->v.while_loop.body, values_copy);
-		    all_values_in_set = stmts_only_contain_values_in_set(stmt->v.while_loop.entry, values_copy);
-		}
-		compiler_free_value_set(values_copy);
-
-		return all_values_in_set;
+		case OP_INT_TO_FLOAT :
+		case OP_FLOAT_TO_INT :
+		case OP_INT_TO_COMPLEX :
+		case OP_FLOAT_TO_COMPLEX :
+		case OP_ADD :
+		case OP_SUB :
+		case OP_NEG :
+		case OP_MUL :
+		case OP_ABS :
+		case OP_MIN :
+		case OP_MAX :
+		case OP_FLOOR :
+		case OP_CEIL :
+		case OP_EQ :
+		case OP_LESS :
+		case OP_LEQ :
+		case OP_NOT :
+		case OP_COMPLEX :
+		case OP_C_REAL :
+		case OP_C_IMAG :
+		case OP_RED :
+		case OP_GREEN :
+		case OP_BLUE :
+		case OP_ALPHA :
+		case OP_TUPLE_NTH :
+		case OP_TREE_VECTOR_NTH :
+		case OP_USERVAL_INT :
+		case OP_USERVAL_FLOAT :
+		case OP_USERVAL_BOOL :
+		case OP_USERVAL_COLOR :
+		case OP_USERVAL_CURVE :
+		case OP_USERVAL_GRADIENT :
+		case OP_USERVAL_IMAGE :
+		case OP_IMAGE_PIXEL_WIDTH :
+		case OP_IMAGE_PIXEL_HEIGHT :
+		    return TRUE;
+
+		default :
+		    return FALSE;
 	    }
 
 	default :
-	    g_assert_not_reached();
+	    return FALSE;
     }
-
-    g_assert_not_reached();
 }
 
+/* Whether the loop's condition is a constant true on entry, so its
+   body is executed at least once. */
 static gboolean
-stmts_only_contain_values_in_set (statement_t *stmts, value_set_t *values)
+body_is_always_executed (statement_t *loop)
 {
-    values = compiler_value_set_copy(values);
+    rhs_t *condition = loop->v.while_loop.invariant;
+    primary_t primary;
+
+    if (condition->kind != RHS_PRIMARY)
+	return FALSE;
+    primary = condition->v.primary;
 
-    while (stmts != NULL)
+    /* the condition's value on entry is the first argument of its
+       entry phi */
+    if (primary.kind == PRIMARY_VALUE)
     {
-	if (!stmt_only_contains_values_in_set(stmts, values))
-	{
-	    compiler_free_value_set(values);
-	    return FALSE;
-	}
+	statement_t *phi;
 
-	add_values_from_stmt(stmts, values);
+	for (phi = loop->v.while_loop.entry; phi != NULL; phi = phi->next)
+	    if (phi->kind == STMT_PHI_ASSIGN && phi->v.assign.lhs == primary.v.value)
+		break;
 
-	stmts = stmts->next;
+	if (phi == NULL || phi->v.assign.rhs->kind != RHS_PRIMARY)
+	    return FALSE;
+	primary = phi->v.assign.rhs->v.primary;
     }
 
-    compiler_free_value_set(values);
+    if (primary.kind != PRIMARY_CONST)
+	return FALSE;
 
-    return TRUE;
+    switch (primary.const_type)
+    {
+	case TYPE_INT :
+	    return primary.v.constant.int_value != 0;
+
+	case TYPE_FLOAT :
+	    return primary.v.constant.float_value != 0.0;
+
+	default :
+	    return FALSE;
+    }
 }
 
 static gboolean
+stmt_is_invariant (statement_t *stmt, value_set_t *set_values, gboolean speculative)
+{
+    gboolean all_values_in_set = TRUE;
+
+    if (stmt->kind != STMT_ASSIGN || !rhs_is_pure(stmt->v.assign.rhs))
+	return FALSE;
+    if (speculative && !rhs_is_cheap(stmt->v.assign.rhs))
+	return FALSE;
+
+    COMPILER_FOR_EACH_VALUE_IN_RHS(stmt->v.assign.rhs, &_check_value_in_set, set_values, &all_values_in_set);
+
+    return all_values_in_set;
+}
+
+/* Returns the number of statements hoisted out of the loop. */
+static int
 process_loop (statement_t **loop, value_set_t *set_values)
 {
     statement_t **iter;
-    gboolean did_change = FALSE;
+    int num_hoisted = 0;
+    gboolean speculative;
 
     set_values = compiler_value_set_copy(set_values);
 
     g_assert((*loop)->kind == STMT_WHILE_LOOP);
 
+    speculative = !body_is_always_executed(*loop);
+
     iter = &(*loop)->v.while_loop.body;
     while (*iter != NULL)
     {
-	if (stmt_only_contains_values_in_set(*iter, set_values))
+	if (stmt_is_invariant(*iter, set_values, speculative))
 	{
 	    statement_t *stmt = compiler_stmt_unlink(iter);
 
 	    loop = compiler_stmt_insert_before(stmt, loop);
-	    add_values_from_stmt(stmt, set_values);
-	    did_change = TRUE;
+	    compiler_value_set_add(set_values, stmt->v.assign.lhs);
+	    ++num_hoisted;
 	}
 	else
 	    iter = &(*iter)->next;
@@ -208,11 +232,11 @@ process_loop (statement_t **loop, value_set_t *set_values)
 
     compiler_free_value_set(set_values);
 
-    return did_change;
+    return num_hoisted;
 }
 
 static void
-recurse (statement_t **stmtp, value_set_t *set_values, gboolean *did_change)
+recurse (statement_t **stmtp, value_set_t *set_values, int *num_hoisted)
 {
     while (*stmtp != NULL)
     {
@@ -232,11 +256,11 @@ recurse (statement_t **stmtp, value_set_t *set_values, gboolean *did_change)
 		    value_set_t *set_values_copy;
 
 		    set_values_copy = compiler_value_set_copy(set_values);
-		    recurse(&stmt->v.if_cond.consequent, set_values_copy, did_change);
+		    recurse(&stmt->v.if_cond.consequent, set_values_copy, num_hoisted);
 		    compiler_free_value_set(set_values_copy);
 
 		    set_values_copy = compiler_value_set_copy(set_values);
-		    recurse(&stmt->v.if_cond.alternative, set_values_copy, did_change);
+		    recurse(&stmt->v.if_cond.alternative, set_values_copy, num_hoisted);
 		    compiler_free_value_set(set_values_copy);
 
 		    add_values_from_phis(stmt->v.if_cond.exit, set_values);
@@ -244,20 +268,27 @@ recurse (statement_t **stmtp, value_set_t *set_values, gboolean *did_change)
 		break;
 
 	    case STMT_WHILE_LOOP :
-		if (process_loop(stmtp, set_values))
 		{
-		    *did_change = TRUE;
-		    continue;
-		}
-		else
-		{
-		    value_set_t *set_values_copy;
-
-		    add_values_from_phis(stmt->v.while_loop.entry, set_values);
-
-		    set_values_copy = compiler_value_set_copy(set_values);
-		    recurse(&stmt->v.while_loop.body, set_values_copy, did_change);
-		    compiler_free_value_set(set_values_copy);
+		    int num_hoisted_here = process_loop(stmtp, set_values);
+
+		    if (num_hoisted_here > 0)
+		    {
+			/* The hoisted statements are in front of the
+			   loop now, so we go through them before we come
+			   back to it. */
+			*num_hoisted += num_hoisted_here;
+			continue;
+		    }
+		    else
+		    {
+			value_set_t *set_values_copy;
+
+			add_values_from_phis(stmt->v.while_loop.entry, set_values);
+
+			set_values_copy = compiler_value_set_copy(set_values);
+			recurse(&stmt->v.while_loop.body, set_values_copy, num_hoisted);
+			compiler_free_value_set(set_values_copy);
+		    }
 		}
 		break;
 
@@ -270,15 +301,16 @@ recurse (statement_t **stmtp, value_set_t *set_values, gboolean *did_change)
     }
 }
 
-gboolean
+/* Returns the number of statements hoisted out of loops. */
+int
 compiler_opt_loop_invariant_code_motion (statement_t **first_stmt)
 {
     value_set_t *set_values = compiler_new_value_set();
-    gboolean did_change = FALSE;
+    int num_hoisted = 0;
 
-    recurse(first_stmt, set_values, &did_change);
+    recurse(first_stmt, set_values, &num_hoisted);
 
     compiler_free_value_set(set_values);
 
-    return did_change;
+    return num_hoisted;
 }
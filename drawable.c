@@ -97,6 +97,10 @@ free_input_drawable (input_drawable_t *drawable)
 	    break;
 
 	case INPUT_DRAWABLE_CMDLINE_IMAGE :
+	    if (drawable->v.cmdline.stream != 0)
+		free_cmdline_input_stream(drawable->v.cmdline.stream);
+	    else
+		unbind_cmdline_cache_entries(drawable);
 	    g_free(drawable->v.cmdline.image_filename);
 	    g_free(drawable->v.cmdline.cache_entries);
 	    break;
@@ -152,6 +156,9 @@ copy_input_drawable (input_drawable_t *drawable)
 	    g_assert_not_reached();
     }
 
+    if (copy == NULL)
+	return NULL;
+
     copy->scale_x = drawable->scale_x;
     copy->scale_y = drawable->scale_y;
     copy->middle_x = drawable->middle_x;
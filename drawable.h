@@ -43,6 +43,7 @@
 #define INPUT_DRAWABLE_OPENSTEP			4
 
 struct _cache_entry_t;
+struct _input_stream_t;
 
 /* TEMPLATE image_types */
 #define IMAGE_DRAWABLE		1
@@ -164,6 +165,8 @@ typedef struct _input_drawable_t {
 	    int num_frames;
 	    struct _cache_entry_t **cache_entries;
 	    char *image_filename;
+	    struct _input_stream_t *stream; /* only for streamed images */
+	    gboolean read_failed; /* the image couldn't be read again */
 #ifdef MOVIES
 	    quicktime_t *movie;
 #endif
@@ -196,6 +199,8 @@ input_drawable_t* get_default_input_drawable (void);
 #endif
 
 input_drawable_t* alloc_cmdline_image_input_drawable (const char *filename);
+void free_cmdline_input_stream (struct _input_stream_t *stream);
+void unbind_cmdline_cache_entries (input_drawable_t *drawable);
 #ifdef MOVIES
 input_drawable_t* alloc_cmdline_movie_input_drawable (const char *filename);
 #endif
@@ -75,6 +75,7 @@
 #include "designer/designer.h"
 
 #define DEFAULT_PREVIEW_SIZE	384
+#define PREVIEW_POLL_INTERVAL	20	/* ms */
 
 /* Even more stuff from Quartics plugins */
 #define CHECK_SIZE  8
@@ -198,6 +199,7 @@ static void dialog_preview_size_allocate (GtkWidget *widget, GtkAllocation *allo
 static void dialog_preview_callback (GtkWidget *widget, gpointer data);
 /*static void dialog_preview_click (GtkWidget *widget, GdkEvent *event);*/
 static void refresh_preview (void);
+static void free_preview_frame (void);
 
 static void dialog_load_callback (GtkWidget *widget, gpointer data);
 static void dialog_save_callback (GtkWidget *widget, gpointer data);
@@ -970,6 +972,9 @@ update_gradient (void)
 static gboolean
 generate_code (void)
 {
+    /* the invocation must not change while the preview renders */
+    cancel_preview();
+
     if (expression_changed)
     {
 	static char *support_paths[3];
@@ -979,6 +984,8 @@ generate_code (void)
 	if (run_mode == GIMP_RUN_INTERACTIVE && expression_entry != 0)
 	    dialog_text_update();
 
+	free_preview_frame();
+
 	if (mathmap != 0)
 	    unload_mathmap(mathmap);
 
@@ -1134,6 +1141,8 @@ do_mathmap (int frame_num, float current_t)
 
     assert(invocation != 0);
 
+    free_preview_frame();
+
     previewing = 0;
 
     if (generate_code())
@@ -1316,6 +1325,22 @@ mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable,
 	return get_pixel(invocation, drawable, frame, x, y);
 }
 
+void
+mathmap_get_pixel_quad (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+			int x1, int y1, int x2, int y2, color_t *pixels)
+{
+    if (cmd_line_mode && !previewing)
+    {
+	cmdline_mathmap_get_pixel_quad(invocation, drawable, frame, x1, y1, x2, y2, pixels);
+	return;
+    }
+
+    pixels[0] = mathmap_get_pixel(invocation, drawable, frame, x1, y1);
+    pixels[1] = mathmap_get_pixel(invocation, drawable, frame, x1, y2);
+    pixels[2] = mathmap_get_pixel(invocation, drawable, frame, x2, y1);
+    pixels[3] = mathmap_get_pixel(invocation, drawable, frame, x2, y2);
+}
+
 void
 drawable_get_pixel_inc (mathmap_invocation_t *invocation, input_drawable_t *drawable, int *inc_x, int *inc_y)
 {
@@ -2094,6 +2119,8 @@ mathmap_dialog (int mutable_expression)
     gtk_main();
     gdk_flush();
 
+    free_preview_frame();
+
     unref_tiles();
 
     g_free(wint.wimage);
@@ -2104,13 +2131,6 @@ mathmap_dialog (int mutable_expression)
 
 /*****/
 
-void
-user_value_changed (void)
-{
-    if (auto_preview)
-	dialog_update_preview();
-}
-
 #ifdef PRINT_FPS
 static void
 calculate_and_print_fps (void)
@@ -2138,6 +2158,212 @@ calculate_and_print_fps (void)
 }
 #endif
 
+/* The preview is rendered in the background, so that a render which
+   is out of date can be cancelled as soon as something changes.  The
+   closure and frame are kept after rendering.  If only uservals
+   change they are reused, and only the rows which the changes made
+   dirty are rendered again. */
+static struct
+{
+    image_t *closure;		/* NULL if there is no frame */
+    mathmap_frame_t *frame;
+    guchar *buf;
+    int width, height;
+
+    int dirty_y, dirty_height;	/* rows which need rendering */
+    gboolean refresh_frame;
+
+    gpointer call;		/* NULL if not rendering */
+    guint timeout_id;
+    gboolean *tiles_shown;	/* allocated on the first poll */
+    int old_render_width, old_render_height;
+} preview_render;
+
+static void
+copy_preview_rows (int first_row, int num_rows)
+{
+    int preview_width = preview_render.width;
+    int x, y;
+    guchar *p_ul, *p;
+    gint check, check_0, check_1;
+
+    p = preview_render.buf + first_row * preview_width * 4;
+    p_ul = wint.wimage + first_row * preview_width * 3;
+
+    for (y = first_row; y < first_row + num_rows; y++)
+    {
+	if ((y / CHECK_SIZE) & 1) {
+	    check_0 = CHECK_DARK;
+	    check_1 = CHECK_LIGHT;
+	} else {
+	    check_0 = CHECK_LIGHT;
+	    check_1 = CHECK_DARK;
+	}
+
+	for (x = 0; x < preview_width; x++)
+	{
+	    if (output_bpp == 2 || output_bpp == 4 )
+	    {
+		if (((x) / CHECK_SIZE) & 1)
+		    check = check_0;
+		else
+		    check = check_1;
+
+		if (p[3] == 255)
+		{
+		    p_ul[0] = p[0];
+		    p_ul[1] = p[1];
+		    p_ul[2] = p[2];
+		}
+		else if (p[3] != 255)
+		{
+		    float alphaf = (float)p[3] / 255.0;
+
+		    p_ul[0] = check + (p[0] - check) * alphaf;
+		    p_ul[1] = check + (p[1] - check) * alphaf;
+		    p_ul[2] = check + (p[2] - check) * alphaf;
+		}
+	    }
+	    else
+	    {
+		p_ul[0] = p[0];
+		p_ul[1] = p[1];
+		p_ul[2] = p[2];
+	    }
+
+	    p_ul += 3;
+	    p += 4;
+	}
+    }
+}
+
+/* Shows the tiles which were rendered since the last call. */
+static void
+show_rendered_preview_tiles (void)
+{
+    const tile_timing_t *tiles;
+    int num_tiles, i;
+
+    /* the preview might have been resized in the meantime */
+    if (wint.wimage == NULL
+	|| gdk_pixbuf_get_width(wint.pixbuf) != preview_render.width
+	|| gdk_pixbuf_get_height(wint.pixbuf) != preview_render.height)
+	return;
+
+    tiles = invocation_call_tile_timings(preview_render.call, &num_tiles);
+
+    if (preview_render.tiles_shown == NULL)
+	preview_render.tiles_shown = g_new0(gboolean, num_tiles);
+
+    for (i = 0; i < num_tiles; ++i)
+    {
+	if (preview_render.tiles_shown[i] || g_atomic_int_get((gint*)&tiles[i].thread_index) < 0)
+	    continue;
+
+	copy_preview_rows(tiles[i].first_row, tiles[i].num_rows);
+	gimp_preview_area_draw(GIMP_PREVIEW_AREA(wint.preview),
+			       0, tiles[i].first_row,
+			       preview_render.width, tiles[i].num_rows,
+			       GIMP_RGB_IMAGE,
+			       wint.wimage + tiles[i].first_row * preview_render.width * 3,
+			       preview_render.width * 3);
+
+	preview_render.tiles_shown[i] = TRUE;
+    }
+}
+
+static void
+finish_preview_call (gboolean cancel)
+{
+    g_assert(preview_render.call != NULL);
+
+    if (cancel)
+    {
+	const tile_timing_t *tiles;
+	int num_tiles, i;
+	int first_row = preview_render.height, last_row = 0;
+
+	/* Tiles which are still rendering count as dirty. */
+	tiles = invocation_call_tile_timings(preview_render.call, &num_tiles);
+	for (i = 0; i < num_tiles; ++i)
+	    if (g_atomic_int_get((gint*)&tiles[i].thread_index) < 0)
+	    {
+		first_row = MIN(first_row, tiles[i].first_row);
+		last_row = MAX(last_row, tiles[i].first_row + tiles[i].num_rows);
+	    }
+
+	cancel_invocation_call(preview_render.call);
+
+	preview_render.dirty_y = first_row;
+	preview_render.dirty_height = MAX(0, last_row - first_row);
+    }
+    else
+    {
+	show_rendered_preview_tiles();
+	join_invocation_call(preview_render.call);
+
+	preview_render.dirty_y = 0;
+	preview_render.dirty_height = 0;
+    }
+
+    preview_render.call = NULL;
+    g_free(preview_render.tiles_shown);
+    preview_render.tiles_shown = NULL;
+
+    if (preview_render.timeout_id != 0)
+    {
+	g_source_remove(preview_render.timeout_id);
+	preview_render.timeout_id = 0;
+    }
+
+    invocation->render_width = preview_render.old_render_width;
+    invocation->render_height = preview_render.old_render_height;
+}
+
+static gboolean
+preview_render_timeout (gpointer data)
+{
+    show_rendered_preview_tiles();
+
+    if (!invocation_call_is_done(preview_render.call))
+	return TRUE;
+
+    /* returning FALSE removes the source */
+    preview_render.timeout_id = 0;
+    finish_preview_call(FALSE);
+
+    return FALSE;
+}
+
+/* Stops rendering the preview, which must be done before changing
+   anything the render uses. */
+void
+cancel_preview (void)
+{
+    if (preview_render.call != NULL)
+	finish_preview_call(TRUE);
+}
+
+static void
+free_preview_frame (void)
+{
+    cancel_preview();
+
+    if (preview_render.closure == NULL)
+	return;
+
+    invocation_free_frame(preview_render.frame);
+    closure_image_free(preview_render.closure);
+    g_free(preview_render.buf);
+
+    invocation_release_native_filter_results(invocation);
+
+    preview_render.closure = NULL;
+    preview_render.frame = NULL;
+    preview_render.buf = NULL;
+    preview_render.refresh_frame = FALSE;
+}
+
 static gboolean
 recalculate_preview (void)
 {
@@ -2156,16 +2382,16 @@ recalculate_preview (void)
     {
 	int preview_width = gdk_pixbuf_get_width(wint.pixbuf);
 	int preview_height = gdk_pixbuf_get_height(wint.pixbuf);
-	int x, y;
-	guchar *p_ul, *p;
-	gint check, check_0, check_1;
-	guchar *buf = (guchar*)malloc(4 * preview_width * preview_height);
-	int old_render_width, old_render_height;
-	mathmap_frame_t *frame;
-	image_t *closure = closure_image_alloc(&invocation->mathfuncs, NULL,
-					       invocation->mathmap->main_filter->num_uservals, invocation->uservals,
-					       preview_width, preview_height);
-	assert(buf != 0);
+
+	if (preview_render.closure != NULL
+	    && (preview_render.width != preview_width || preview_render.height != preview_height))
+	    free_preview_frame();
+
+	if (preview_render.closure != NULL && preview_render.dirty_height == 0)
+	{
+	    --in_recalculate;
+	    return TRUE;
+	}
 
 	update_uservals(mathmap->main_filter->userval_infos, invocation->uservals);
 
@@ -2187,8 +2413,8 @@ recalculate_preview (void)
 	*/
 	    disable_debugging(invocation);
 
-	old_render_width = invocation->render_width;
-	old_render_height = invocation->render_height;
+	preview_render.old_render_width = invocation->render_width;
+	preview_render.old_render_height = invocation->render_height;
 
 	if (previewing)
 	{
@@ -2204,74 +2430,37 @@ recalculate_preview (void)
 	if (previewing)
 	    for_each_input_drawable(build_fast_image_source);
 
-	frame = invocation_new_frame(invocation, closure, 0, mmvals.param_t);
-
-	frame->frame_render_width = preview_width;
-	frame->frame_render_height = preview_height;
-
-	if (previewing)
-	    call_invocation_parallel_and_join(frame, closure, 0, 0, preview_width, preview_height,
-					      buf, get_num_cpus());
-	else
-	    call_invocation_parallel_and_join(frame, closure, 0, 0, preview_width, preview_height,
-					      buf, NUM_FINAL_RENDER_CPUS);
-
-	invocation_free_frame(frame);
+	if (preview_render.closure == NULL)
+	{
+	    preview_render.closure = closure_image_alloc(&invocation->mathfuncs, NULL,
+							 invocation->mathmap->main_filter->num_uservals, invocation->uservals,
+							 preview_width, preview_height);
+	    preview_render.buf = g_malloc(4 * preview_width * preview_height);
+	    preview_render.width = preview_width;
+	    preview_render.height = preview_height;
 
-	invocation->render_width = old_render_width;
-	invocation->render_height = old_render_height;
+	    preview_render.frame = invocation_new_frame(invocation, preview_render.closure, 0, mmvals.param_t);
 
-	p = buf;
-	p_ul = wint.wimage;
+	    preview_render.frame->frame_render_width = preview_width;
+	    preview_render.frame->frame_render_height = preview_height;
 
-	for (y = 0; y < preview_height; y++)
+	    preview_render.dirty_y = 0;
+	    preview_render.dirty_height = preview_height;
+	}
+	else if (preview_render.refresh_frame)
 	{
-	    if ((y / CHECK_SIZE) & 1) {
-		check_0 = CHECK_DARK;
-		check_1 = CHECK_LIGHT;
-	    } else {
-		check_0 = CHECK_LIGHT;
-		check_1 = CHECK_DARK;
-	    }
-
-	    for (x = 0; x < preview_width; x++)
-	    {
-		if (output_bpp == 2 || output_bpp == 4 )
-		{
-		    if (((x) / CHECK_SIZE) & 1)
-			check = check_0;
-		    else
-			check = check_1;
-
-		    if (p[3] == 255)
-		    {
-			p_ul[0] = p[0];
-			p_ul[1] = p[1];
-			p_ul[2] = p[2];
-		    }
-		    else if (p[3] != 255)
-		    {
-			float alphaf = (float)p[3] / 255.0;
-
-			p_ul[0] = check + (p[0] - check) * alphaf;
-			p_ul[1] = check + (p[1] - check) * alphaf;
-			p_ul[2] = check + (p[2] - check) * alphaf;
-		    }
-		}
-		else
-		{
-		    p_ul[0] = p[0];
-		    p_ul[1] = p[1];
-		    p_ul[2] = p[2];
-		}
-
-		p_ul += 3;
-		p += 4;
-	    }
+	    invocation_release_native_filter_results(invocation);
+	    invocation_refresh_frame(preview_render.frame, preview_render.closure);
 	}
+	preview_render.refresh_frame = FALSE;
 
-	free(buf);
-	closure_image_free(closure);
+	preview_render.call = call_invocation_parallel(preview_render.frame, preview_render.closure,
+						       0, preview_render.dirty_y,
+						       preview_width, preview_render.dirty_height,
+						       preview_render.buf + preview_render.dirty_y * preview_width * 4,
+						       previewing ? get_num_cpus() : NUM_FINAL_RENDER_CPUS);
+
+	preview_render.timeout_id = g_timeout_add(PREVIEW_POLL_INTERVAL, preview_render_timeout, NULL);
 
 	--in_recalculate;
 
@@ -2286,11 +2475,36 @@ recalculate_preview (void)
 static void
 dialog_update_preview (void)
 {
-    if (recalculate_preview())
+    free_preview_frame();
+    recalculate_preview();
+}
+
+void
+user_value_changed (userval_t *userval)
+{
+    if (invocation != NULL && preview_render.closure != NULL
+	&& userval >= invocation->uservals
+	&& userval < invocation->uservals + invocation->mathmap->main_filter->num_uservals)
     {
-	refresh_preview();
-	gtk_widget_draw(wint.preview, NULL);
+	int use;
+
+	cancel_preview();
+
+	use = invocation_userval_changed(invocation, preview_render.closure, userval - invocation->uservals);
+	if (use == USERVAL_USE_FRAME)
+	    preview_render.refresh_frame = TRUE;
+	if (use != USERVAL_USE_NONE)
+	{
+	    preview_render.dirty_y = 0;
+	    preview_render.dirty_height = preview_render.height;
+	}
+
+	/* The render we might have cancelled still has to finish. */
+	if (auto_preview || use == USERVAL_USE_NONE)
+	    recalculate_preview();
     }
+    else if (auto_preview)
+	dialog_update_preview();
 }
 
 /*****/
@@ -2985,6 +3199,7 @@ dialog_response (GtkWidget *widget,
 
 	case GTK_RESPONSE_CANCEL :
 	case GTK_RESPONSE_DELETE_EVENT :
+	    cancel_preview();
 	    gtk_widget_destroy(widget);
 	    break;
 
@@ -152,12 +152,59 @@ typedef color_t (*orig_val_pixel_func_t) (struct _mathmap_invocation_t*, float,
 
 typedef struct _native_filter_cache_entry_t
 {
-    filter_t *filter;
-    userval_t *args;
+    native_filter_func_t func;
+    int num_args;
+    int *arg_types;
+    userval_t *args;		/* images are stored as their ids */
+    int render_width, render_height;
+    orig_val_pixel_func_t orig_val_func;
+    int edge_behaviour_x, edge_behaviour_y;
+    color_t edge_color_x, edge_color_y;
+    guint hash;
+
     image_t *image;		/* NULL if not done */
+    mathmap_pools_t pools;	/* the image is allocated here */
+    size_t size;
+    int num_users;		/* invocations holding the result */
+    long last_use;
+    gboolean is_abandoned;	/* computed by a cancelled render and
+				   not in the cache anymore */
+
     struct _native_filter_cache_entry_t *next;
 } native_filter_cache_entry_t;
 
+typedef struct
+{
+    long hits;
+    long misses;
+    long waits;			/* hits on results still being computed */
+    long evictions;
+    size_t size;		/* bytes currently used by results */
+} native_filter_cache_stats_t;
+
+/* A job whose tiles can be rendered by any thread of the invocation.
+   Threads waiting for a native filter result help with posted jobs
+   instead of sleeping. */
+typedef struct _parallel_job_t
+{
+    void (*func) (struct _parallel_job_t *job, int tile);
+    void *data;
+    int num_tiles;
+    int next_tile;		/* these are protected by the */
+    int num_tiles_done;		/* native filter cache mutex */
+    struct _parallel_job_t *next;
+} parallel_job_t;
+
+typedef struct
+{
+    int first_row, num_rows;	/* the rows of the call */
+    int rows_done;
+    double pixels_per_second;
+    double seconds_left;	/* negative if not known yet */
+} render_progress_t;
+
+typedef void (*render_progress_func_t) (const render_progress_t *progress, void *data);
+
 /* TEMPLATE invocation_frame_slice */
 typedef struct _mathmap_invocation_t
 {
@@ -171,6 +218,8 @@ typedef struct _mathmap_invocation_t
 
     int supersampling;
 
+    int tile_height;		/* rows per tile for parallel rendering */
+
     int output_bpp;
 
     int edge_behaviour_x, edge_behaviour_y;
@@ -188,10 +237,20 @@ typedef struct _mathmap_invocation_t
 
     unsigned char * volatile rows_finished;
 
-    mathmap_pools_t pools;	/* used exclusively for the native filter cache */
-    GMutex *native_filter_cache_mutex;
-    GCond *native_filter_cache_cond;
-    native_filter_cache_entry_t *native_filter_cache;
+    /* Renders stop at the next row or tile while this is not zero.
+       See invocation_cancel(). */
+    volatile int cancelled;
+
+    /* Called by the rendering threads after each tile of a parallel
+       call. */
+    render_progress_func_t progress_func;
+    void *progress_data;
+
+    /* Native filter results this invocation holds on to.  These and
+       parallel_jobs are protected by the native filter cache mutex. */
+    native_filter_cache_entry_t **native_filter_results;
+    int num_native_filter_results;
+    struct _parallel_job_t *parallel_jobs;
 
     /* FIXME: remove - it's in the closure */
     mathfuncs_t mathfuncs;
@@ -252,6 +311,8 @@ void llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first
 
 int cmdline_main (int argc, char *argv[]);
 color_t cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y);
+void cmdline_mathmap_get_pixel_quad (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+				     int x1, int y1, int x2, int y2, color_t *pixels);
 
 userval_info_t* arg_decls_to_uservals (filter_t *filter, arg_decl_t *arg_decls);
 void register_args_as_uservals (filter_t *filter, arg_decl_t *arg_decls);
@@ -271,6 +332,8 @@ unsigned int filter_flags (filter_t *filter);
 void start_parsing_filter (mathmap_t *mathmap, top_level_decl_t *decl);
 void finish_parsing_filter (mathmap_t *mathmap);
 
+void lock_mathmap_compiler (void);
+void unlock_mathmap_compiler (void);
 int check_mathmap (char *expression);
 mathmap_t* parse_mathmap (char *expression);
 mathmap_t* compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend);
@@ -280,12 +343,30 @@ mathmap_invocation_t* invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *
 mathmap_frame_t* invocation_new_frame (mathmap_invocation_t *invocation, image_t *closure,
 				       int current_frame, float current_t);
 void invocation_free_frame (mathmap_frame_t *frame);
+void invocation_refresh_frame (mathmap_frame_t *frame, image_t *closure);
+
+int invocation_userval_changed (mathmap_invocation_t *invocation, image_t *closure, int index);
 
 void invocation_init_slice (mathmap_slice_t *slice, image_t *image, mathmap_frame_t *frame, int region_x, int region_y,
 			    int region_width, int region_height, float sampling_offset_x, float sampling_offset_y);
 void invocation_deinit_slice (mathmap_slice_t *slice);
 
 void invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialising);
+void invocation_set_tile_height (mathmap_invocation_t *invocation, int tile_height);
+void invocation_set_progress_func (mathmap_invocation_t *invocation, render_progress_func_t func, void *data);
+
+void invocation_cancel (mathmap_invocation_t *invocation);
+void invocation_reset_cancel (mathmap_invocation_t *invocation);
+gboolean invocation_is_cancelled (mathmap_invocation_t *invocation);
+
+#define DEFAULT_TILE_HEIGHT		8
+
+typedef struct
+{
+    int first_row, num_rows;
+    int thread_index;		/* the thread which rendered the tile */
+    double render_time;		/* in seconds */
+} tile_timing_t;
 
 gpointer call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
 				   int region_x, int region_y, int region_width, int region_height,
@@ -295,8 +376,11 @@ void call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure
 					unsigned char *q, int num_threads);
 
 void join_invocation_call (gpointer *_call);
-void kill_invocation_call (gpointer *_call);
+void cancel_invocation_call (gpointer *_call);
 gboolean invocation_call_is_done (gpointer *_call);
+gboolean invocation_call_wait (gpointer *_call);
+const tile_timing_t* invocation_call_tile_timings (gpointer *_call, int *num_tiles);
+void invocation_call_progress (gpointer *_call, render_progress_t *progress);
 
 native_filter_cache_entry_t* invocation_lookup_native_filter_invocation (mathmap_invocation_t *invocation, userval_t *args,
 									 native_filter_func_t filter_func);
@@ -304,10 +388,22 @@ void native_filter_cache_entry_set_image (mathmap_invocation_t *invocation,
 					  native_filter_cache_entry_t *cache_entry,
 					  image_t *image);
 
+/* Makes the native filter results used so far evictable.  Must only
+   be called when no frame of the invocation is being rendered. */
+void invocation_release_native_filter_results (mathmap_invocation_t *invocation);
+void native_filter_cache_set_budget (size_t budget);
+void native_filter_cache_get_stats (native_filter_cache_stats_t *stats);
+
+void invocation_run_parallel_job (mathmap_invocation_t *invocation, parallel_job_t *job);
+
 void carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathmap_invocation_t *template_invocation,
 					gboolean copy_first_image);
 
 color_t mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y);
+/* Fetches the pixels (x1,y1), (x1,y2), (x2,y1) and (x2,y2), which must
+   all be inside the drawable. */
+void mathmap_get_pixel_quad (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+			     int x1, int y1, int x2, int y2, color_t *pixels);
 
 typedef int (*template_processor_func_t) (mathmap_t *mathmap, const char *directive, const char *arg, FILE *out, void *data);
 
@@ -321,7 +417,8 @@ int generate_plug_in (char *filter, char *output_filename,
 		      char *template_filename, int analyze_constants,
 		      template_processor_func_t template_processor);
 
-void user_value_changed (void);
+void user_value_changed (userval_t *userval);
+void cancel_preview (void);
 
 void delete_expression_marker (void);
 void set_expression_marker (int start_line, int start_column, int end_line, int end_column);
@@ -345,7 +442,6 @@ typedef gpointer thread_handle_t;
 
 thread_handle_t mathmap_thread_start (void (*func) (gpointer), gpointer data);
 void mathmap_thread_join (thread_handle_t thread);
-void mathmap_thread_kill (thread_handle_t thread);
 
 char* make_filter_source_from_design (designer_design_t *design, const char *filter_name);
 
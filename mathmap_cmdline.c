@@ -28,6 +28,15 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #include <glib.h>
 
@@ -35,6 +44,7 @@
 
 #include "exprtree.h"
 #include "builtins/builtins.h"
+#include "builtins/libnoise.h"
 #include "tags.h"
 #include "scanner.h"
 #include "vars.h"
@@ -61,12 +71,69 @@ typedef struct _cache_entry_t
     input_drawable_t *drawable;
     int frame;
     guchar *data;
+    gboolean tiled;
+    int tiles_per_row;
     int timestamp;
 } cache_entry_t;
 
+/* In tiled mode input images are stored as square tiles of
+   INPUT_TILE_SIZE x INPUT_TILE_SIZE pixels with 4 bytes each, so that
+   filters which walk the input in other than row order (rotations,
+   polar maps) stay within a few cache lines. */
+#define INPUT_TILE_SHIFT	3
+#define INPUT_TILE_SIZE		(1 << INPUT_TILE_SHIFT)
+#define INPUT_TILE_MASK		(INPUT_TILE_SIZE - 1)
+
+static gboolean tiled_input = FALSE;
+
+/* Streamed input images are never decoded as a whole.  Instead they are
+   read in bands of STREAM_BAND_HEIGHT rows through an image reader,
+   and at most stream_budget bytes worth of bands are kept in memory.
+   Since readers can only move forward, going back to an earlier band
+   reopens the image.
+
+   Bands are looked up, loaded and evicted under the stream's mutex.
+   A band with users is never evicted.  Each rendering thread keeps
+   the band it reads from pinned, i.e. counted as a user, until it
+   needs another band of the same stream or exits, so most pixels are
+   read without locking. */
+#define STREAM_BAND_HEIGHT	64
+
+typedef struct
+{
+    int index;
+    guchar *data;
+    int users;
+    int timestamp;
+} stream_band_t;
+
+typedef struct _input_stream_t
+{
+    char *filename;
+    image_reader_t *reader;
+    int width;
+    int height;
+    int num_bands;
+    stream_band_t **band_table;
+    int num_slots;
+    stream_band_t **slots;
+    int clock;
+    gboolean read_failed;
+    GMutex *mutex;
+} input_stream_t;
+
+static size_t stream_budget = 0;
+
+/* The cache is shared by all rendering threads.  Loading, binding and
+   evicting entries happens under cache_mutex.  An entry whose
+   timestamp is the current time is never evicted, so once a thread
+   has seen that it may use the entry's data without locking until
+   current_time is advanced, which only happens between renders. */
 static int cache_size = 16;
-static cache_entry_t *cache = 0;
+static cache_entry_t **cache = 0;
+static int num_cache_entries = 0;
 static int current_time = 0;
+static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
 
 static cache_entry_t*
 get_free_cache_entry (void)
@@ -75,31 +142,85 @@ get_free_cache_entry (void)
     int i;
 
     if (cache == 0)
-	cache = g_new0(cache_entry_t, cache_size);
+    {
+	num_cache_entries = cache_size;
+	cache = g_new0(cache_entry_t*, num_cache_entries);
+	for (i = 0; i < num_cache_entries; ++i)
+	    cache[i] = g_new0(cache_entry_t, 1);
+    }
     g_assert(cache != 0);
 
-    for (i = 0; i < cache_size; ++i)
-	if (cache[i].drawable == 0)
+    for (i = 0; i < num_cache_entries; ++i)
+	if (cache[i]->drawable == 0)
 	{
 	    lru_index = i;
 	    break;
 	}
 	else
-	    if (lru_index < 0 || cache[i].timestamp < cache[lru_index].timestamp)
+	    if (cache[i]->timestamp < current_time
+		&& (lru_index < 0 || cache[i]->timestamp < cache[lru_index]->timestamp))
 		lru_index = i;
 
-    if (cache[lru_index].drawable != 0)
-	cache[lru_index].drawable->v.cmdline.cache_entries[cache[lru_index].frame] = 0;
+    /* All entries are in use by the current render, so we have to
+       grow the cache. */
+    if (lru_index < 0)
+    {
+	lru_index = num_cache_entries++;
+	cache = g_renew(cache_entry_t*, cache, num_cache_entries);
+	cache[lru_index] = g_new0(cache_entry_t, 1);
+    }
+
+    if (cache[lru_index]->drawable != 0)
+	cache[lru_index]->drawable->v.cmdline.cache_entries[cache[lru_index]->frame] = 0;
+
+    if (cache[lru_index]->data != 0)
+    {
+	free(cache[lru_index]->data);
+	cache[lru_index]->data = 0;
+    }
+
+    cache[lru_index]->drawable = 0;
+
+    return cache[lru_index];
+}
+
+static void
+tile_cache_entry_data (cache_entry_t *cache_entry, int width, int height)
+{
+    int tiles_per_row = (width + INPUT_TILE_MASK) >> INPUT_TILE_SHIFT;
+    int tiles_per_column = (height + INPUT_TILE_MASK) >> INPUT_TILE_SHIFT;
+    guchar *tiled = (guchar*)malloc(tiles_per_row * tiles_per_column * INPUT_TILE_SIZE * INPUT_TILE_SIZE * 4);
+    int x, y;
 
-    if (cache[lru_index].data != 0)
+    g_assert(tiled != 0);
+
+    for (y = 0; y < height; ++y)
     {
-	free(cache[lru_index].data);
-	cache[lru_index].data = 0;
+	guchar *src = cache_entry->data + 3 * width * y;
+	guchar *tile_row = tiled + ((y >> INPUT_TILE_SHIFT) * tiles_per_row * INPUT_TILE_SIZE * INPUT_TILE_SIZE
+				    + (y & INPUT_TILE_MASK) * INPUT_TILE_SIZE) * 4;
+
+	for (x = 0; x < width; ++x)
+	{
+	    guchar *dst = tile_row + ((x >> INPUT_TILE_SHIFT) * INPUT_TILE_SIZE * INPUT_TILE_SIZE
+				      + (x & INPUT_TILE_MASK)) * 4;
+
+	    dst[0] = src[0];
+	    dst[1] = src[1];
+	    dst[2] = src[2];
+	    dst[3] = 255;
+
+	    src += 3;
+	}
     }
 
-    return &cache[lru_index];
+    free(cache_entry->data);
+    cache_entry->data = tiled;
+    cache_entry->tiled = TRUE;
+    cache_entry->tiles_per_row = tiles_per_row;
 }
 
+/* Returns NULL if the image cannot be read. */
 static cache_entry_t*
 get_cache_entry_for_image (const char *filename, int *width, int *height)
 {
@@ -107,10 +228,11 @@ get_cache_entry_for_image (const char *filename, int *width, int *height)
 
     cache_entry->data = read_image(filename, width, height);
     if (cache_entry->data == 0)
-    {
-	fprintf(stderr, _("Error: Cannot read input image `%s'.\n"), filename);
-	exit(1);
-    }
+	return NULL;
+
+    cache_entry->tiled = FALSE;
+    if (tiled_input)
+	tile_cache_entry_data(cache_entry, *width, *height);
 
     return cache_entry;
 }
@@ -123,35 +245,40 @@ bind_cache_entry_to_drawable (cache_entry_t *cache_entry, input_drawable_t *draw
 
     cache_entry->drawable = drawable;
     cache_entry->frame = frame;
-    cache_entry->timestamp = current_time;
+    g_atomic_int_set(&cache_entry->timestamp, current_time);
 
     drawable->v.cmdline.cache_entries[frame] = cache_entry;
 }
 
-color_t
-cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+/* Returns NULL if the image cannot be read anymore.  The drawable is
+   then marked, so that the render can be reported as failed. */
+static cache_entry_t*
+lookup_cache_entry (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame)
 {
-    guchar *p;
-    int num_frames;
-    cache_entry_t **cache_entries;
-
-    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+    cache_entry_t *cache_entry = drawable->v.cmdline.cache_entries[frame];
 
-    num_frames = drawable->v.cmdline.num_frames;
-    cache_entries = drawable->v.cmdline.cache_entries;
+    if (cache_entry != 0
+	&& g_atomic_int_get(&cache_entry->timestamp) == current_time
+	&& cache_entry->drawable == drawable && cache_entry->frame == frame)
+	return cache_entry;
 
-    if (frame < 0 || frame >= num_frames)
-	return MAKE_RGBA_COLOR(255, 255, 255, 255);
+    g_static_mutex_lock(&cache_mutex);
 
-    if (cache_entries[frame] == 0)
+    cache_entry = drawable->v.cmdline.cache_entries[frame];
+    if (cache_entry == 0)
     {
-	cache_entry_t *cache_entry;
-
 	if (drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE)
 	{
 	    int width, height;
 
-	    cache_entry = get_cache_entry_for_image(drawable->v.cmdline.image_filename, &width, &height);
+	    if (!drawable->v.cmdline.read_failed)
+		cache_entry = get_cache_entry_for_image(drawable->v.cmdline.image_filename, &width, &height);
+	    if (cache_entry == 0)
+	    {
+		drawable->v.cmdline.read_failed = TRUE;
+		g_static_mutex_unlock(&cache_mutex);
+		return NULL;
+	    }
 
 	    g_assert(width == drawable->image.pixel_width && height == drawable->image.pixel_height);
 	}
@@ -176,26 +303,422 @@ cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *d
 	bind_cache_entry_to_drawable(cache_entry, drawable, frame);
     }
     else
-	cache_entries[frame]->timestamp = current_time;
+	g_atomic_int_set(&cache_entry->timestamp, current_time);
+
+    g_static_mutex_unlock(&cache_mutex);
+
+    return cache_entry;
+}
+
+/* Called when a drawable is freed, so that the memory of its entries
+   can be reused. */
+void
+unbind_cmdline_cache_entries (input_drawable_t *drawable)
+{
+    int i;
+
+    g_static_mutex_lock(&cache_mutex);
+
+    for (i = 0; i < drawable->v.cmdline.num_frames; ++i)
+    {
+	cache_entry_t *cache_entry = drawable->v.cmdline.cache_entries[i];
+
+	if (cache_entry == 0 || cache_entry->drawable != drawable)
+	    continue;
+
+	cache_entry->drawable = 0;
+	free(cache_entry->data);
+	cache_entry->data = 0;
+    }
+
+    g_static_mutex_unlock(&cache_mutex);
+}
+
+/* Returns NULL if the image cannot be read. */
+static input_stream_t*
+alloc_input_stream (const char *filename)
+{
+    image_reader_t *reader = open_image_reading(filename);
+    input_stream_t *stream;
+    size_t band_size;
+    int i;
+
+    if (reader == 0)
+	return NULL;
+
+    stream = g_new0(input_stream_t, 1);
+    stream->filename = g_strdup(filename);
+    stream->reader = reader;
+    stream->width = stream->reader->width;
+    stream->height = stream->reader->height;
+    stream->num_bands = (stream->height + STREAM_BAND_HEIGHT - 1) / STREAM_BAND_HEIGHT;
+    stream->band_table = g_new0(stream_band_t*, stream->num_bands);
+
+    band_size = (size_t)stream->width * 3 * STREAM_BAND_HEIGHT;
+    stream->num_slots = MAX(2, MIN(stream->num_bands, stream_budget / band_size));
+    stream->slots = g_new(stream_band_t*, stream->num_slots);
+    for (i = 0; i < stream->num_slots; ++i)
+    {
+	stream->slots[i] = g_new0(stream_band_t, 1);
+	stream->slots[i]->index = -1;
+    }
+
+    stream->mutex = g_mutex_new();
+
+    return stream;
+}
+
+/* Must be called with the stream's mutex held. */
+static stream_band_t*
+evict_stream_band (input_stream_t *stream)
+{
+    stream_band_t *victim = 0;
+    int i;
+
+    for (i = 0; i < stream->num_slots; ++i)
+    {
+	stream_band_t *band = stream->slots[i];
+
+	if (band->index < 0)
+	    return band;
+	if (g_atomic_int_get(&band->users) == 0
+	    && (victim == 0 || band->timestamp < victim->timestamp))
+	    victim = band;
+    }
+
+    /* All bands are being read from right now, so we have to grow the
+       cache beyond its budget. */
+    if (victim == 0)
+    {
+	victim = g_new0(stream_band_t, 1);
+	stream->slots = g_renew(stream_band_t*, stream->slots, stream->num_slots + 1);
+	stream->slots[stream->num_slots++] = victim;
+    }
+    else
+	stream->band_table[victim->index] = 0;
+
+    victim->index = -1;
+
+    return victim;
+}
+
+/* Must be called with the stream's mutex held.  If the image cannot
+   be read again, the band is white and the stream is marked, so that
+   the render can be reported as failed. */
+static void
+load_stream_band (input_stream_t *stream, stream_band_t *band, int index)
+{
+    int first_row = index * STREAM_BAND_HEIGHT;
+    int num_rows = MIN(STREAM_BAND_HEIGHT, stream->height - first_row);
+
+    if (band->data == 0)
+	band->data = g_malloc((size_t)stream->width * 3 * STREAM_BAND_HEIGHT);
+
+    band->index = index;
+
+    if (!stream->read_failed
+	&& (stream->reader == 0 || stream->reader->num_lines_read > first_row))
+    {
+	if (stream->reader != 0)
+	    free_image_reader(stream->reader);
+	stream->reader = open_image_reading(stream->filename);
+	if (stream->reader == 0
+	    || stream->reader->width != stream->width || stream->reader->height != stream->height)
+	    stream->read_failed = TRUE;
+    }
+
+    if (stream->read_failed)
+    {
+	memset(band->data, 255, (size_t)stream->width * 3 * num_rows);
+	return;
+    }
+
+    /* Skip the rows between the last band read and this one, using the
+       band's buffer as scratch space. */
+    while (stream->reader->num_lines_read < first_row)
+	read_lines(stream->reader, band->data,
+		   MIN(STREAM_BAND_HEIGHT, first_row - stream->reader->num_lines_read));
+
+    read_lines(stream->reader, band->data, num_rows);
+}
+
+static stream_band_t*
+acquire_stream_band (input_stream_t *stream, int index)
+{
+    stream_band_t *band;
+
+    g_mutex_lock(stream->mutex);
+
+    band = stream->band_table[index];
+    if (band == 0)
+    {
+	band = evict_stream_band(stream);
+	load_stream_band(stream, band, index);
+	stream->band_table[index] = band;
+    }
+    g_atomic_int_inc(&band->users);
+    band->timestamp = ++stream->clock;
+
+    g_mutex_unlock(stream->mutex);
+
+    return band;
+}
+
+static void
+release_stream_band (stream_band_t *band)
+{
+    g_atomic_int_add(&band->users, -1);
+}
+
+/* The bands a thread has pinned, one for each of the last few streams
+   it read from. */
+#define NUM_STREAM_PINS		4
+
+typedef struct
+{
+    input_stream_t *stream;
+    stream_band_t *band;
+} stream_pin_t;
+
+typedef struct
+{
+    stream_pin_t pins[NUM_STREAM_PINS];
+    int next_victim;
+} stream_pins_t;
+
+static GStaticPrivate stream_pins_key = G_STATIC_PRIVATE_INIT;
+
+static void
+free_stream_pins (gpointer data)
+{
+    stream_pins_t *pins = (stream_pins_t*)data;
+    int i;
+
+    for (i = 0; i < NUM_STREAM_PINS; ++i)
+	if (pins->pins[i].band != 0)
+	    release_stream_band(pins->pins[i].band);
+
+    g_free(pins);
+}
+
+/* Releases the pin this thread holds on a band of the stream, if
+   any. */
+static void
+unpin_stream (input_stream_t *stream)
+{
+    stream_pins_t *pins = (stream_pins_t*)g_static_private_get(&stream_pins_key);
+    int i;
+
+    if (pins == 0)
+	return;
+
+    for (i = 0; i < NUM_STREAM_PINS; ++i)
+	if (pins->pins[i].stream == stream)
+	{
+	    release_stream_band(pins->pins[i].band);
+	    pins->pins[i].stream = 0;
+	    pins->pins[i].band = 0;
+	}
+}
+
+static stream_band_t*
+pin_stream_band (input_stream_t *stream, int index)
+{
+    stream_pins_t *pins = (stream_pins_t*)g_static_private_get(&stream_pins_key);
+    stream_pin_t *pin;
+    int i;
+
+    if (pins == 0)
+    {
+	pins = g_new0(stream_pins_t, 1);
+	g_static_private_set(&stream_pins_key, pins, free_stream_pins);
+    }
+
+    for (i = 0; i < NUM_STREAM_PINS; ++i)
+	if (pins->pins[i].stream == stream)
+	    break;
+
+    if (i == NUM_STREAM_PINS)
+    {
+	i = pins->next_victim;
+	pins->next_victim = (i + 1) % NUM_STREAM_PINS;
+    }
+    pin = &pins->pins[i];
+
+    /* A pinned band is not evicted, so its index can't change. */
+    if (pin->stream == stream && pin->band->index == index)
+	return pin->band;
+
+    if (pin->band != 0)
+	release_stream_band(pin->band);
+
+    pin->stream = stream;
+    pin->band = acquire_stream_band(stream, index);
+
+    return pin->band;
+}
+
+/* The threads which read from the stream, except for the calling
+   one, must have exited. */
+void
+free_cmdline_input_stream (input_stream_t *stream)
+{
+    int i;
+
+    unpin_stream(stream);
+
+    for (i = 0; i < stream->num_slots; ++i)
+    {
+	g_assert(stream->slots[i]->users == 0);
+	g_free(stream->slots[i]->data);
+	g_free(stream->slots[i]);
+    }
+    g_free(stream->slots);
+    g_free(stream->band_table);
+
+    if (stream->reader != 0)
+	free_image_reader(stream->reader);
+
+    g_mutex_free(stream->mutex);
+    g_free(stream->filename);
+    g_free(stream);
+}
+
+static color_t
+stream_get_pixel (input_stream_t *stream, int x, int y)
+{
+    stream_band_t *band = pin_stream_band(stream, y / STREAM_BAND_HEIGHT);
+    guchar *p = band->data + 3 * (stream->width * (y % STREAM_BAND_HEIGHT) + x);
+
+    return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+}
+
+static inline guchar*
+cache_entry_pixel (cache_entry_t *cache_entry, int width, int x, int y)
+{
+    if (cache_entry->tiled)
+	return cache_entry->data
+	    + (((y >> INPUT_TILE_SHIFT) * cache_entry->tiles_per_row + (x >> INPUT_TILE_SHIFT))
+	       * (INPUT_TILE_SIZE * INPUT_TILE_SIZE)
+	       + ((y & INPUT_TILE_MASK) << INPUT_TILE_SHIFT) + (x & INPUT_TILE_MASK)) * 4;
+    return cache_entry->data + 3 * (width * y + x);
+}
+
+color_t
+cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+{
+    cache_entry_t *cache_entry;
+    guchar *p;
+    int num_frames;
+
+    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+
+    num_frames = drawable->v.cmdline.num_frames;
+
+    if (frame < 0 || frame >= num_frames)
+	return MAKE_RGBA_COLOR(255, 255, 255, 255);
+
+    if (drawable->v.cmdline.stream != 0)
+	return stream_get_pixel(drawable->v.cmdline.stream, x, y);
+
+    cache_entry = lookup_cache_entry(invocation, drawable, frame);
+    if (cache_entry == 0)
+	return MAKE_RGBA_COLOR(255, 255, 255, 255);
 
-    p = cache_entries[frame]->data + 3 * (drawable->image.pixel_width * y + x);
+    p = cache_entry_pixel(cache_entry, drawable->image.pixel_width, x, y);
 
     return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
 }
 
+void
+cmdline_mathmap_get_pixel_quad (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+				int x1, int y1, int x2, int y2, color_t *pixels)
+{
+    int width = drawable->image.pixel_width;
+    cache_entry_t *cache_entry;
+    guchar *p;
+
+    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+
+    if (frame < 0 || frame >= drawable->v.cmdline.num_frames)
+    {
+	pixels[0] = pixels[1] = pixels[2] = pixels[3] = MAKE_RGBA_COLOR(255, 255, 255, 255);
+	return;
+    }
+
+    if (drawable->v.cmdline.stream != 0)
+    {
+	input_stream_t *stream = drawable->v.cmdline.stream;
+
+	pixels[0] = stream_get_pixel(stream, x1, y1);
+	pixels[1] = stream_get_pixel(stream, x1, y2);
+	pixels[2] = stream_get_pixel(stream, x2, y1);
+	pixels[3] = stream_get_pixel(stream, x2, y2);
+	return;
+    }
+
+    cache_entry = lookup_cache_entry(invocation, drawable, frame);
+    if (cache_entry == 0)
+    {
+	pixels[0] = pixels[1] = pixels[2] = pixels[3] = MAKE_RGBA_COLOR(255, 255, 255, 255);
+	return;
+    }
+
+    p = cache_entry_pixel(cache_entry, width, x1, y1);
+    pixels[0] = MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+    p = cache_entry_pixel(cache_entry, width, x1, y2);
+    pixels[1] = MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+    p = cache_entry_pixel(cache_entry, width, x2, y1);
+    pixels[2] = MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+    p = cache_entry_pixel(cache_entry, width, x2, y2);
+    pixels[3] = MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+}
+
+/* Returns NULL if the image cannot be read. */
 input_drawable_t*
 alloc_cmdline_image_input_drawable (const char *filename)
 {
     int width, height;
-    cache_entry_t *cache_entry = get_cache_entry_for_image(filename, &width, &height);
-    input_drawable_t *drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
+    cache_entry_t *cache_entry;
+    input_drawable_t *drawable;
+
+    if (stream_budget > 0)
+    {
+	input_stream_t *stream = alloc_input_stream(filename);
+
+	if (stream == 0)
+	    return NULL;
+
+	drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, stream->width, stream->height);
+
+	drawable->v.cmdline.cache_entries = g_new0(cache_entry_t*, 1);
+	drawable->v.cmdline.num_frames = 1;
+	drawable->v.cmdline.image_filename = strdup(filename);
+	drawable->v.cmdline.stream = stream;
+
+	return drawable;
+    }
+
+    g_static_mutex_lock(&cache_mutex);
+
+    cache_entry = get_cache_entry_for_image(filename, &width, &height);
+    if (cache_entry == 0)
+    {
+	g_static_mutex_unlock(&cache_mutex);
+	return NULL;
+    }
+
+    drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
 
     drawable->v.cmdline.cache_entries = g_new0(cache_entry_t*, 1);
     drawable->v.cmdline.num_frames = 1;
     drawable->v.cmdline.image_filename = strdup(filename);
+    drawable->v.cmdline.stream = 0;
 
     bind_cache_entry_to_drawable(cache_entry, drawable, 0);
 
+    g_static_mutex_unlock(&cache_mutex);
+
     return drawable;
 }
 
@@ -283,141 +806,1027 @@ write_filter_html_doc (FILE *out, top_level_decl_t *decl)
     for (arg = decl->v.filter.args; arg != NULL; arg = arg->next)
 	++num_args;
 
-    arg_indent = strlen("filter") + strlen(decl->name) + 3;
+    arg_indent = strlen("filter") + strlen(decl->name) + 3;
+
+    for (arg = decl->v.filter.args; arg != NULL; arg = arg->next)
+    {
+	static struct { int num; const char *name; } types[] =
+	    { { ARG_TYPE_INT, "int" },
+	      { ARG_TYPE_FLOAT, "float" },
+	      { ARG_TYPE_COLOR, "color" },
+	      { ARG_TYPE_GRADIENT, "gradient" },
+	      { ARG_TYPE_CURVE, "curve" },
+	      { ARG_TYPE_IMAGE, "image" },
+	      { 0, NULL } };
+
+	int i;
+
+	for (i = 0; types[i].name != NULL; ++i)
+	    if (types[i].num == arg->type)
+		break;
+	g_assert(types[i].name != NULL);
+
+	fprintf(out, "%s <b>%s</b>", types[i].name, arg->name);
+
+	switch (arg->type)
+	{
+	    case ARG_TYPE_INT :
+		if (arg->v.integer.have_limits)
+		    fprintf(out, ": %d - %d", arg->v.integer.min, arg->v.integer.max);
+		break;
+
+	    case ARG_TYPE_FLOAT :
+		if (arg->v.floating.have_limits)
+		    fprintf(out, ": %g - %g", arg->v.floating.min, arg->v.floating.max);
+		break;
+
+	    default :
+		break;
+	}
+
+	if (arg->next != NULL)
+	{
+	    if (num_args > 2)
+	    {
+		int i;
+
+		fprintf(out, ",\n<br>");
+
+		for (i = 0; i < arg_indent; ++i)
+		    fprintf(out, "&nbsp;");
+	    }
+	    else
+		fprintf(out, ", ");
+	}
+    }
+
+    fprintf(out, ")</font>\n");
+
+    if (decl->docstring != NULL)
+    {
+	char *p;
+	gboolean bold_mode = FALSE;
+	gboolean newline = FALSE;
+
+	fprintf(out, "<blockquote>");
+	for (p = decl->docstring; *p != '\0'; ++p)
+	{
+	    if (*p == '\n')
+	    {
+		if (newline)
+		{
+		    fprintf(out, "\n<p>");
+		    continue;
+		}
+		newline = TRUE;
+	    }
+	    else
+		newline = FALSE;
+
+	    if (*p == '@')
+	    {
+		fprintf(out, "<b>");
+		bold_mode = TRUE;
+	    }
+	    else
+	    {
+		if (bold_mode && !is_ident_char(*p))
+		{
+		    fprintf(out, "</b>");
+		    bold_mode = FALSE;
+		}
+
+		if (!print_html_char(out, *p))
+		    return FALSE;
+	    }
+	}
+	fprintf(out, "</blockquote>\n");
+    }
+
+    return TRUE;
+}
+
+static void
+append_define (const char *str, define_t **defines)
+{
+    define_t *define = g_new0(define_t, 1);
+    const char *p;
+
+    p = strchr(str, '=');
+    if (p == NULL)
+    {
+	fprintf(stderr, _("Error: Option to -D is malformed: `%s'.\n"), str);
+	exit(1);
+    }
+
+    define->name = malloc(p - str + 1);
+    memcpy(define->name, str, p - str);
+    define->name[p - str] = '\0';
+
+    define->value = strdup(p + 1);
+
+    define->next = *defines;
+    *defines = define;
+}
+
+static define_t*
+lookup_define (define_t *defines, const char *name)
+{
+    while (defines != NULL)
+    {
+	if (strcmp(name, defines->name) == 0)
+	    return defines;
+
+	defines = defines->next;
+    }
+
+    return NULL;
+}
+
+/* Checks that all input images of the main filter are defined and
+   can be read, and if the image size is not set yet, takes it from
+   the first one.  Returns an error message, or NULL on success. */
+static char*
+check_input_images (mathmap_t *mathmap, define_t *defines, int *width, int *height,
+		    gboolean *size_is_set)
+{
+    userval_info_t *userval_info;
+
+    for (userval_info = mathmap->main_filter->userval_infos;
+	 userval_info != NULL;
+	 userval_info = userval_info->next)
+    {
+	define_t *define;
+	image_reader_t *reader;
+
+	if (userval_info->type != USERVAL_IMAGE)
+	    continue;
+
+	define = lookup_define(defines, userval_info->name);
+	if (define == NULL)
+	    return g_strdup_printf(_("No value defined for input image `%s'."), userval_info->name);
+
+	/* only the header is read */
+	reader = open_image_reading(define->value);
+	if (reader == NULL)
+	    return g_strdup_printf(_("Could not read input image `%s'."), define->value);
+
+	if (!*size_is_set)
+	{
+	    *width = reader->width;
+	    *height = reader->height;
+	    *size_is_set = TRUE;
+	}
+
+	free_image_reader(reader);
+    }
+
+    return NULL;
+}
+
+/* Sets the user values of the invocation's main filter to the
+   defines.  Returns an error message, or NULL on success. */
+static char*
+assign_defines_to_uservals (mathmap_invocation_t *invocation, define_t *defines, int *num_input_drawables)
+{
+    userval_info_t *userval_info;
+
+    for (userval_info = invocation->mathmap->main_filter->userval_infos;
+	 userval_info != NULL;
+	 userval_info = userval_info->next)
+    {
+	userval_t *userval = &invocation->uservals[userval_info->index];
+	define_t *define = lookup_define(defines, userval_info->name);
+
+	if (define == NULL)
+	{
+	    if (userval_info->type == USERVAL_IMAGE)
+		return g_strdup_printf(_("No value defined for input image `%s'."), userval_info->name);
+	}
+	else
+	    switch (userval_info->type)
+	    {
+		case USERVAL_INT_CONST :
+		    userval->v.int_const = atoi(define->value);
+		    break;
+
+		case USERVAL_FLOAT_CONST :
+		    userval->v.float_const = g_ascii_strtod(define->value, NULL);
+		    break;
+
+		case USERVAL_BOOL_CONST :
+		    userval->v.bool_const = (float)atoi(define->value);
+		    break;
+
+		case USERVAL_IMAGE :
+		    {
+			input_drawable_t *drawable = alloc_cmdline_image_input_drawable(define->value);
+
+			if (drawable == NULL)
+			    return g_strdup_printf(_("Could not read input image `%s'."), define->value);
+
+			assign_image_userval_drawable(userval_info, userval, drawable);
+			++*num_input_drawables;
+		    }
+		    break;
+
+		default :
+		    return g_strdup(_("Can only define user values for types int, float, bool and image."));
+	    }
+    }
+
+    return NULL;
+}
+
+/* Input images are read again while rendering if they were evicted
+   from the cache.  Returns an error message if one of the invocation's
+   images could not be read that way, or NULL. */
+static char*
+check_input_image_reads (mathmap_invocation_t *invocation)
+{
+    userval_info_t *info;
+
+    for (info = invocation->mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+    {
+	userval_t *userval = &invocation->uservals[info->index];
+	input_drawable_t *drawable;
+
+	if (info->type != USERVAL_IMAGE || userval->v.image == NULL
+	    || userval->v.image->type != IMAGE_DRAWABLE)
+	    continue;
+
+	drawable = userval->v.image->v.drawable;
+	if (drawable == NULL || drawable->kind != INPUT_DRAWABLE_CMDLINE_IMAGE)
+	    continue;
+
+	if (drawable->v.cmdline.read_failed
+	    || (drawable->v.cmdline.stream != NULL && drawable->v.cmdline.stream->read_failed))
+	    return g_strdup_printf(_("Could not read input image `%s'."), drawable->v.cmdline.image_filename);
+    }
+
+    return NULL;
+}
+
+#define DEFAULT_FRAME_BUFFERS		4
+
+static char*
+make_frame_filename (const char *filename, int frame)
+{
+    const char *dot = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+
+    if (dot == NULL || (slash != NULL && dot < slash))
+	return g_strdup_printf("%s-%04d", filename, frame);
+    return g_strdup_printf("%.*s-%04d%s", (int)(dot - filename), filename, frame, dot);
+}
+
+static void
+write_frame (const char *output_filename, int frame, guchar *output,
+	     int img_width, int img_height, int output_bpp)
+{
+    char *filename = make_frame_filename(output_filename, frame);
+
+    write_image(filename, img_width, img_height, output,
+		output_bpp, img_width * output_bpp, IMAGE_FORMAT_PNG);
+
+    g_free(filename);
+}
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+/* Animations are rendered in a three stage pipeline: the main thread
+   initializes frames, the render thread renders them and the write
+   thread encodes them.  Each frame in flight owns one output buffer,
+   and there are only num_buffers of them, which bounds the memory
+   used. */
+typedef struct
+{
+    int current_frame;
+    guchar *output;
+    image_t *closure;
+    mathmap_frame_t *frame;
+} pipeline_frame_t;
+
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    int img_width, img_height;
+    int num_threads;
+    const char *output_filename; /* NULL if no output */
+
+    GAsyncQueue *free_queue;
+    GAsyncQueue *render_queue;
+    GAsyncQueue *write_queue;
+} pipeline_t;
+
+/* Pushed through the queues after the last frame. */
+static pipeline_frame_t end_of_frames;
+
+static void
+pipeline_render_thread_func (gpointer _pipeline)
+{
+    pipeline_t *pipeline = (pipeline_t*)_pipeline;
+
+    for (;;)
+    {
+	pipeline_frame_t *pframe = g_async_queue_pop(pipeline->render_queue);
+
+	if (pframe != &end_of_frames)
+	{
+	    call_invocation_parallel_and_join(pframe->frame, pframe->closure, 0, 0,
+					      pipeline->img_width, pipeline->img_height,
+					      pframe->output, pipeline->num_threads);
+
+	    invocation_free_frame(pframe->frame);
+	    closure_image_free(pframe->closure);
+	    pframe->frame = NULL;
+	    pframe->closure = NULL;
+	}
+
+	g_async_queue_push(pipeline->write_queue, pframe);
+
+	if (pframe == &end_of_frames)
+	    break;
+    }
+}
+
+static void
+pipeline_write_thread_func (gpointer _pipeline)
+{
+    pipeline_t *pipeline = (pipeline_t*)_pipeline;
+    mathmap_invocation_t *invocation = pipeline->invocation;
+
+    for (;;)
+    {
+	pipeline_frame_t *pframe = g_async_queue_pop(pipeline->write_queue);
+
+	if (pframe == &end_of_frames)
+	    break;
+
+	if (pipeline->output_filename != NULL)
+	    write_frame(pipeline->output_filename, pframe->current_frame, pframe->output,
+			pipeline->img_width, pipeline->img_height, invocation->output_bpp);
+
+	g_async_queue_push(pipeline->free_queue, pframe);
+    }
+}
+
+static void
+render_frames_pipelined (mathmap_invocation_t *invocation, int img_width, int img_height,
+			 int num_frames, int num_threads, int num_buffers, const char *output_filename)
+{
+    pipeline_t pipeline;
+    pipeline_frame_t *pframes;
+    thread_handle_t render_thread, write_thread;
+    int current_frame;
+    int i;
+
+    pipeline.invocation = invocation;
+    pipeline.img_width = img_width;
+    pipeline.img_height = img_height;
+    pipeline.num_threads = num_threads;
+    pipeline.output_filename = output_filename;
+
+    pipeline.free_queue = g_async_queue_new();
+    pipeline.render_queue = g_async_queue_new();
+    pipeline.write_queue = g_async_queue_new();
+
+    num_buffers = MIN(num_buffers, num_frames);
+    pframes = g_new0(pipeline_frame_t, num_buffers);
+    for (i = 0; i < num_buffers; ++i)
+    {
+	pframes[i].output = (guchar*)malloc((long)invocation->output_bpp * (long)img_width * (long)img_height);
+	assert(pframes[i].output != 0);
+	g_async_queue_push(pipeline.free_queue, &pframes[i]);
+    }
+
+    render_thread = mathmap_thread_start(pipeline_render_thread_func, &pipeline);
+    write_thread = mathmap_thread_start(pipeline_write_thread_func, &pipeline);
+
+    for (current_frame = 0; current_frame < num_frames; ++current_frame)
+    {
+	pipeline_frame_t *pframe = g_async_queue_pop(pipeline.free_queue);
+	float current_t = (float)current_frame / (float)num_frames;
+
+	pframe->current_frame = current_frame;
+	pframe->closure = closure_image_alloc(&invocation->mathfuncs,
+					      NULL,
+					      invocation->mathmap->main_filter->num_uservals,
+					      invocation->uservals,
+					      img_width, img_height);
+	pframe->frame = invocation_new_frame(invocation, pframe->closure,
+					     current_frame, current_t);
+
+	g_async_queue_push(pipeline.render_queue, pframe);
+    }
+
+    g_async_queue_push(pipeline.render_queue, &end_of_frames);
+
+    mathmap_thread_join(render_thread);
+    mathmap_thread_join(write_thread);
+
+    for (i = 0; i < num_buffers; ++i)
+	free(pframes[i].output);
+    g_free(pframes);
+
+    g_async_queue_unref(pipeline.free_queue);
+    g_async_queue_unref(pipeline.render_queue);
+    g_async_queue_unref(pipeline.write_queue);
+}
+#endif
+
+/* Still images are rendered and written in bands of rows so that only
+   two bands of output have to be kept in memory: while one band is
+   rendered, the finished rows of it and the rest of the previous band
+   are encoded. */
+#define MIN_OUTPUT_BAND_HEIGHT		64
+
+static void
+write_finished_rows (mathmap_invocation_t *invocation, image_writer_t *writer,
+		     guchar *band, int band_y, int last_row, gboolean wait_for_rows)
+{
+    while (writer->num_lines_written < last_row)
+    {
+	int first_row = writer->num_lines_written;
+	int row = first_row;
+
+	if (wait_for_rows)
+	    while (row < last_row && invocation->rows_finished[row])
+		++row;
+	else
+	    row = last_row;
+
+	if (row == first_row)
+	    break;
+
+	write_lines(writer, band + (first_row - band_y) * invocation->row_stride, row - first_row);
+    }
+}
+
+static gboolean
+render_and_write_banded (mathmap_invocation_t *invocation, mathmap_frame_t *frame, image_t *closure,
+			 int img_width, int img_height, int num_threads, const char *output_filename)
+{
+    int band_height = MIN(img_height, MAX(MIN_OUTPUT_BAND_HEIGHT, invocation->tile_height * num_threads * 4));
+    long band_size = (long)invocation->row_stride * band_height;
+    guchar *bands[2];
+    image_writer_t *writer;
+    int band_y, prev_band_y = -1;
+    int i;
+
+    writer = open_image_writing(output_filename, img_width, img_height,
+				invocation->output_bpp, invocation->row_stride, IMAGE_FORMAT_PNG);
+    if (writer == 0)
+	return FALSE;
+
+    for (i = 0; i < 2; ++i)
+    {
+	bands[i] = (guchar*)malloc(band_size);
+	assert(bands[i] != 0);
+    }
+
+    for (i = 0, band_y = 0; band_y < img_height; band_y += band_height, i ^= 1)
+    {
+	int this_band_height = MIN(band_height, img_height - band_y);
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+	gpointer call = call_invocation_parallel(frame, closure, 0, band_y, img_width, this_band_height,
+						 bands[i], num_threads);
+
+	if (prev_band_y >= 0)
+	    write_finished_rows(invocation, writer, bands[i ^ 1], prev_band_y, band_y, FALSE);
+
+	while (invocation_call_wait(call))
+	    write_finished_rows(invocation, writer, bands[i], band_y, band_y + this_band_height, TRUE);
+
+	join_invocation_call(call);
+#else
+	call_invocation_parallel_and_join(frame, closure, 0, band_y, img_width, this_band_height,
+					  bands[i], num_threads);
+
+	if (prev_band_y >= 0)
+	    write_finished_rows(invocation, writer, bands[i ^ 1], prev_band_y, band_y, FALSE);
+#endif
+
+	prev_band_y = band_y;
+    }
+
+    if (prev_band_y >= 0)
+	write_finished_rows(invocation, writer, bands[i ^ 1], prev_band_y, img_height, FALSE);
+
+    free_image_writer(writer);
+
+    for (i = 0; i < 2; ++i)
+	free(bands[i]);
+
+    return TRUE;
+}
+
+/* Still images are rendered in bands, each by its own call, so the
+   rows and the time left are computed for the whole image. */
+static void
+print_progress (const render_progress_t *progress, void *data)
+{
+    mathmap_invocation_t *invocation = (mathmap_invocation_t*)data;
+    int rows_done = progress->first_row + progress->rows_done;
+
+    if (progress->pixels_per_second <= 0.0)
+	return;
+
+    fprintf(stderr, _("\r%d of %d rows, %.2f Mpixels/s, %.0f s left  "),
+	    rows_done, invocation->img_height, progress->pixels_per_second / 1000000.0,
+	    (double)(invocation->img_height - rows_done) * invocation->img_width / progress->pixels_per_second);
+    if (rows_done == invocation->img_height)
+	fprintf(stderr, "\n");
+}
+
+static char**
+make_support_paths (void)
+{
+    char **support_paths = g_new(char*, 4);
+
+    support_paths[0] = g_strdup_printf("%s/mathmap", GIMPDATADIR);
+    support_paths[1] = g_strdup_printf("%s/.gimp-2.6/mathmap", getenv("HOME"));
+    support_paths[2] = g_strdup_printf("%s/.gimp-2.4/mathmap", getenv("HOME"));
+    support_paths[3] = NULL;
+
+    return support_paths;
+}
+
+/* In server mode render jobs are read from stdin or from connections
+   to a Unix socket and done one after the other, so the startup costs
+   are only paid once.  A job is a sequence of lines
+
+     script-file FILENAME
+     script LENGTH          followed by LENGTH bytes of script
+     define NAME=VALUE
+     size WIDTHxHEIGHT
+     output FILENAME
+     render
+
+   and is answered with a line `ok' or `error MESSAGE'.  `quit' stops
+   the server.
+
+   The most recently used scripts are kept compiled, keyed by their
+   text.  The invocation of the last job of a script is the template
+   for the next one, so the user values a job doesn't define keep the
+   values they had in the previous job with the same script.  Input
+   images are not carried over. */
+#define DEFAULT_SCRIPT_CACHE_SIZE	8
+
+typedef struct
+{
+    char *script;
+    mathmap_t *mathmap;
+    mathmap_invocation_t *template;
+    int timestamp;
+} compiled_script_t;
+
+typedef struct
+{
+    char **support_paths;
+    int compile_time_limit;
+    int num_threads;
+    int antialiasing;
+    int supersampling;
+
+    compiled_script_t *scripts;
+    int num_scripts;
+    int clock;
+} server_t;
+
+typedef struct
+{
+    char *script;
+    define_t *defines;
+    gboolean size_is_set;
+    int img_width;
+    int img_height;
+    char *output_filename;
+} server_job_t;
+
+static void
+free_compiled_script (compiled_script_t *compiled)
+{
+    if (compiled->template != NULL)
+	free_invocation(compiled->template);
+    free_mathmap(compiled->mathmap);
+    g_free(compiled->script);
+
+    memset(compiled, 0, sizeof(compiled_script_t));
+}
+
+static compiled_script_t*
+lookup_compiled_script (server_t *server, const char *script, char **error)
+{
+    compiled_script_t *compiled = NULL;
+    char *script_copy;
+    mathmap_t *mathmap;
+    int i;
+
+    for (i = 0; i < server->num_scripts; ++i)
+	if (server->scripts[i].script == NULL)
+	{
+	    if (compiled == NULL)
+		compiled = &server->scripts[i];
+	}
+	else if (strcmp(server->scripts[i].script, script) == 0)
+	{
+	    server->scripts[i].timestamp = ++server->clock;
+	    return &server->scripts[i];
+	}
+	else if (compiled == NULL || (compiled->script != NULL && server->scripts[i].timestamp < compiled->timestamp))
+	    compiled = &server->scripts[i];
+
+    g_assert(compiled != NULL);
+
+    script_copy = g_strdup(script);
+    lock_mathmap_compiler();
+    mathmap = compile_mathmap(script_copy, server->support_paths, server->compile_time_limit, FALSE);
+    if (mathmap == NULL)
+    {
+	*error = g_strdup(error_string);
+	unlock_mathmap_compiler();
+	g_free(script_copy);
+	return NULL;
+    }
+    unlock_mathmap_compiler();
+
+    if (compiled->script != NULL)
+	free_compiled_script(compiled);
+
+    compiled->script = script_copy;
+    compiled->mathmap = mathmap;
+    compiled->template = NULL;
+    compiled->timestamp = ++server->clock;
+
+    return compiled;
+}
+
+/* Templates must not hold on to input images, because carrying them
+   over would read them again. */
+static void
+free_image_uservals (mathmap_invocation_t *invocation)
+{
+    userval_info_t *info;
+
+    for (info = invocation->mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+    {
+	userval_t *userval = &invocation->uservals[info->index];
+
+	if (info->type != USERVAL_IMAGE || userval->v.image == NULL
+	    || userval->v.image->type != IMAGE_DRAWABLE)
+	    continue;
+
+	free_input_drawable(userval->v.image->v.drawable);
+	userval->v.image = NULL;
+    }
+}
+
+/* Returns an error message, or NULL if the job was done. */
+static char*
+run_server_job (server_t *server, server_job_t *job)
+{
+    compiled_script_t *compiled;
+    mathmap_invocation_t *invocation;
+    int img_width = job->img_width, img_height = job->img_height;
+    gboolean size_is_set = job->size_is_set;
+    int num_input_drawables = 0;
+    char *error = NULL;
+
+    if (job->script == NULL)
+	return g_strdup(_("No script given."));
+    if (job->output_filename == NULL)
+	return g_strdup(_("No output file given."));
+
+    compiled = lookup_compiled_script(server, job->script, &error);
+    if (compiled == NULL)
+	return error;
+
+    error = check_input_images(compiled->mathmap, job->defines, &img_width, &img_height, &size_is_set);
+    if (error != NULL)
+	return error;
+    if (!size_is_set)
+	return g_strdup(_("Image size not set and no input images given."));
+
+    invocation = invoke_mathmap(compiled->mathmap, compiled->template, img_width, img_height, FALSE);
+
+    error = assign_defines_to_uservals(invocation, job->defines, &num_input_drawables);
+    if (error == NULL)
+    {
+	image_t *closure;
+	mathmap_frame_t *frame;
+
+	invocation_set_antialiasing(invocation, server->antialiasing);
+	invocation->supersampling = server->supersampling;
+	invocation->output_bpp = 4;
+
+	closure = closure_image_alloc(&invocation->mathfuncs, NULL,
+				      invocation->mathmap->main_filter->num_uservals,
+				      invocation->uservals, img_width, img_height);
+	frame = invocation_new_frame(invocation, closure, 0, 0.0);
+
+	++current_time;
+
+	if (!render_and_write_banded(invocation, frame, closure, img_width, img_height,
+				     server->num_threads, job->output_filename))
+	    error = g_strdup_printf(_("Cannot write output image `%s'."), job->output_filename);
+	else
+	    error = check_input_image_reads(invocation);
+
+	invocation_free_frame(frame);
+	closure_image_free(closure);
+	invocation_release_native_filter_results(invocation);
+    }
+
+    free_image_uservals(invocation);
+
+    if (error != NULL)
+    {
+	free_invocation(invocation);
+	return error;
+    }
+
+    if (compiled->template != NULL)
+	free_invocation(compiled->template);
+    compiled->template = invocation;
+
+    return NULL;
+}
+
+static void
+reset_server_job (server_job_t *job)
+{
+    while (job->defines != NULL)
+    {
+	define_t *next = job->defines->next;
+
+	free(job->defines->name);
+	free(job->defines->value);
+	g_free(job->defines);
+
+	job->defines = next;
+    }
+
+    g_free(job->script);
+    g_free(job->output_filename);
+
+    memset(job, 0, sizeof(server_job_t));
+}
+
+/* Returns the next line without the newline, or NULL at the end of
+   the input. */
+static char*
+read_server_line (FILE *in)
+{
+    GString *line = g_string_new(NULL);
+    int c;
+
+    while ((c = getc(in)) != EOF && c != '\n')
+	g_string_append_c(line, c);
+
+    if (c == EOF && line->len == 0)
+    {
+	g_string_free(line, TRUE);
+	return NULL;
+    }
+
+    return g_string_free(line, FALSE);
+}
+
+static char*
+read_server_job_line (FILE *in, server_job_t *job, gboolean *render, gboolean *quit)
+{
+    char *line = read_server_line(in);
+    char *arg;
+    char *error = NULL;
+
+    if (line == NULL)
+    {
+	*quit = TRUE;
+	return NULL;
+    }
+
+    arg = strchr(line, ' ');
+    if (arg != NULL)
+	*arg++ = '\0';
+
+    if (strcmp(line, "render") == 0)
+	*render = TRUE;
+    else if (strcmp(line, "quit") == 0)
+	*quit = TRUE;
+    else if (line[0] == '\0')
+	;
+    else if (arg == NULL)
+	error = g_strdup_printf(_("Unknown command `%s'."), line);
+    else if (strcmp(line, "script-file") == 0)
+    {
+	g_free(job->script);
+	job->script = NULL;
+	if (!g_file_get_contents(arg, &job->script, NULL, NULL))
+	    error = g_strdup_printf(_("The script file `%s' could not be read."), arg);
+    }
+    else if (strcmp(line, "script") == 0)
+    {
+	long length = atol(arg);
+
+	g_free(job->script);
+	job->script = g_malloc(MAX(length, 0) + 1);
+	if (length < 0 || (long)fread(job->script, 1, length, in) != length)
+	{
+	    error = g_strdup(_("The script is shorter than its length."));
+	    *quit = TRUE;
+	}
+	else
+	    job->script[length] = '\0';
+    }
+    else if (strcmp(line, "define") == 0)
+    {
+	if (strchr(arg, '=') == NULL)
+	    error = g_strdup_printf(_("Define is malformed: `%s'."), arg);
+	else
+	    append_define(arg, &job->defines);
+    }
+    else if (strcmp(line, "size") == 0)
+    {
+	if (parse_image_size(arg, &job->img_width, &job->img_height))
+	    job->size_is_set = TRUE;
+	else
+	    error = g_strdup(_("Invalid image size.  Syntax is <width>x<height>."));
+    }
+    else if (strcmp(line, "output") == 0)
+    {
+	g_free(job->output_filename);
+	job->output_filename = g_strdup(arg);
+    }
+    else
+	error = g_strdup_printf(_("Unknown command `%s'."), line);
+
+    g_free(line);
+
+    return error;
+}
+
+static void
+reply_to_client (FILE *out, char *error)
+{
+    if (error == NULL)
+	fprintf(out, "ok\n");
+    else
+    {
+	fprintf(out, "error %s\n", error);
+	g_free(error);
+    }
+    fflush(out);
+}
+
+/* Does the jobs read from in until the end of the input.  Returns
+   whether the server should quit.  A job with an erroneous line is
+   discarded up to its render line. */
+static gboolean
+serve_jobs (server_t *server, FILE *in, FILE *out)
+{
+    server_job_t job;
+    char *job_error = NULL;
+    gboolean quit = FALSE;
+
+    memset(&job, 0, sizeof(server_job_t));
 
-    for (arg = decl->v.filter.args; arg != NULL; arg = arg->next)
+    for (;;)
     {
-	static struct { int num; const char *name; } types[] =
-	    { { ARG_TYPE_INT, "int" },
-	      { ARG_TYPE_FLOAT, "float" },
-	      { ARG_TYPE_COLOR, "color" },
-	      { ARG_TYPE_GRADIENT, "gradient" },
-	      { ARG_TYPE_CURVE, "curve" },
-	      { ARG_TYPE_IMAGE, "image" },
-	      { 0, NULL } };
-
-	int i;
-
-	for (i = 0; types[i].name != NULL; ++i)
-	    if (types[i].num == arg->type)
-		break;
-	g_assert(types[i].name != NULL);
+	gboolean render = FALSE, end = FALSE;
+	char *error = read_server_job_line(in, &job, &render, &end);
 
-	fprintf(out, "%s <b>%s</b>", types[i].name, arg->name);
+	if (error != NULL && job_error == NULL)
+	    job_error = error;
+	else
+	    g_free(error);
 
-	switch (arg->type)
+	if (render)
 	{
-	    case ARG_TYPE_INT :
-		if (arg->v.integer.have_limits)
-		    fprintf(out, ": %d - %d", arg->v.integer.min, arg->v.integer.max);
-		break;
-
-	    case ARG_TYPE_FLOAT :
-		if (arg->v.floating.have_limits)
-		    fprintf(out, ": %g - %g", arg->v.floating.min, arg->v.floating.max);
-		break;
+	    if (job_error == NULL)
+		job_error = run_server_job(server, &job);
+	    reply_to_client(out, job_error);
 
-	    default :
-		break;
+	    job_error = NULL;
+	    reset_server_job(&job);
 	}
 
-	if (arg->next != NULL)
+	if (end)
 	{
-	    if (num_args > 2)
-	    {
-		int i;
+	    /* an unfinished job is not done, but its error reported */
+	    if (job_error != NULL)
+		reply_to_client(out, job_error);
+	    quit = !feof(in);
+	    break;
+	}
+    }
 
-		fprintf(out, ",\n<br>");
+    reset_server_job(&job);
 
-		for (i = 0; i < arg_indent; ++i)
-		    fprintf(out, "&nbsp;");
-	    }
-	    else
-		fprintf(out, ", ");
-	}
+    return quit;
+}
+
+#ifndef __MINGW32__
+static int
+serve_socket (server_t *server, const char *socket_filename)
+{
+    struct sockaddr_un address;
+    struct stat stat_buf;
+    int fd;
+    gboolean quit = FALSE;
+
+    if (strlen(socket_filename) >= sizeof(address.sun_path))
+    {
+	fprintf(stderr, _("Error: The socket file name `%s' is too long.\n"), socket_filename);
+	return 1;
     }
 
-    fprintf(out, ")</font>\n");
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_filename);
 
-    if (decl->docstring != NULL)
+    /* a socket left over by a server which didn't quit */
+    if (stat(socket_filename, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode))
+	unlink(socket_filename);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0
+	|| bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+	|| listen(fd, 8) != 0)
     {
-	char *p;
-	gboolean bold_mode = FALSE;
-	gboolean newline = FALSE;
+	fprintf(stderr, _("Error: Cannot listen on socket `%s': %s\n"), socket_filename, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return 1;
+    }
 
-	fprintf(out, "<blockquote>");
-	for (p = decl->docstring; *p != '\0'; ++p)
-	{
-	    if (*p == '\n')
-	    {
-		if (newline)
-		{
-		    fprintf(out, "\n<p>");
-		    continue;
-		}
-		newline = TRUE;
-	    }
-	    else
-		newline = FALSE;
+    /* clients might go away before we reply */
+    signal(SIGPIPE, SIG_IGN);
 
-	    if (*p == '@')
-	    {
-		fprintf(out, "<b>");
-		bold_mode = TRUE;
-	    }
-	    else
-	    {
-		if (bold_mode && !is_ident_char(*p))
-		{
-		    fprintf(out, "</b>");
-		    bold_mode = FALSE;
-		}
+    while (!quit)
+    {
+	int connection = accept(fd, NULL, NULL);
+	FILE *in, *out;
 
-		if (!print_html_char(out, *p))
-		    return FALSE;
-	    }
+	if (connection < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, _("Error: Cannot accept connection: %s\n"), strerror(errno));
+	    break;
 	}
-	fprintf(out, "</blockquote>\n");
-    }
 
-    return TRUE;
-}
+	in = fdopen(connection, "r");
+	out = fdopen(dup(connection), "w");
+	g_assert(in != NULL && out != NULL);
 
-static void
-append_define (const char *str, define_t **defines)
-{
-    define_t *define = g_new0(define_t, 1);
-    const char *p;
+	quit = serve_jobs(server, in, out);
 
-    p = strchr(str, '=');
-    if (p == NULL)
-    {
-	fprintf(stderr, _("Error: Option to -D is malformed: `%s'.\n"), str);
-	exit(1);
+	fclose(in);
+	fclose(out);
     }
 
-    define->name = malloc(p - str + 1);
-    memcpy(define->name, str, p - str);
-    define->name[p - str] = '\0';
-
-    define->value = strdup(p + 1);
+    close(fd);
+    unlink(socket_filename);
 
-    define->next = *defines;
-    *defines = define;
+    return quit ? 0 : 1;
 }
+#endif
 
-static define_t*
-lookup_define (define_t *defines, const char *name)
+static int
+run_server (char **support_paths, int compile_time_limit, int num_threads,
+	    int antialiasing, int supersampling, int script_cache_size, const char *socket_filename)
 {
-    while (defines != NULL)
-    {
-	if (strcmp(name, defines->name) == 0)
-	    return defines;
+    server_t server;
+    int result = 0;
+    int i;
 
-	defines = defines->next;
+    server.support_paths = support_paths;
+    server.compile_time_limit = compile_time_limit;
+    server.num_threads = num_threads;
+    server.antialiasing = antialiasing;
+    server.supersampling = supersampling;
+    server.scripts = g_new0(compiled_script_t, script_cache_size);
+    server.num_scripts = script_cache_size;
+    server.clock = 0;
+
+    if (socket_filename != NULL)
+    {
+#ifndef __MINGW32__
+	result = serve_socket(&server, socket_filename);
+#else
+	fprintf(stderr, _("Error: Sockets are not supported on this platform.\n"));
+	result = 1;
+#endif
     }
+    else
+	serve_jobs(&server, stdin, stdout);
 
-    return NULL;
+    for (i = 0; i < server.num_scripts; ++i)
+	if (server.scripts[i].script != NULL)
+	    free_compiled_script(&server.scripts[i]);
+    g_free(server.scripts);
+
+    return result;
 }
 
 static void
@@ -434,21 +1843,42 @@ usage (void)
 	   "  mathmap --htmldoc [<script>] <outfile>\n"
 	   "      outputs HTML documentation for the filters in\n"
 	   "      the script to <outfile>\n"
+	   "  mathmap [option ...] --server\n"
+	   "      render the jobs read from stdin, or from the\n"
+	   "      connections to the socket given by --server-socket\n"
 	   "Options:\n"
 	   "  -f, --script-file=FILENAME  read script from FILENAME\n"
 	   "  -D<name>=<value>            define user value\n"
 #ifdef MOVIES
 	   "  -M, --movie=FILENAME        input movie FILENAME\n"
 	   "  -F, --frames=NUM            output movie has NUM frames\n"
+#else
+	   "  -F, --frames=NUM            render NUM frames to numbered files\n"
 #endif
 	   "  -i, --intersampling         use intersampling\n"
 	   "  -o, --oversampling          use oversampling\n"
 	   "  -s, --size=WIDTHxHEIGHT     sets the output image size\n"
 	   "  -c, --cache=NUM             cache NUM input images (default %d)\n"
+	   "      --tiled-input           store input images in tiles\n"
+	   "      --filter-cache=MB       keep at most MB megabytes of blur and\n"
+	   "                              convolution results (default 256)\n"
+	   "      --stream-input=MB       read input images on demand, keeping\n"
+	   "                              at most MB megabytes of each in memory\n"
+	   "                              (fractions are allowed)\n"
+	   "      --fast-noise            compute noise functions in single\n"
+	   "                              precision\n"
+	   "  -t, --threads=NUM           render with NUM threads (default %d)\n"
+	   "      --frame-buffers=NUM     render at most NUM frames at once (default %d)\n"
+	   "      --progress              print the rendering progress\n"
+	   "      --server-socket=FILENAME\n"
+	   "                              in server mode, read jobs from\n"
+	   "                              connections to the Unix socket FILENAME\n"
+	   "      --script-cache=NUM      in server mode, keep the NUM most\n"
+	   "                              recently used scripts compiled (default %d)\n"
 	   "  -g, --generator=GEN         generate plug-in code with GEN\n"
 	   "\n"
 	   "Report bugs and suggestions to schani@complang.tuwien.ac.at\n",
-	   cache_size);
+	   cache_size, get_num_cpus(), DEFAULT_FRAME_BUFFERS, DEFAULT_SCRIPT_CACHE_SIZE);
 }
 
 #define OPTION_VERSION				256
@@ -459,6 +1889,15 @@ usage (void)
 #define OPTION_BENCH_NO_COMPILE_TIME_LIMIT	261
 #define OPTION_BENCH_NO_BACKEND			262
 #define OPTION_BENCH_RENDER_COUNT		263
+#define OPTION_FRAME_BUFFERS			264
+#define OPTION_TILED_INPUT			265
+#define OPTION_STREAM_INPUT			266
+#define OPTION_FILTER_CACHE			267
+#define OPTION_FAST_NOISE			268
+#define OPTION_PROGRESS				269
+#define OPTION_SERVER				270
+#define OPTION_SERVER_SOCKET			271
+#define OPTION_SCRIPT_CACHE			272
 
 int
 cmdline_main (int argc, char *argv[])
@@ -473,7 +1912,6 @@ cmdline_main (int argc, char *argv[])
     int antialiasing = 0, supersampling = 0;
     int img_width, img_height;
     char *generator = 0;
-    userval_info_t *userval_info;
     int num_input_drawables = 0;
     gboolean size_is_set = FALSE;
     char *script = NULL;
@@ -485,6 +1923,12 @@ cmdline_main (int argc, char *argv[])
     gboolean bench_no_output = FALSE;
     gboolean bench_no_backend = FALSE;
     int compile_time_limit = DEFAULT_OPTIMIZATION_TIMEOUT;
+    int num_threads = get_num_cpus();
+    int num_frame_buffers = DEFAULT_FRAME_BUFFERS;
+    gboolean show_progress = FALSE;
+    gboolean server = FALSE;
+    char *server_socket = NULL;
+    int script_cache_size = DEFAULT_SCRIPT_CACHE_SIZE;
 
     for (;;)
     {
@@ -495,6 +1939,17 @@ cmdline_main (int argc, char *argv[])
 		{ "intersampling", no_argument, 0, 'i' },
 		{ "oversampling", no_argument, 0, 'o' },
 		{ "cache", required_argument, 0, 'c' },
+		{ "tiled-input", no_argument, 0, OPTION_TILED_INPUT },
+		{ "stream-input", required_argument, 0, OPTION_STREAM_INPUT },
+		{ "filter-cache", required_argument, 0, OPTION_FILTER_CACHE },
+		{ "fast-noise", no_argument, 0, OPTION_FAST_NOISE },
+		{ "threads", required_argument, 0, 't' },
+		{ "frames", required_argument, 0, 'F' },
+		{ "frame-buffers", required_argument, 0, OPTION_FRAME_BUFFERS },
+		{ "progress", no_argument, 0, OPTION_PROGRESS },
+		{ "server", no_argument, 0, OPTION_SERVER },
+		{ "server-socket", required_argument, 0, OPTION_SERVER_SOCKET },
+		{ "script-cache", required_argument, 0, OPTION_SCRIPT_CACHE },
 		{ "generator", required_argument, 0, 'g' },
 		{ "size", required_argument, 0, 's' },
 		{ "script-file", required_argument, 0, 'f' },
@@ -505,7 +1960,6 @@ cmdline_main (int argc, char *argv[])
 		{ "bench-no-backend", no_argument, 0, OPTION_BENCH_NO_BACKEND },
 		{ "bench-render-count", required_argument, 0, OPTION_BENCH_RENDER_COUNT },
 #ifdef MOVIES
-		{ "frames", required_argument, 0, 'F' },
 		{ "movie", required_argument, 0, 'M' },
 #endif
 		{ 0, 0, 0, 0 }
@@ -515,9 +1969,9 @@ cmdline_main (int argc, char *argv[])
 
 	option = getopt_long(argc, argv, 
 #ifdef MOVIES
-			     "f:ioF:D:M:c:g:s:", 
+			     "f:ioF:D:M:c:t:g:s:", 
 #else
-			     "f:ioD:c:g:s:",
+			     "f:ioF:D:c:t:g:s:",
 #endif
 			     long_options, &option_index);
 
@@ -575,12 +2029,77 @@ cmdline_main (int argc, char *argv[])
 		assert(cache_size > 0);
 		break;
 
+	    case OPTION_TILED_INPUT :
+		tiled_input = TRUE;
+		break;
+
+	    case OPTION_FILTER_CACHE :
+		if (atoi(optarg) < 0)
+		{
+		    fprintf(stderr, _("Error: The filter cache size must not be negative.\n"));
+		    return 1;
+		}
+		native_filter_cache_set_budget((size_t)atoi(optarg) * 1024 * 1024);
+		break;
+
+	    case OPTION_FAST_NOISE :
+		libnoise_set_fast_noise(1);
+		break;
+
+	    case OPTION_PROGRESS :
+		show_progress = TRUE;
+		break;
+
+	    case OPTION_SERVER :
+		server = TRUE;
+		break;
+
+	    case OPTION_SERVER_SOCKET :
+		server = TRUE;
+		server_socket = optarg;
+		break;
+
+	    case OPTION_SCRIPT_CACHE :
+		script_cache_size = atoi(optarg);
+		if (script_cache_size <= 0)
+		{
+		    fprintf(stderr, _("Error: The script cache size must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+	    case OPTION_STREAM_INPUT :
+		{
+		    double megabytes = g_ascii_strtod(optarg, NULL);
+
+		    if (megabytes * 1024 * 1024 < 1)
+		    {
+			fprintf(stderr, _("Error: The stream input budget must be positive.\n"));
+			return 1;
+		    }
+		    stream_budget = (size_t)(megabytes * 1024 * 1024);
+		}
+		break;
+
+	    case 't' :
+		num_threads = atoi(optarg);
+		if (num_threads <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of threads must be positive.\n"));
+		    return 1;
+		}
+		break;
+
 	    case 'D' :
 		append_define(optarg, &defines);
 		break;
 
 	    case 'I' :
-		alloc_cmdline_image_input_drawable(optarg);
+		if (alloc_cmdline_image_input_drawable(optarg) == NULL)
+		{
+		    fprintf(stderr, _("Error: Could not read input image `%s'.\n"), optarg);
+		    return 1;
+		}
 		break;
 
 	    case 'g' :
@@ -616,13 +2135,25 @@ cmdline_main (int argc, char *argv[])
 		bench_no_backend = TRUE;
 		break;
 
-#ifdef MOVIES
+	    case OPTION_FRAME_BUFFERS :
+		num_frame_buffers = atoi(optarg);
+		if (num_frame_buffers <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of frame buffers must be positive.\n"));
+		    return 1;
+		}
+		break;
+
 	    case 'F' :
+#ifdef MOVIES
 		generate_movie = 1;
+#endif
 		num_frames = atoi(optarg);
 		assert(num_frames > 0);
 		break;
 
+#ifdef MOVIES
+
 	    case 'M' :
 		alloc_cmdline_movie_input_drawable(optarg);
 		break;
@@ -630,7 +2161,15 @@ cmdline_main (int argc, char *argv[])
 	}
     }
 
-    if (script != NULL)
+    if (server)
+    {
+	if (argc - optind != 0)
+	{
+	    usage();
+	    return 1;
+	}
+    }
+    else if (script != NULL)
     {
 	if (argc - optind != 1)
 	{
@@ -657,6 +2196,10 @@ cmdline_main (int argc, char *argv[])
     init_macros();
     init_compiler();
 
+    if (server)
+	return run_server(make_support_paths(), compile_time_limit, num_threads,
+			  antialiasing, supersampling, script_cache_size, server_socket);
+
     if (htmldoc)
     {
 	mathmap_t *mathmap = parse_mathmap(script);
@@ -690,15 +2233,12 @@ cmdline_main (int argc, char *argv[])
     }
     else if (generator == 0)
     {
-	char *support_paths[4];
+	char **support_paths = make_support_paths();
 	mathmap_t *mathmap;
 	mathmap_invocation_t *invocation;
 	int current_frame;
-
-	support_paths[0] = g_strdup_printf("%s/mathmap", GIMPDATADIR);
-	support_paths[1] = g_strdup_printf("%s/.gimp-2.6/mathmap", getenv("HOME"));
-	support_paths[2] = g_strdup_printf("%s/.gimp-2.4/mathmap", getenv("HOME"));
-	support_paths[3] = NULL;
+	gboolean write_frames;
+	char *error;
 
 	mathmap = compile_mathmap(script, support_paths, compile_time_limit, bench_no_backend);
 
@@ -714,36 +2254,12 @@ cmdline_main (int argc, char *argv[])
 	if (bench_render_count == 0)
 	    return 0;
 
-	if (!size_is_set)
-	    for (userval_info = mathmap->main_filter->userval_infos;
-		 userval_info != NULL;
-		 userval_info = userval_info->next)
-	    {
-		define_t *define;
-		unsigned char *image;
-
-		if (userval_info->type != USERVAL_IMAGE)
-		    continue;
-
-		define = lookup_define(defines, userval_info->name);
-		if (define == NULL)
-		{
-		    fprintf(stderr, _("Error: No value defined for input image `%s'.\n"), userval_info->name);
-		    return 1;
-		}
-
-		image = read_image(define->value, &img_width, &img_height);
-		if (image == NULL)
-		{
-		    fprintf(stderr, _("Error: Could not read input image `%s'.\n"), define->value);
-		    return 1;
-		}
-		free(image);
-
-		size_is_set = TRUE;
-
-		break;
-	    }
+	error = check_input_images(mathmap, defines, &img_width, &img_height, &size_is_set);
+	if (error != NULL)
+	{
+	    fprintf(stderr, _("Error: %s\n"), error);
+	    return 1;
+	}
 
 	if (!size_is_set)
 	{
@@ -751,48 +2267,19 @@ cmdline_main (int argc, char *argv[])
 	    exit(1);
 	}
 
+	write_frames = num_frames > 1;
+#ifdef MOVIES
+	if (generate_movie)
+	    write_frames = FALSE;
+#endif
+
 	invocation = invoke_mathmap(mathmap, NULL, img_width, img_height, TRUE);
 
-	for (userval_info = mathmap->main_filter->userval_infos;
-	     userval_info != NULL;
-	     userval_info = userval_info->next)
+	error = assign_defines_to_uservals(invocation, defines, &num_input_drawables);
+	if (error != NULL)
 	{
-	    userval_t *userval = &invocation->uservals[userval_info->index];
-	    define_t *define = lookup_define(defines, userval_info->name);
-
-	    if (define == NULL)
-	    {
-		if (userval_info->type == USERVAL_IMAGE)
-		{
-		    fprintf(stderr, _("Error: No value defined for input image `%s'.\n"), userval_info->name);
-		    return 1;
-		}
-	    }
-	    else
-		switch (userval_info->type)
-		{
-		    case USERVAL_INT_CONST :
-			userval->v.int_const = atoi(define->value);
-			break;
-
-		    case USERVAL_FLOAT_CONST :
-			userval->v.float_const = g_ascii_strtod(define->value, NULL);
-			break;
-
-		    case USERVAL_BOOL_CONST :
-			userval->v.bool_const = (float)atoi(define->value);
-			break;
-
-		    case USERVAL_IMAGE :
-			assign_image_userval_drawable(userval_info, userval,
-						      alloc_cmdline_image_input_drawable(define->value));
-			++num_input_drawables;
-			break;
-
-		    default :
-			fprintf(stderr, _("Error: Can only define user values for types int, float, bool and image.\n"));
-			return 1;
-		}
+	    fprintf(stderr, _("Error: %s\n"), error);
+	    return 1;
 	}
 
 	for (render_num = 0; render_num < bench_render_count; ++render_num)
@@ -811,6 +2298,52 @@ cmdline_main (int argc, char *argv[])
 
 	    invocation->output_bpp = 4;
 
+	    if (show_progress)
+		invocation_set_progress_func(invocation, print_progress, invocation);
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+	    if (write_frames)
+	    {
+		/* Frames in flight may share input images, so none of
+		   the entries in use may be evicted while the pipeline
+		   runs. */
+		++current_time;
+
+		render_frames_pipelined(invocation, img_width, img_height, num_frames, num_threads,
+					num_frame_buffers, bench_no_output ? NULL : output_filename);
+		invocation_release_native_filter_results(invocation);
+		continue;
+	    }
+#endif
+
+	    if (num_frames == 1 && !bench_no_output
+#ifdef MOVIES
+		&& !generate_movie
+#endif
+		)
+	    {
+		image_t *closure = closure_image_alloc(&invocation->mathfuncs,
+						       NULL,
+						       invocation->mathmap->main_filter->num_uservals,
+						       invocation->uservals,
+						       img_width, img_height);
+		mathmap_frame_t *frame = invocation_new_frame(invocation, closure, 0, 0.0);
+
+		++current_time;
+
+		if (!render_and_write_banded(invocation, frame, closure, img_width, img_height,
+					     num_threads, output_filename))
+		{
+		    fprintf(stderr, _("Error: Cannot write output image `%s'.\n"), output_filename);
+		    exit(1);
+		}
+
+		invocation_free_frame(frame);
+		closure_image_free(closure);
+		invocation_release_native_filter_results(invocation);
+		continue;
+	    }
+
 	    output = (guchar*)malloc((long)invocation->output_bpp * (long)img_width * (long)img_height);
 	    assert(output != 0);
 
@@ -841,9 +2374,18 @@ cmdline_main (int argc, char *argv[])
 		mathmap_frame_t *frame = invocation_new_frame(invocation, closure,
 							      current_frame, current_t);
 
-		call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, 1);
+		/* Entries used for earlier frames may be evicted from
+		   now on. */
+		++current_time;
+
+		call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, num_threads);
 
 		invocation_free_frame(frame);
+		invocation_release_native_filter_results(invocation);
+
+		if (write_frames && !bench_no_output)
+		    write_frame(output_filename, current_frame, output,
+				img_width, img_height, invocation->output_bpp);
 
 #ifdef MOVIES
 		if (generate_movie && !bench_no_output)
@@ -856,7 +2398,7 @@ cmdline_main (int argc, char *argv[])
 		closure_image_free(closure);
 	    }
 
-	    if (!bench_no_output)
+	    if (!bench_no_output && !write_frames)
 	    {
 #ifdef MOVIES
 		if (generate_movie)
@@ -869,6 +2411,23 @@ cmdline_main (int argc, char *argv[])
 
 	    free(output);
 	}
+
+	error = check_input_image_reads(invocation);
+	if (error != NULL)
+	{
+	    fprintf(stderr, _("Error: %s\n"), error);
+	    return 1;
+	}
+
+#ifdef DEBUG_OUTPUT
+	{
+	    native_filter_cache_stats_t stats;
+
+	    native_filter_cache_get_stats(&stats);
+	    g_print("native filter cache: %ld hits, %ld misses, %ld waits, %ld evictions, %lu bytes\n",
+		    stats.hits, stats.misses, stats.waits, stats.evictions, (unsigned long)stats.size);
+	}
+#endif
     }
     else
     {
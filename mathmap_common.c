@@ -33,6 +33,7 @@
 #endif
 #include <locale.h>
 #include <unistd.h>
+#include <sys/time.h>
 #ifdef __MINGW32__
 #include <windows.h>
 #endif
@@ -311,9 +312,7 @@ free_invocation (mathmap_invocation_t *invocation)
 
     free(invocation->rows_finished);
 
-    g_mutex_free(invocation->native_filter_cache_mutex);
-    g_cond_free(invocation->native_filter_cache_cond);
-    mathmap_pools_free(&invocation->pools);
+    invocation_release_native_filter_results(invocation);
 
     free(invocation);
 }
@@ -408,8 +407,27 @@ does_filter_use_t (filter_t *filter)
     return t_internal->is_used;
 }
 
-mathmap_t*
-parse_mathmap (char *expression)
+/* The scanner, the parser, the backends and the error reporting in
+   error_string and error_region keep their state in globals, so only
+   one script is parsed or compiled at a time.  A caller that reads
+   error_string after a failed compilation while other threads might
+   be compiling must hold the lock across both. */
+static GStaticRecMutex compiler_mutex = G_STATIC_REC_MUTEX_INIT;
+
+void
+lock_mathmap_compiler (void)
+{
+    g_static_rec_mutex_lock(&compiler_mutex);
+}
+
+void
+unlock_mathmap_compiler (void)
+{
+    g_static_rec_mutex_unlock(&compiler_mutex);
+}
+
+static mathmap_t*
+parse_mathmap_unlocked (char *expression)
 {
     static mathmap_t *mathmap;	/* this is static to avoid problems with longjmp.  */
     volatile gboolean need_end_scan = FALSE;
@@ -486,6 +504,18 @@ parse_mathmap (char *expression)
     return mathmap;
 }
 
+mathmap_t*
+parse_mathmap (char *expression)
+{
+    mathmap_t *mathmap;
+
+    lock_mathmap_compiler();
+    mathmap = parse_mathmap_unlocked(expression);
+    unlock_mathmap_compiler();
+
+    return mathmap;
+}
+
 int
 check_mathmap (char *expression)
 {
@@ -500,8 +530,8 @@ check_mathmap (char *expression)
 	return 0;
 }
 
-mathmap_t*
-compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend)
+static mathmap_t*
+compile_mathmap_unlocked (char *expression, char **support_paths, int timeout, gboolean no_backend)
 {
     volatile mathmap_t *mathmap = NULL;
     char *template_filename, *include_path;
@@ -533,7 +563,7 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
     DO_JUMP_CODE {
 	filter_code_t **filter_codes;
 
-	mathmap = parse_mathmap(expression);
+	mathmap = parse_mathmap_unlocked(expression);
 
 	if (mathmap == 0)
 	{
@@ -581,6 +611,18 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
     return (mathmap_t*)mathmap;
 }
 
+mathmap_t*
+compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend)
+{
+    mathmap_t *mathmap;
+
+    lock_mathmap_compiler();
+    mathmap = compile_mathmap_unlocked(expression, support_paths, timeout, no_backend);
+    unlock_mathmap_compiler();
+
+    return mathmap;
+}
+
 void
 llvm_filter_init_frame (mathmap_frame_t *mmframe, image_t *closure)
 {
@@ -646,11 +688,16 @@ llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row,
 
     for (row = first_row - slice->region_y; row < last_row - slice->region_y; ++row)
     {
-	float y = CALC_VIRTUAL_Y(row + slice->region_y, frame_render_height, sampling_offset_y);
+	float y;
 	unsigned char *p = q;
 	float *fp = q;
 	void *x_vars;
 
+	if (invocation->cancelled)
+	    break;
+
+	y = CALC_VIRTUAL_Y(row + slice->region_y, frame_render_height, sampling_offset_y);
+
 #ifdef POOLS_DEBUG_OUTPUT
 	printf("calcing x_vars for row %d\n", row);
 #endif
@@ -705,7 +752,7 @@ llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row,
 	    q = (unsigned char*)q + invocation->row_stride;
 
 	if (!invocation->supersampling)
-	    invocation->rows_finished[row] = 1;
+	    invocation->rows_finished[row + slice->region_y] = 1;
     }
 
     mathmap_pools_free(&pixel_pools);
@@ -743,6 +790,64 @@ invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialia
 	invocation->orig_val_func = get_orig_val_pixel;
 }
 
+void
+invocation_set_tile_height (mathmap_invocation_t *invocation, int tile_height)
+{
+    g_assert(tile_height > 0);
+
+    invocation->tile_height = tile_height;
+}
+
+/* func is called by the rendering threads, but never by two of them
+   at the same time. */
+void
+invocation_set_progress_func (mathmap_invocation_t *invocation, render_progress_func_t func, void *data)
+{
+    invocation->progress_func = func;
+    invocation->progress_data = data;
+}
+
+/* Makes all renders of the invocation stop at the next row or tile,
+   and native filters skip their remaining work.  The rows which were
+   not rendered and the results of the native filters are garbage, but
+   everything is freed as usual.  Renders only start working again
+   after invocation_reset_cancel().
+
+   The cancelled field of the invocation has a bit for this, and counts
+   the calls being cancelled by cancel_invocation_call() in the rest,
+   so that the two don't undo each other. */
+#define CANCEL_REQUESTED	1
+#define CANCEL_CALL		2
+
+static void
+set_cancel_requested (mathmap_invocation_t *invocation, gboolean requested)
+{
+    int old;
+
+    do
+	old = g_atomic_int_get(&invocation->cancelled);
+    while (!g_atomic_int_compare_and_exchange(&invocation->cancelled, old,
+					      requested ? (old | CANCEL_REQUESTED) : (old & ~CANCEL_REQUESTED)));
+}
+
+void
+invocation_cancel (mathmap_invocation_t *invocation)
+{
+    set_cancel_requested(invocation, TRUE);
+}
+
+void
+invocation_reset_cancel (mathmap_invocation_t *invocation)
+{
+    set_cancel_requested(invocation, FALSE);
+}
+
+gboolean
+invocation_is_cancelled (mathmap_invocation_t *invocation)
+{
+    return g_atomic_int_get(&invocation->cancelled) != 0;
+}
+
 mathmap_invocation_t*
 invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_width, int img_height,
 		gboolean copy_first_image)
@@ -760,6 +865,8 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
 
     invocation->supersampling = 0;
 
+    invocation->tile_height = DEFAULT_TILE_HEIGHT;
+
     invocation->output_bpp = 4;
 
     invocation->edge_behaviour_x = invocation->edge_behaviour_y = EDGE_BEHAVIOUR_COLOR;
@@ -786,10 +893,13 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
     if (!g_thread_supported())
 	g_thread_init (NULL);
 
-    mathmap_pools_init_global(&invocation->pools);
-    invocation->native_filter_cache_mutex = g_mutex_new();
-    invocation->native_filter_cache_cond = g_cond_new();
-    invocation->native_filter_cache = NULL;
+    invocation->native_filter_results = NULL;
+    invocation->num_native_filter_results = 0;
+    invocation->parallel_jobs = NULL;
+
+    invocation->cancelled = 0;
+    invocation->progress_func = NULL;
+    invocation->progress_data = NULL;
 
     return invocation;
 }
@@ -822,6 +932,38 @@ invocation_free_frame (mathmap_frame_t *frame)
     g_free(frame);
 }
 
+/* Computes the frame's constants again, for when a userval changed
+   which they depend on.  The frame must not be rendering. */
+void
+invocation_refresh_frame (mathmap_frame_t *frame, image_t *closure)
+{
+    mathmap_pools_free(&frame->pools);
+    mathmap_pools_init_global(&frame->pools);
+
+    closure->v.closure.funcs->init_frame(frame, closure);
+}
+
+/* Passes the new value of the userval with the given index to the
+   closure.  Returns the userval's use, which says what has to be done
+   for the change to show: nothing, rendering again, or refreshing
+   the frames before rendering.  The closure must not be rendering. */
+int
+invocation_userval_changed (mathmap_invocation_t *invocation, image_t *closure, int index)
+{
+    userval_info_t *info;
+
+    for (info = invocation->mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+	if (info->index == index)
+	    break;
+    g_assert(info != NULL);
+
+    closure->v.closure.args[index] = invocation->uservals[index];
+
+    if (info->use == USERVAL_USE_UNKNOWN)
+	return USERVAL_USE_FRAME;
+    return info->use;
+}
+
 void
 enable_debugging (mathmap_invocation_t *invocation)
 {
@@ -896,6 +1038,9 @@ call_invocation (mathmap_frame_t *frame, image_t *closure,
 	{
 	    unsigned char *p = q;
 
+	    if (invocation->cancelled)
+		break;
+
 	    calc_lines(&short_slice, closure, row, row + 1, line2);
 	    calc_lines(&long_slice, closure, row + 1, row + 2, line3);
 
@@ -936,37 +1081,161 @@ call_invocation (mathmap_frame_t *frame, image_t *closure,
 }
 
 #if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+/* Each thread owns a deque of tiles.  It takes tiles from the head of
+   its own deque and, once that is empty, steals from the tail of the
+   other threads' deques. */
+typedef struct
+{
+    GMutex *mutex;
+    int head, tail;
+} tile_deque_t;
+
+struct _invocation_call_t;
+
 typedef struct
 {
     thread_handle_t thread_handle;
+    struct _invocation_call_t *call;
+    int index;
+    tile_deque_t deque;
+} thread_data_t;
+
+typedef struct _invocation_call_t
+{
     mathmap_frame_t *frame;
     image_t *closure;
     int region_x, region_y;
-    int region_height, region_width;
+    int region_width, region_height;
     unsigned char *q;
-    gboolean is_done;
-} thread_data_t;
 
-typedef struct
-{
+    int num_tiles;
+    tile_timing_t *tiles;
+
+    double start_time;
+    volatile gint rows_done;
+    GMutex *progress_mutex;	/* serializes the progress function */
+
+    /* These are protected by finished_mutex.  finished_cond is
+       signalled whenever a tile or a thread is finished. */
+    GMutex *finished_mutex;
+    GCond *finished_cond;
+    int num_tiles_finished;
+    int num_tiles_seen;		/* by invocation_call_wait() */
+    int num_threads_done;
+
     int num_threads;
     thread_data_t datas[];
 } invocation_call_t;
 
+static double
+current_time_seconds (void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static gboolean
+take_tile (invocation_call_t *call, int thread_index, int *tile_index)
+{
+    int i;
+
+    if (invocation_is_cancelled(call->frame->invocation))
+	return FALSE;
+
+    for (i = 0; i < call->num_threads; ++i)
+    {
+	tile_deque_t *deque = &call->datas[(thread_index + i) % call->num_threads].deque;
+	gboolean found = FALSE;
+
+	g_mutex_lock(deque->mutex);
+	if (deque->head < deque->tail)
+	{
+	    if (i == 0)
+		*tile_index = deque->head++;
+	    else
+		*tile_index = --deque->tail;
+	    found = TRUE;
+	}
+	g_mutex_unlock(deque->mutex);
+
+	if (found)
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+report_progress (invocation_call_t *call, int num_rows)
+{
+    mathmap_invocation_t *invocation = call->frame->invocation;
+    render_progress_t progress;
+
+    g_atomic_int_add(&call->rows_done, num_rows);
+
+    if (invocation->progress_func == NULL)
+	return;
+
+    g_mutex_lock(call->progress_mutex);
+    invocation_call_progress((gpointer*)call, &progress);
+    invocation->progress_func(&progress, invocation->progress_data);
+    g_mutex_unlock(call->progress_mutex);
+}
+
 static void
 call_invocation_thread_func (gpointer _data)
 {
     thread_data_t *data = (thread_data_t*)_data;
+    invocation_call_t *call = data->call;
+    mathmap_invocation_t *invocation = call->frame->invocation;
+    mathmap_slice_t slice;
+    int tile_index;
+
+    /* Without supersampling one slice covers all tiles this thread
+       might render, so the y-constant values are only computed
+       once. */
+    if (!invocation->supersampling)
+	invocation_init_slice(&slice, call->closure, call->frame, call->region_x, call->region_y,
+			      call->region_width, call->region_height, 0.0, 0.0);
+
+    while (take_tile(call, data->index, &tile_index))
+    {
+	tile_timing_t *tile = &call->tiles[tile_index];
+	unsigned char *q = call->q + (tile->first_row - call->region_y) * invocation->row_stride;
+	double start_time = current_time_seconds();
 
-#ifdef USE_PTHREADS
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-#endif
+	if (invocation->supersampling)
+	    call_invocation(call->frame, call->closure, call->region_x, tile->first_row,
+			    call->region_width, tile->num_rows, q);
+	else
+	    calc_lines(&slice, call->closure, tile->first_row, tile->first_row + tile->num_rows, q);
+
+	/* A tile cut short by a cancellation is not rendered. */
+	if (invocation_is_cancelled(invocation))
+	    break;
+
+	tile->render_time = current_time_seconds() - start_time;
+	/* this marks the tile as rendered */
+	g_atomic_int_set(&tile->thread_index, data->index);
+
+	g_mutex_lock(call->finished_mutex);
+	++call->num_tiles_finished;
+	g_cond_broadcast(call->finished_cond);
+	g_mutex_unlock(call->finished_mutex);
+
+	report_progress(call, tile->num_rows);
+    }
 
-    call_invocation(data->frame, data->closure, data->region_x, data->region_y,
-		    data->region_width, data->region_height, data->q);
+    if (!invocation->supersampling)
+	invocation_deinit_slice(&slice);
 
-    data->is_done = TRUE;
+    g_mutex_lock(call->finished_mutex);
+    ++call->num_threads_done;
+    g_cond_broadcast(call->finished_cond);
+    g_mutex_unlock(call->finished_mutex);
 }
 
 gpointer
@@ -979,68 +1248,183 @@ call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
     int i;
     int first_row = region_y;
     int last_row = region_y + region_height;
+    int tile_height = invocation->tile_height;
+    int num_tiles;
 
     g_assert(first_row >= 0 && last_row <= invocation->img_height && first_row <= last_row);
 
     memset(invocation->rows_finished + first_row, 0, last_row - first_row);
 
+    if (tile_height <= 0)
+	tile_height = DEFAULT_TILE_HEIGHT;
+    num_tiles = (region_height + tile_height - 1) / tile_height;
+
+    num_threads = MAX(1, MIN(num_threads, num_tiles));
+
     call = g_malloc(sizeof(invocation_call_t) + sizeof(thread_data_t) * num_threads);
 
+    call->frame = frame;
+    call->closure = closure;
+    call->region_x = region_x;
+    call->region_y = region_y;
+    call->region_width = region_width;
+    call->region_height = region_height;
+    call->q = q;
+
+    call->num_tiles = num_tiles;
+    call->tiles = g_new0(tile_timing_t, num_tiles);
+    for (i = 0; i < num_tiles; ++i)
+    {
+	call->tiles[i].first_row = first_row + i * tile_height;
+	call->tiles[i].num_rows = MIN(tile_height, last_row - call->tiles[i].first_row);
+	call->tiles[i].thread_index = -1;
+    }
+
+    call->start_time = current_time_seconds();
+    call->rows_done = 0;
+    call->progress_mutex = g_mutex_new();
+
+    call->finished_mutex = g_mutex_new();
+    call->finished_cond = g_cond_new();
+    call->num_tiles_finished = 0;
+    call->num_tiles_seen = 0;
+    call->num_threads_done = 0;
+
     call->num_threads = num_threads;
 
+    /* All deques have to be set up before the first thread starts
+       stealing. */
     for (i = 0; i < num_threads; ++i)
     {
-	call->datas[i].frame = frame;
-	call->datas[i].closure = closure;
-	call->datas[i].region_x = region_x;
-	call->datas[i].region_width = region_width;
-	call->datas[i].region_y = first_row + (last_row - first_row) * i / num_threads;
-	call->datas[i].region_height = first_row + (last_row - first_row) * (i + 1) / num_threads - call->datas[i].region_y;
-	call->datas[i].q = q + (call->datas[i].region_y - region_y) * invocation->row_stride;
-	call->datas[i].is_done = FALSE;
+	call->datas[i].call = call;
+	call->datas[i].index = i;
+	call->datas[i].deque.mutex = g_mutex_new();
+	call->datas[i].deque.head = num_tiles * i / num_threads;
+	call->datas[i].deque.tail = num_tiles * (i + 1) / num_threads;
+    }
 
+    for (i = 0; i < num_threads; ++i)
 	call->datas[i].thread_handle = mathmap_thread_start(call_invocation_thread_func, &call->datas[i]);
-    }
 
     return call;
 }
 
-void
-join_invocation_call (gpointer *_call)
+static void
+free_invocation_call (invocation_call_t *call)
 {
-    invocation_call_t *call = (invocation_call_t*)_call;
     int i;
 
     for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_join(call->datas[i].thread_handle);
+	g_mutex_free(call->datas[i].deque.mutex);
+    g_mutex_free(call->progress_mutex);
+    g_mutex_free(call->finished_mutex);
+    g_cond_free(call->finished_cond);
 
+    g_free(call->tiles);
     g_free(call);
 }
 
-#ifdef USE_PTHREADS
 void
-kill_invocation_call (gpointer *_call)
+join_invocation_call (gpointer *_call)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
     int i;
 
     for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_kill(call->datas[i].thread_handle);
+	mathmap_thread_join(call->datas[i].thread_handle);
 
-    g_free(call);
-}
+#ifdef DEBUG_OUTPUT
+    for (i = 0; i < call->num_tiles; ++i)
+	printf("tile rows %d-%d rendered by thread %d in %f s\n",
+	       call->tiles[i].first_row, call->tiles[i].first_row + call->tiles[i].num_rows - 1,
+	       call->tiles[i].thread_index, call->tiles[i].render_time);
 #endif
 
+    free_invocation_call(call);
+}
+
+/* Stops the call at the next row and frees it.  Rows in tiles which
+   were not rendered completely are garbage.  Other renders of the same
+   invocation running at the same time are cancelled, too, but a
+   cancellation requested with invocation_cancel() stays in effect
+   afterwards. */
+void
+cancel_invocation_call (gpointer *_call)
+{
+    invocation_call_t *call = (invocation_call_t*)_call;
+    mathmap_invocation_t *invocation = call->frame->invocation;
+
+    g_atomic_int_add(&invocation->cancelled, CANCEL_CALL);
+    join_invocation_call(_call);
+    g_atomic_int_add(&invocation->cancelled, -CANCEL_CALL);
+}
+
 gboolean
 invocation_call_is_done (gpointer *_call)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
+    gboolean is_done;
 
-    for (i = 0; i < call->num_threads; ++i)
-	if (!call->datas[i].is_done)
-	    return FALSE;
-    return TRUE;
+    g_mutex_lock(call->finished_mutex);
+    is_done = call->num_threads_done == call->num_threads;
+    g_mutex_unlock(call->finished_mutex);
+
+    return is_done;
+}
+
+/* Blocks until more tiles of the call are finished than when it last
+   returned, or until the call is done.  Returns FALSE once the call is
+   done, after which it still has to be joined.  Only one thread may
+   wait for a call. */
+gboolean
+invocation_call_wait (gpointer *_call)
+{
+    invocation_call_t *call = (invocation_call_t*)_call;
+    gboolean is_done;
+
+    g_mutex_lock(call->finished_mutex);
+    while (call->num_tiles_finished == call->num_tiles_seen
+	   && call->num_threads_done < call->num_threads)
+	g_cond_wait(call->finished_cond, call->finished_mutex);
+    call->num_tiles_seen = call->num_tiles_finished;
+    is_done = call->num_threads_done == call->num_threads;
+    g_mutex_unlock(call->finished_mutex);
+
+    return !is_done;
+}
+
+/* Only valid until the call is joined or cancelled.  Tiles which have
+   not been rendered yet have a thread index of -1. */
+const tile_timing_t*
+invocation_call_tile_timings (gpointer *_call, int *num_tiles)
+{
+    invocation_call_t *call = (invocation_call_t*)_call;
+
+    *num_tiles = call->num_tiles;
+    return call->tiles;
+}
+
+void
+invocation_call_progress (gpointer *_call, render_progress_t *progress)
+{
+    invocation_call_t *call = (invocation_call_t*)_call;
+    int rows_done = g_atomic_int_get(&call->rows_done);
+    double elapsed = current_time_seconds() - call->start_time;
+
+    progress->first_row = call->region_y;
+    progress->num_rows = call->region_height;
+    progress->rows_done = rows_done;
+
+    if (rows_done > 0 && elapsed > 0.0)
+    {
+	progress->pixels_per_second = (double)rows_done * call->region_width / elapsed;
+	progress->seconds_left = elapsed * (call->region_height - rows_done) / rows_done;
+    }
+    else
+    {
+	progress->pixels_per_second = 0.0;
+	progress->seconds_left = -1.0;
+    }
 }
 
 void
@@ -1054,29 +1438,13 @@ call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
     join_invocation_call(call);
 }
 
-#ifdef USE_PTHREAD
-static void
-sigusr2_handler (int signum)
-{
-    pthread_testcancel();
-}
-#endif
-
 thread_handle_t
 mathmap_thread_start (void (*func) (gpointer), gpointer data)
 {
 #ifdef USE_PTHREAD
-    static gboolean signal_handler_set = FALSE;
-
     pthread_t thread;
     int result;
 
-    if (!signal_handler_set)
-    {
-	signal(SIGUSR2, sigusr2_handler);
-	signal_handler_set = TRUE;
-    }
-
     result = pthread_create(&thread, NULL, (gpointer (*) (gpointer))func, data);
     g_assert(result == 0);
 #else
@@ -1101,16 +1469,6 @@ mathmap_thread_join (thread_handle_t thread)
     g_thread_join(thread);
 #endif
 }
-
-#ifdef USE_PTHREAD
-void
-mathmap_thread_kill (thread_handle_t thread)
-{
-    pthread_cancel(thread);
-    pthread_kill(thread, SIGUSR2);
-    pthread_join(thread, NULL);
-}
-#endif
 #else
 void
 call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
@@ -1138,8 +1496,14 @@ carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathmap_inv
 	    continue;
 	}
 
-	if (template_info != 0)
-	    copy_userval(&invocation->uservals[info->index], &template->uservals[template_info->index], info->type);
+	if (template_info == 0)
+	    continue;
+
+	/* the template might not have an image */
+	if (info->type == USERVAL_IMAGE && template->uservals[template_info->index].v.image == NULL)
+	    continue;
+
+	copy_userval(&invocation->uservals[info->index], &template->uservals[template_info->index], info->type);
     }
 }
 
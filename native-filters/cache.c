@@ -24,6 +24,32 @@
 
 #include "../mathmap.h"
 
+/* The native filter cache is global, so results can be reused by later
+   frames and by other invocations.  Entries are keyed on the filter
+   function, the filter's arguments (images by their id) and the
+   invocation settings that influence how input images are sampled.
+   They are hashed into chains in a hash table.
+
+   Each result lives in its entry's pools.  An invocation that has
+   looked up an entry holds on to it until it releases its results, and
+   only entries which are not held by anybody are evicted, in LRU
+   order, once the results take up more than the budget.
+
+   A result computed by a cancelled render is garbage, so its entry is
+   abandoned: it is taken out of the cache and freed once nobody holds
+   it anymore.  Renders of other invocations waiting for it look it up
+   again. */
+
+#define DEFAULT_NATIVE_FILTER_CACHE_BUDGET	(256 * 1024 * 1024)
+
+static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
+static GCond *cache_cond = NULL;
+static GHashTable *cache_table = NULL;
+static size_t cache_budget = DEFAULT_NATIVE_FILTER_CACHE_BUDGET;
+static size_t cache_size = 0;
+static long cache_clock = 0;
+static native_filter_cache_stats_t cache_stats;
+
 static filter_t*
 get_native_filter_for_func (mathmap_t *mathmap, native_filter_func_t func)
 {
@@ -36,34 +62,43 @@ get_native_filter_for_func (mathmap_t *mathmap, native_filter_func_t func)
 }
 
 static gboolean
-uservals_match (filter_t *filter, userval_t *entry_args, userval_t *filter_args)
+entry_matches (native_filter_cache_entry_t *entry, native_filter_func_t func, mathmap_invocation_t *invocation,
+	       filter_t *filter, userval_t *args)
 {
     int i;
-    userval_info_t *info;
 
-    for (i = 0, info = filter->userval_infos;
-	 i < filter->num_uservals;
-	 ++i, info = info->next)
+    if (entry->func != func
+	|| entry->render_width != invocation->render_width || entry->render_height != invocation->render_height
+	|| entry->orig_val_func != invocation->orig_val_func
+	|| entry->edge_behaviour_x != invocation->edge_behaviour_x
+	|| entry->edge_behaviour_y != invocation->edge_behaviour_y
+	|| entry->edge_color_x != invocation->edge_color_x
+	|| entry->edge_color_y != invocation->edge_color_y)
+	return FALSE;
+
+    g_assert(entry->num_args == filter->num_uservals);
+
+    for (i = 0; i < entry->num_args; ++i)
     {
-	switch (info->type)
+	switch (entry->arg_types[i])
 	{
 	    case USERVAL_INT_CONST :
-		if (entry_args[i].v.int_const != filter_args[i].v.int_const)
+		if (entry->args[i].v.int_const != args[i].v.int_const)
 		    return FALSE;
 		break;
 
 	    case USERVAL_FLOAT_CONST :
-		if (entry_args[i].v.float_const != filter_args[i].v.float_const)
+		if (entry->args[i].v.float_const != args[i].v.float_const)
 		    return FALSE;
 		break;
 
 	    case USERVAL_BOOL_CONST :
-		if (entry_args[i].v.bool_const != filter_args[i].v.bool_const)
+		if (entry->args[i].v.bool_const != args[i].v.bool_const)
 		    return FALSE;
 		break;
 
 	    case USERVAL_IMAGE :
-		if (GPOINTER_TO_INT(entry_args[i].v.image) != filter_args[i].v.image->id)
+		if (GPOINTER_TO_INT(entry->args[i].v.image) != args[i].v.image->id)
 		    return FALSE;
 		break;
 
@@ -71,32 +106,96 @@ uservals_match (filter_t *filter, userval_t *entry_args, userval_t *filter_args)
 		g_assert_not_reached();
 	}
     }
-    g_assert(info == NULL);
 
     return TRUE;
 }
 
-static userval_t*
-uservals_copy (filter_t *filter, userval_t *args, mathmap_pools_t *pools)
+#define HASH_COMBINE(h,x)	((h) * 31 + (guint)(x))
+
+static guint
+hash_args (native_filter_func_t func, mathmap_invocation_t *invocation, filter_t *filter, userval_t *args)
 {
+    guint hash = GPOINTER_TO_UINT(func);
+    userval_info_t *info;
     int i;
+
+    hash = HASH_COMBINE(hash, invocation->render_width);
+    hash = HASH_COMBINE(hash, invocation->render_height);
+
+    for (i = 0, info = filter->userval_infos;
+	 i < filter->num_uservals;
+	 ++i, info = info->next)
+    {
+	switch (info->type)
+	{
+	    case USERVAL_INT_CONST :
+		hash = HASH_COMBINE(hash, args[i].v.int_const);
+		break;
+
+	    case USERVAL_FLOAT_CONST :
+		{
+		    union { float f; guint32 i; } u;
+
+		    u.f = args[i].v.float_const;
+		    hash = HASH_COMBINE(hash, u.i);
+		}
+		break;
+
+	    case USERVAL_BOOL_CONST :
+		hash = HASH_COMBINE(hash, args[i].v.bool_const);
+		break;
+
+	    case USERVAL_IMAGE :
+		hash = HASH_COMBINE(hash, args[i].v.image->id);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+    g_assert(info == NULL);
+
+    return hash;
+}
+
+static native_filter_cache_entry_t*
+make_entry (native_filter_func_t func, mathmap_invocation_t *invocation, filter_t *filter, userval_t *args,
+	    guint hash)
+{
+    native_filter_cache_entry_t *entry = g_new0(native_filter_cache_entry_t, 1);
     userval_info_t *info;
-    userval_t *copy = mathmap_pools_alloc(pools, sizeof(userval_t) * filter->num_uservals);
+    int i;
+
+    entry->func = func;
+    entry->hash = hash;
+    entry->render_width = invocation->render_width;
+    entry->render_height = invocation->render_height;
+    entry->orig_val_func = invocation->orig_val_func;
+    entry->edge_behaviour_x = invocation->edge_behaviour_x;
+    entry->edge_behaviour_y = invocation->edge_behaviour_y;
+    entry->edge_color_x = invocation->edge_color_x;
+    entry->edge_color_y = invocation->edge_color_y;
+
+    entry->num_args = filter->num_uservals;
+    entry->arg_types = g_new(int, entry->num_args);
+    entry->args = g_new0(userval_t, entry->num_args);
 
     for (i = 0, info = filter->userval_infos;
 	 i < filter->num_uservals;
 	 ++i, info = info->next)
     {
+	entry->arg_types[i] = info->type;
+
 	switch (info->type)
 	{
 	    case USERVAL_INT_CONST :
 	    case USERVAL_FLOAT_CONST :
 	    case USERVAL_BOOL_CONST :
-		copy_userval(&copy[i], &args[i], info->type);
+		copy_userval(&entry->args[i], &args[i], info->type);
 		break;
 
 	    case USERVAL_IMAGE :
-		copy[i].v.image = GINT_TO_POINTER(args[i].v.image->id);
+		entry->args[i].v.image = GINT_TO_POINTER(args[i].v.image->id);
 		break;
 
 	    default :
@@ -104,7 +203,202 @@ uservals_copy (filter_t *filter, userval_t *args, mathmap_pools_t *pools)
 	}
     }
 
-    return copy;
+    mathmap_pools_init_global(&entry->pools);
+
+    return entry;
+}
+
+static void
+free_entry (native_filter_cache_entry_t *entry)
+{
+    mathmap_pools_free(&entry->pools);
+    g_free(entry->arg_types);
+    g_free(entry->args);
+    g_free(entry);
+}
+
+static void
+unlink_entry (native_filter_cache_entry_t *entry)
+{
+    native_filter_cache_entry_t *first = g_hash_table_lookup(cache_table, GUINT_TO_POINTER(entry->hash));
+    native_filter_cache_entry_t **p;
+
+    if (first == entry)
+    {
+	if (entry->next != NULL)
+	    g_hash_table_insert(cache_table, GUINT_TO_POINTER(entry->hash), entry->next);
+	else
+	    g_hash_table_remove(cache_table, GUINT_TO_POINTER(entry->hash));
+	return;
+    }
+
+    for (p = &first->next; *p != entry; p = &(*p)->next)
+	g_assert(*p != NULL);
+    *p = entry->next;
+}
+
+static void
+find_lru_entry (gpointer key, gpointer value, gpointer user_data)
+{
+    native_filter_cache_entry_t **lru = (native_filter_cache_entry_t**)user_data;
+    native_filter_cache_entry_t *entry;
+
+    for (entry = (native_filter_cache_entry_t*)value; entry != NULL; entry = entry->next)
+	if (entry->image != NULL && entry->num_users == 0
+	    && (*lru == NULL || entry->last_use < (*lru)->last_use))
+	    *lru = entry;
+}
+
+/* Must be called with the cache mutex held. */
+static void
+evict_entries (void)
+{
+    while (cache_size > cache_budget)
+    {
+	native_filter_cache_entry_t *lru = NULL;
+
+	g_hash_table_foreach(cache_table, find_lru_entry, &lru);
+	if (lru == NULL)
+	    break;
+
+	unlink_entry(lru);
+	cache_size -= lru->size;
+	++cache_stats.evictions;
+
+	free_entry(lru);
+    }
+}
+
+/* Must be called with the cache mutex held. */
+static void
+hold_entry (mathmap_invocation_t *invocation, native_filter_cache_entry_t *entry)
+{
+    int i;
+
+    entry->last_use = ++cache_clock;
+
+    for (i = 0; i < invocation->num_native_filter_results; ++i)
+	if (invocation->native_filter_results[i] == entry)
+	    return;
+
+    invocation->native_filter_results = g_renew(native_filter_cache_entry_t*, invocation->native_filter_results,
+						invocation->num_native_filter_results + 1);
+    invocation->native_filter_results[invocation->num_native_filter_results++] = entry;
+    ++entry->num_users;
+}
+
+static void
+lock_cache (void)
+{
+    g_static_mutex_lock(&cache_mutex);
+
+    if (cache_table == NULL)
+    {
+	cache_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	cache_cond = g_cond_new();
+    }
+}
+
+static void
+unlock_cache (void)
+{
+    g_static_mutex_unlock(&cache_mutex);
+}
+
+static void
+wait_cache (void)
+{
+    g_cond_wait(cache_cond, g_static_mutex_get_mutex(&cache_mutex));
+}
+
+/* Must be called with the cache mutex held, which is released while
+   the tile is rendered.  Returns FALSE if there was
+   nothing to do. */
+static gboolean
+help_with_parallel_job (mathmap_invocation_t *invocation)
+{
+    parallel_job_t *job;
+    int tile;
+
+    for (job = invocation->parallel_jobs; job != NULL; job = job->next)
+	if (job->next_tile < job->num_tiles)
+	    break;
+
+    if (job == NULL)
+	return FALSE;
+
+    tile = job->next_tile++;
+
+    unlock_cache();
+    if (!invocation_is_cancelled(invocation))
+	job->func(job, tile);
+    lock_cache();
+
+    if (++job->num_tiles_done == job->num_tiles)
+	g_cond_broadcast(cache_cond);
+
+    return TRUE;
+}
+
+void
+invocation_run_parallel_job (mathmap_invocation_t *invocation, parallel_job_t *job)
+{
+    parallel_job_t **p;
+
+    job->next_tile = 0;
+    job->num_tiles_done = 0;
+
+    lock_cache();
+
+    job->next = invocation->parallel_jobs;
+    invocation->parallel_jobs = job;
+    g_cond_broadcast(cache_cond);
+
+    while (job->next_tile < job->num_tiles)
+    {
+	int tile = job->next_tile++;
+
+	unlock_cache();
+	/* Cancelled tiles still count as done, so nobody waits for
+	   them. */
+	if (!invocation_is_cancelled(invocation))
+	    job->func(job, tile);
+	lock_cache();
+
+	++job->num_tiles_done;
+    }
+
+    /* Our remaining tiles are being rendered by other threads, which
+       might be waiting for jobs of their own. */
+    while (job->num_tiles_done < job->num_tiles)
+	if (!help_with_parallel_job(invocation))
+	    wait_cache();
+
+    for (p = &invocation->parallel_jobs; *p != job; p = &(*p)->next)
+	g_assert(*p != NULL);
+    *p = job->next;
+
+    unlock_cache();
+}
+
+/* Must be called with the cache mutex held. */
+static void
+unhold_abandoned_entry (mathmap_invocation_t *invocation, native_filter_cache_entry_t *entry)
+{
+    int i;
+
+    g_assert(entry->is_abandoned);
+
+    for (i = 0; i < invocation->num_native_filter_results; ++i)
+	if (invocation->native_filter_results[i] == entry)
+	    break;
+    g_assert(i < invocation->num_native_filter_results);
+
+    invocation->native_filter_results[i]
+	= invocation->native_filter_results[--invocation->num_native_filter_results];
+
+    if (--entry->num_users == 0)
+	free_entry(entry);
 }
 
 native_filter_cache_entry_t*
@@ -112,35 +406,48 @@ invocation_lookup_native_filter_invocation (mathmap_invocation_t *invocation, us
 					    native_filter_func_t filter_func)
 {
     filter_t *filter = get_native_filter_for_func(invocation->mathmap, filter_func);
+    guint hash = hash_args(filter_func, invocation, filter, args);
     native_filter_cache_entry_t *entry;
 
-    g_mutex_lock(invocation->native_filter_cache_mutex);
-
-    for (entry = invocation->native_filter_cache; entry != NULL; entry = entry->next)
-    {
-	if (entry->filter != filter)
-	    continue;
+    lock_cache();
 
-	if (uservals_match(filter, entry->args, args))
+ retry:
+    for (entry = g_hash_table_lookup(cache_table, GUINT_TO_POINTER(hash)); entry != NULL; entry = entry->next)
+	if (entry->hash == hash && entry_matches(entry, filter_func, invocation, filter, args))
 	    break;
-    }
 
     if (entry)
     {
+	hold_entry(invocation, entry);
+
+	if (entry->image == NULL)
+	    ++cache_stats.waits;
+	else
+	    ++cache_stats.hits;
+
 	while (entry->image == NULL)
-	    g_cond_wait(invocation->native_filter_cache_cond, invocation->native_filter_cache_mutex);
+	    if (!help_with_parallel_job(invocation))
+		wait_cache();
+
+	/* A cancelled render may as well use the garbage. */
+	if (entry->is_abandoned && !invocation_is_cancelled(invocation))
+	{
+	    unhold_abandoned_entry(invocation, entry);
+	    goto retry;
+	}
     }
     else
     {
-	entry = mathmap_pools_alloc(&invocation->pools, sizeof(native_filter_cache_entry_t));
-	entry->filter = filter;
-	entry->args = uservals_copy(filter, args, &invocation->pools);
-	entry->image = NULL;
-	entry->next = invocation->native_filter_cache;
-	invocation->native_filter_cache = entry;
+	entry = make_entry(filter_func, invocation, filter, args, hash);
+	entry->next = g_hash_table_lookup(cache_table, GUINT_TO_POINTER(hash));
+	g_hash_table_insert(cache_table, GUINT_TO_POINTER(hash), entry);
+
+	hold_entry(invocation, entry);
+
+	++cache_stats.misses;
     }
 
-    g_mutex_unlock(invocation->native_filter_cache_mutex);
+    unlock_cache();
 
     return entry;
 }
@@ -148,9 +455,72 @@ invocation_lookup_native_filter_invocation (mathmap_invocation_t *invocation, us
 void
 native_filter_cache_entry_set_image (mathmap_invocation_t *invocation, native_filter_cache_entry_t *cache_entry, image_t *image)
 {
-    g_mutex_lock(invocation->native_filter_cache_mutex);
+    lock_cache();
+
     g_assert(cache_entry->image == NULL);
     cache_entry->image = image;
-    g_cond_broadcast(invocation->native_filter_cache_cond);
-    g_mutex_unlock(invocation->native_filter_cache_mutex);
+
+    if (invocation_is_cancelled(invocation))
+    {
+	unlink_entry(cache_entry);
+	cache_entry->is_abandoned = TRUE;
+    }
+    else
+    {
+	if (image->type == IMAGE_FLOATMAP)
+	    cache_entry->size = (size_t)image->pixel_width * image->pixel_height * NUM_FLOATMAP_CHANNELS * sizeof(float);
+	cache_size += cache_entry->size;
+    }
+
+    g_cond_broadcast(cache_cond);
+
+    evict_entries();
+
+    unlock_cache();
+}
+
+void
+invocation_release_native_filter_results (mathmap_invocation_t *invocation)
+{
+    int i;
+
+    if (invocation->num_native_filter_results == 0)
+	return;
+
+    lock_cache();
+
+    for (i = 0; i < invocation->num_native_filter_results; ++i)
+    {
+	native_filter_cache_entry_t *entry = invocation->native_filter_results[i];
+
+	g_assert(entry->num_users > 0);
+	if (--entry->num_users == 0 && entry->is_abandoned)
+	    free_entry(entry);
+    }
+
+    g_free(invocation->native_filter_results);
+    invocation->native_filter_results = NULL;
+    invocation->num_native_filter_results = 0;
+
+    evict_entries();
+
+    unlock_cache();
+}
+
+void
+native_filter_cache_set_budget (size_t budget)
+{
+    lock_cache();
+    cache_budget = budget;
+    evict_entries();
+    unlock_cache();
+}
+
+void
+native_filter_cache_get_stats (native_filter_cache_stats_t *stats)
+{
+    lock_cache();
+    *stats = cache_stats;
+    stats->size = cache_size;
+    unlock_cache();
 }
@@ -25,43 +25,166 @@
 #include <complex.h>
 #include <fftw3.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "../drawable.h"
 #include "../mmpools.h"
 
 #include "native-filters.h"
 
+/* Plans are expensive to make, so we keep them around for every image
+   size we've seen.  We only ever execute them with the new-array
+   interface on arrays from fftw_malloc(), which have the alignment
+   the plans were made for.  All channels of a floatmap are
+   transformed at once, so the plans stride over the interleaved
+   channels.
+
+   If MATHMAP_FFTW_WISDOM names a file, plans are measured instead of
+   estimated and the accumulated wisdom is kept in that file.  The
+   planner is not thread safe, so plan_mutex guards all of this. */
+#define FFTW_WISDOM_ENV		"MATHMAP_FFTW_WISDOM"
+
+typedef struct _fft_plan_t
+{
+    int width, height;
+    int num_channels;
+    gboolean inverse;
+    fftw_plan plan;
+    struct _fft_plan_t *next;
+} fft_plan_t;
+
+static GStaticMutex plan_mutex = G_STATIC_MUTEX_INIT;
+static fft_plan_t *plans = NULL;
+static gboolean planner_initialized = FALSE;
+static const char *wisdom_filename = NULL;
+
 static void
-copy (double *dest, float *src, int n)
+init_planner (void)
+{
+#ifdef HAVE_FFTW_THREADS
+    if (fftw_init_threads())
+	fftw_plan_with_nthreads(get_num_cpus());
+#endif
+
+    wisdom_filename = getenv(FFTW_WISDOM_ENV);
+    if (wisdom_filename != NULL && wisdom_filename[0] == '\0')
+	wisdom_filename = NULL;
+    if (wisdom_filename != NULL)
+	fftw_import_wisdom_from_filename(wisdom_filename);
+
+    planner_initialized = TRUE;
+}
+
+static fftw_plan
+get_fft_plan (int width, int height, int num_channels, gboolean inverse)
+{
+    fft_plan_t *p;
+
+    g_static_mutex_lock(&plan_mutex);
+
+    for (p = plans; p != NULL; p = p->next)
+	if (p->width == width && p->height == height
+	    && p->num_channels == num_channels && p->inverse == inverse)
+	    break;
+
+    if (p == NULL)
+    {
+	int dims[2] = { height, width };
+	int n = width * height;
+	int cn = height * (width / 2 + 1);
+	/* Measuring overwrites the arrays, so we plan on scratch ones. */
+	double *real = fftw_malloc(sizeof(double) * n * NUM_FLOATMAP_CHANNELS);
+	fftw_complex *cplx = fftw_malloc(sizeof(fftw_complex) * cn * NUM_FLOATMAP_CHANNELS);
+	unsigned flags;
+
+	if (!planner_initialized)
+	    init_planner();
+
+	flags = wisdom_filename != NULL ? FFTW_MEASURE : FFTW_ESTIMATE;
+
+	p = g_new(fft_plan_t, 1);
+	p->width = width;
+	p->height = height;
+	p->num_channels = num_channels;
+	p->inverse = inverse;
+
+	if (inverse)
+	    p->plan = fftw_plan_many_dft_c2r(2, dims, num_channels,
+					     cplx, NULL, NUM_FLOATMAP_CHANNELS, 1,
+					     real, NULL, NUM_FLOATMAP_CHANNELS, 1,
+					     flags);
+	else
+	    p->plan = fftw_plan_many_dft_r2c(2, dims, num_channels,
+					     real, NULL, NUM_FLOATMAP_CHANNELS, 1,
+					     cplx, NULL, NUM_FLOATMAP_CHANNELS, 1,
+					     flags);
+	g_assert(p->plan != NULL);
+
+	p->next = plans;
+	plans = p;
+
+	fftw_free(real);
+	fftw_free(cplx);
+
+	if (wisdom_filename != NULL)
+	    fftw_export_wisdom_to_filename(wisdom_filename);
+    }
+
+    g_static_mutex_unlock(&plan_mutex);
+
+    return p->plan;
+}
+
+static void
+copy_floatmap_data (double *dest, float *src, int n)
 {
     int i;
 
-    for (i = 0; i < n; ++i)
-	dest[i] = src[i * NUM_FLOATMAP_CHANNELS];
+    for (i = 0; i < n * NUM_FLOATMAP_CHANNELS; ++i)
+	dest[i] = src[i];
 }
 
-static double
-copy_and_add (double *dest, float *src, int n)
+static void
+copy_and_add (double *dest, float *src, int n, double *sums)
 {
-    int half;
+    int half, c;
 
     if (n <= 0)
-	return 0.0;
+    {
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    sums[c] = 0.0;
+	return;
+    }
     if (n == 1)
-	return dest[0] = src[0];
+    {
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    sums[c] = dest[c] = src[c];
+	return;
+    }
     if (n == 2)
     {
-	double d1, d2;
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	{
+	    double d1, d2;
 
-	d1 = dest[0] = src[0];
-	d2 = dest[1] = src[NUM_FLOATMAP_CHANNELS];
+	    d1 = dest[c] = src[c];
+	    d2 = dest[NUM_FLOATMAP_CHANNELS + c] = src[NUM_FLOATMAP_CHANNELS + c];
 
-	return d1 + d2;
+	    sums[c] = d1 + d2;
+	}
+	return;
     }
 
-    half = n / 2;
-    return copy_and_add(dest, src, half)
-	+ copy_and_add(dest + half, src + half * NUM_FLOATMAP_CHANNELS, n - half);
+    {
+	double sums1[NUM_FLOATMAP_CHANNELS], sums2[NUM_FLOATMAP_CHANNELS];
+
+	half = n / 2;
+	copy_and_add(dest, src, half, sums1);
+	copy_and_add(dest + half * NUM_FLOATMAP_CHANNELS, src + half * NUM_FLOATMAP_CHANNELS, n - half, sums2);
+
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    sums[c] = sums1[c] + sums2[c];
+    }
 }
 
 CALLBACK_SYMBOL
@@ -76,7 +199,7 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
     image_t *out_image;
     double *fftw_in;
     fftw_complex *image_out, *filter_out;
-    fftw_plan in_plan, filter_plan, inverse_plan;
+    fftw_plan forward_plan, inverse_plan;
     int i, n, nhalf, cn, channel, num_channels;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_convolve);
@@ -92,67 +215,69 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
 	filter_image = render_image(invocation, filter_image,
 				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &cache_entry->pools);
+
+    /* The result of a cancelled render is garbage anyway. */
+    if (invocation_is_cancelled(invocation))
+    {
+	native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
+	return out_image;
+    }
 
     n = in_image->pixel_height * in_image->pixel_width;
     nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
     cn = in_image->pixel_height * (in_image->pixel_width / 2 + 1);
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
-    filter_out = fftw_malloc(sizeof(fftw_complex) * cn);
-
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
-    filter_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-					fftw_in, filter_out,
-					FFTW_ESTIMATE);
-    inverse_plan = fftw_plan_dft_c2r_2d(in_image->pixel_height, in_image->pixel_width,
-					 image_out, fftw_in,
-					 FFTW_ESTIMATE);
-
     if (copy_alpha)
 	num_channels = 3;
     else
 	num_channels = 4;
-    for (channel = 0; channel < num_channels; ++channel)
+
+    fftw_in = fftw_malloc(sizeof(double) * n * NUM_FLOATMAP_CHANNELS);
+    image_out = fftw_malloc(sizeof(fftw_complex) * cn * NUM_FLOATMAP_CHANNELS);
+    filter_out = fftw_malloc(sizeof(fftw_complex) * cn * NUM_FLOATMAP_CHANNELS);
+
+    forward_plan = get_fft_plan(in_image->pixel_width, in_image->pixel_height, num_channels, FALSE);
+    inverse_plan = get_fft_plan(in_image->pixel_width, in_image->pixel_height, num_channels, TRUE);
+
+    // FFT of input image
+    copy_floatmap_data(fftw_in, in_image->v.floatmap.data, n);
+    fftw_execute_dft_r2c(forward_plan, fftw_in, image_out);
+
+    // FFT of kernel image
+    if (normalize)
     {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
+	double d1[NUM_FLOATMAP_CHANNELS], d2[NUM_FLOATMAP_CHANNELS];
+	double factors[NUM_FLOATMAP_CHANNELS];
 
-	// FFT of kernel image
-	if (normalize)
-	{
-	    double d1 = copy_and_add(fftw_in,
-				     filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS,
-				     nhalf);
-	    double d2 = copy_and_add(fftw_in + nhalf,
-				     filter_image->v.floatmap.data + channel,
-				     n - nhalf);
-	    double factor = 1.0 / (d1 + d2);
-
-	    for (i = 0; i < n; ++i)
-		fftw_in[i] *= factor;
-	}
-	else
-	{
-	    copy(fftw_in, filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS, nhalf);
-	    copy(fftw_in + nhalf, filter_image->v.floatmap.data + channel, n - nhalf);
-	}
-	fftw_execute(filter_plan);
+	copy_and_add(fftw_in, filter_image->v.floatmap.data + (n - nhalf) * NUM_FLOATMAP_CHANNELS, nhalf, d1);
+	copy_and_add(fftw_in + nhalf * NUM_FLOATMAP_CHANNELS, filter_image->v.floatmap.data, n - nhalf, d2);
 
-	// multiply in frequency domain
-	for (i = 0; i < cn; ++i)
-	    image_out[i] *= filter_out[i];
+	for (channel = 0; channel < NUM_FLOATMAP_CHANNELS; ++channel)
+	    factors[channel] = 1.0 / (d1[channel] + d2[channel]);
 
-	// reverse FFT
-	fftw_execute(inverse_plan);
 	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
+	    for (channel = 0; channel < num_channels; ++channel)
+		fftw_in[i * NUM_FLOATMAP_CHANNELS + channel] *= factors[channel];
+    }
+    else
+    {
+	copy_floatmap_data(fftw_in, filter_image->v.floatmap.data + (n - nhalf) * NUM_FLOATMAP_CHANNELS, nhalf);
+	copy_floatmap_data(fftw_in + nhalf * NUM_FLOATMAP_CHANNELS, filter_image->v.floatmap.data, n - nhalf);
     }
+    fftw_execute_dft_r2c(forward_plan, fftw_in, filter_out);
+
+    // multiply in frequency domain
+    for (i = 0; i < cn; ++i)
+	for (channel = 0; channel < num_channels; ++channel)
+	    image_out[i * NUM_FLOATMAP_CHANNELS + channel] *= filter_out[i * NUM_FLOATMAP_CHANNELS + channel];
+
+    // reverse FFT
+    fftw_execute_dft_c2r(inverse_plan, image_out, fftw_in);
+    for (i = 0; i < n; ++i)
+	for (channel = 0; channel < num_channels; ++channel)
+	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel]
+		= fftw_in[i * NUM_FLOATMAP_CHANNELS + channel] / n;
 
     // copy alpha channel
     if (copy_alpha)
@@ -160,10 +285,6 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
 	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
 		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
 
-    fftw_destroy_plan(in_plan);
-    fftw_destroy_plan(filter_plan);
-    fftw_destroy_plan(inverse_plan);
-
     fftw_free(fftw_in);
     fftw_free(image_out);
     fftw_free(filter_out);
@@ -184,8 +305,9 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
     image_t *out_image;
     double *fftw_in;
     fftw_complex *image_out;
-    fftw_plan in_plan, inverse_plan;
+    fftw_plan forward_plan, inverse_plan;
     int i, n, nhalf, cn, cw, channel, num_channels;
+    int x, y;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_half_convolve);
     if (cache_entry->image != NULL)
@@ -200,54 +322,59 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
 	filter_image = render_image(invocation, filter_image,
 				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &cache_entry->pools);
+
+    if (invocation_is_cancelled(invocation))
+    {
+	native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
+	return out_image;
+    }
 
     n = in_image->pixel_height * in_image->pixel_width;
     nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
     cw = in_image->pixel_width / 2 + 1;
     cn = in_image->pixel_height * cw;
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
-
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
-    inverse_plan = fftw_plan_dft_c2r_2d(in_image->pixel_height, in_image->pixel_width,
-					 image_out, fftw_in,
-					 FFTW_ESTIMATE);
-
     if (copy_alpha)
 	num_channels = 3;
     else
 	num_channels = 4;
-    for (channel = 0; channel < num_channels; ++channel)
-    {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
 
-	// multiply in frequency domain
-	int x, y;
+    fftw_in = fftw_malloc(sizeof(double) * n * NUM_FLOATMAP_CHANNELS);
+    image_out = fftw_malloc(sizeof(fftw_complex) * cn * NUM_FLOATMAP_CHANNELS);
 
-	for (y = 0; y < in_image->pixel_height; ++y)
-	    for (x = 0; x < cw; ++x)
-	    {
-		int out_idx = x + y * in_image->pixel_width;
-		int in_idx = out_idx + nhalf;
+    forward_plan = get_fft_plan(in_image->pixel_width, in_image->pixel_height, num_channels, FALSE);
+    inverse_plan = get_fft_plan(in_image->pixel_width, in_image->pixel_height, num_channels, TRUE);
 
-		if (in_idx >= n)
-		    in_idx -= n;
+    // FFT of input image
+    copy_floatmap_data(fftw_in, in_image->v.floatmap.data, n);
+    fftw_execute_dft_r2c(forward_plan, fftw_in, image_out);
 
-		image_out[x + y * cw] *= filter_image->v.floatmap.data[in_idx * NUM_FLOATMAP_CHANNELS + channel];
-	    }
+    // multiply in frequency domain
+    for (y = 0; y < in_image->pixel_height; ++y)
+	for (x = 0; x < cw; ++x)
+	{
+	    int out_idx = x + y * in_image->pixel_width;
+	    int in_idx = out_idx + nhalf;
+	    fftw_complex *c;
+	    float *f;
 
-	// reverse FFT
-	fftw_execute(inverse_plan);
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
-    }
+	    if (in_idx >= n)
+		in_idx -= n;
+
+	    c = image_out + (x + y * cw) * NUM_FLOATMAP_CHANNELS;
+	    f = filter_image->v.floatmap.data + in_idx * NUM_FLOATMAP_CHANNELS;
+
+	    for (channel = 0; channel < num_channels; ++channel)
+		c[channel] *= f[channel];
+	}
+
+    // reverse FFT
+    fftw_execute_dft_c2r(inverse_plan, image_out, fftw_in);
+    for (i = 0; i < n; ++i)
+	for (channel = 0; channel < num_channels; ++channel)
+	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel]
+		= fftw_in[i * NUM_FLOATMAP_CHANNELS + channel] / n;
 
     // copy alpha channel
     if (copy_alpha)
@@ -255,9 +382,6 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
 	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
 		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
 
-    fftw_destroy_plan(in_plan);
-    fftw_destroy_plan(inverse_plan);
-
     fftw_free(fftw_in);
     fftw_free(image_out);
 
@@ -276,8 +400,9 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
     image_t *out_image;
     double *fftw_in;
     fftw_complex *image_out;
-    fftw_plan in_plan;
+    fftw_plan forward_plan;
     int i, n, cn, cw, channel, num_channels;
+    int x, y;
     double sqrtn;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_visualize_fft);
@@ -288,54 +413,56 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 	in_image = render_image(invocation, in_image,
 				invocation->render_width, invocation->render_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &cache_entry->pools);
+
+    if (invocation_is_cancelled(invocation))
+    {
+	native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
+	return out_image;
+    }
 
     n = in_image->pixel_height * in_image->pixel_width;
     sqrtn = sqrt(n);
     cw = in_image->pixel_width / 2 + 1;
     cn = in_image->pixel_height * cw;
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
+    if (ignore_alpha)
+	num_channels = 3;
+    else
+	num_channels = 4;
+
+    fftw_in = fftw_malloc(sizeof(double) * n * NUM_FLOATMAP_CHANNELS);
+    image_out = fftw_malloc(sizeof(fftw_complex) * cn * NUM_FLOATMAP_CHANNELS);
 
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
+    forward_plan = get_fft_plan(in_image->pixel_width, in_image->pixel_height, num_channels, FALSE);
 
     memset(out_image->v.floatmap.data, 0,
 	   sizeof(float) * in_image->pixel_width * in_image->pixel_height * NUM_FLOATMAP_CHANNELS);
 
-    if (ignore_alpha)
-	num_channels = 3;
-    else
-	num_channels = 4;
-    for (channel = 0; channel < num_channels; ++channel)
+    // FFT of input image
+    copy_floatmap_data(fftw_in, in_image->v.floatmap.data, n);
+    fftw_execute_dft_r2c(forward_plan, fftw_in, image_out);
+
+    for (y = 0; y < in_image->pixel_height; ++y)
     {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
+	int out_y = y + in_image->pixel_height / 2;
 
-	// multiply in frequency domain
-	int x, y;
+	if (out_y >= in_image->pixel_height)
+	    out_y -= in_image->pixel_height;
 
-	for (y = 0; y < in_image->pixel_height; ++y)
+	for (x = 0; x < cw; ++x)
 	{
-	    int out_y = y + in_image->pixel_height / 2;
-
-	    if (out_y >= in_image->pixel_height)
-		out_y -= in_image->pixel_height;
+	    int out_x1 = cw - 1 - x;
+	    int out_x2 = x + in_image->pixel_width - cw;
+	    float *p1 = out_image->v.floatmap.data + (out_x1 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS;
+	    float *p2 = out_image->v.floatmap.data + (out_x2 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS;
 
-	    for (x = 0; x < cw; ++x)
+	    for (channel = 0; channel < num_channels; ++channel)
 	    {
-		int out_x1 = cw - 1 - x;
-		int out_x2 = x + in_image->pixel_width - cw;
-		double val = cabs(image_out[x + y * cw]) / sqrtn;
-
-		out_image->v.floatmap.data[(out_x1 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS + channel]
-		    = val;
-		out_image->v.floatmap.data[(out_x2 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS + channel]
-		    = val;
+		double val = cabs(image_out[(x + y * cw) * NUM_FLOATMAP_CHANNELS + channel]) / sqrtn;
+
+		p1[channel] = val;
+		p2[channel] = val;
 	    }
 	}
     }
@@ -345,8 +472,6 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 	for (i = 0; i < n; ++i)
 	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3] = 1.0;
 
-    fftw_destroy_plan(in_plan);
-
     fftw_free(fftw_in);
     fftw_free(image_out);
 
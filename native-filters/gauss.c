@@ -114,149 +114,205 @@ find_iir_constants (double *n_p, double *n_m, double *d_p, double *d_m, double *
     }
 }
 
-static void
-transfer_pixels (const double *src1, const double *src2, float *dest, int width)
+/* Both passes work on blocks of GAUSS_BLOCK_LINES lines (columns in the
+   vertical pass, rows in the horizontal one) at once, with all four
+   channels of a pixel next to each other, so one vector holds a pixel
+   of every line in the block.  The image is split into tiles of lines
+   which are rendered as a parallel job.
+
+   The recursion is computed in double precision unless
+   GAUSS_IIR_FLOAT is defined.  Float precision is faster but has to
+   be checked with the blur tests in tests/run_tests.sh, whose
+   reference images are made with double precision. */
+#define GAUSS_BLOCK_LINES	4
+#define GAUSS_TILE_LINES	32
+#define GAUSS_BLOCK_LANES	(GAUSS_BLOCK_LINES * NUM_FLOATMAP_CHANNELS)
+
+#ifdef GAUSS_IIR_FLOAT
+typedef float iir_real_t;
+#else
+typedef double iir_real_t;
+#endif
+
+typedef iir_real_t iir_vec_t __attribute__ ((vector_size (sizeof(iir_real_t) * GAUSS_BLOCK_LANES)));
+
+typedef struct
+{
+    iir_vec_t n_p[5], n_m[5];
+    iir_vec_t d_p[5], d_m[5];
+    iir_vec_t i_p[5], i_m[5];	/* n - bd, for the initial values */
+} iir_constants_t;
+
+typedef struct
 {
-    int b;
+    image_t *out;
+    gboolean vertical;
+    iir_constants_t constants;
+} iir_job_t;
+
+static inline iir_vec_t
+iir_splat (double x)
+{
+    iir_vec_t v;
+    int i;
 
-    for (b = 0; b < width; b++)
-	*dest++ = *src1++ + *src2++;
+    for (i = 0; i < GAUSS_BLOCK_LANES; ++i)
+	v[i] = x;
+    return v;
 }
 
-static image_t*
-gauss_iir (image_t *floatmap, float horizontal_std_dev, float vertical_std_dev, mathmap_pools_t *pools)
+static void
+make_iir_constants (iir_constants_t *c, float std_dev)
 {
-    image_t *out;
-    int width = floatmap->pixel_width;
-    int height = floatmap->pixel_height;
-    float *dest;
-    float *src, *sp_p, *sp_m;
     double n_p[5], n_m[5];
     double d_p[5], d_m[5];
     double bd_p[5], bd_m[5];
-    double *val_p;
-    double *val_m;
-    double *vp, *vm;
-    int i, j;
-    int row, col;
-    int terms;
-    float initial_p;
-    float initial_m;
-    int channel;
+    int i;
 
-    out = floatmap_copy(floatmap, pools);
+    find_iir_constants(n_p, n_m, d_p, d_m, bd_p, bd_m, std_dev);
 
-    val_p = g_malloc(MAX(width, height) * sizeof(double));
-    val_m = g_malloc(MAX(width, height) * sizeof(double));
+    for (i = 0; i <= 4; ++i)
+    {
+	c->n_p[i] = iir_splat(n_p[i]);
+	c->n_m[i] = iir_splat(n_m[i]);
+	c->d_p[i] = iir_splat(d_p[i]);
+	c->d_m[i] = iir_splat(d_m[i]);
+	c->i_p[i] = iir_splat(n_p[i] - bd_p[i]);
+	c->i_m[i] = iir_splat(n_m[i] - bd_m[i]);
+    }
+}
 
-    src = g_malloc(MAX(width, height) * sizeof(float));
-    dest = g_malloc(MAX(width, height) * sizeof(float));
+/* Line j of the block starts at p + j * line_stride. */
+static inline iir_vec_t
+iir_load (const float *p, int line_stride, int num_lines)
+{
+    iir_vec_t v = iir_splat(0.0);
+    int j, c;
 
-    /*  First the vertical pass  */
-    find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, vertical_std_dev);
+    for (j = 0; j < num_lines; ++j)
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    v[j * NUM_FLOATMAP_CHANNELS + c] = p[j * line_stride + c];
+    return v;
+}
 
-    for (channel = 0; channel < NUM_FLOATMAP_CHANNELS; ++channel)
-	for (col = 0; col < width; col++)
-	{
-	    memset (val_p, 0, height * sizeof (double));
-	    memset (val_m, 0, height * sizeof (double));
-
-	    floatmap_get_channel_column(src, out, col, channel);
-
-	    sp_p = src;
-	    sp_m = src + (height - 1);
-	    vp = val_p;
-	    vm = val_m + (height - 1);
-
-	    /*  Set up the first vals  */
-	    initial_p = sp_p[0];
-	    initial_m = sp_m[0];
-
-	    for (row = 0; row < height; row++)
-	    {
-		double *vpptr, *vmptr;
-		terms = (row < 4) ? row : 4;
-
-		vpptr = vp; vmptr = vm;
-		for (i = 0; i <= terms; i++)
-		{
-		    *vpptr += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
-		    *vmptr += n_m[i] * sp_m[i] - d_m[i] * vm[i];
-		}
-		for (j = i; j <= 4; j++)
-		{
-		    *vpptr += (n_p[j] - bd_p[j]) * initial_p;
-		    *vmptr += (n_m[j] - bd_m[j]) * initial_m;
-		}
-
-		sp_p++;
-		sp_m--;
-		vp++;
-		vm--;
-	    }
-
-	    transfer_pixels (val_p, val_m, dest, height);
-
-	    floatmap_set_channel_column(out, col, channel, dest);
-	}
+static inline void
+iir_store (float *p, int line_stride, int num_lines, iir_vec_t v)
+{
+    int j, c;
 
-    /*  Now the horizontal pass  */
-    find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, horizontal_std_dev);
+    for (j = 0; j < num_lines; ++j)
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    p[j * line_stride + c] = v[j * NUM_FLOATMAP_CHANNELS + c];
+}
 
-    for (channel = 0; channel < NUM_FLOATMAP_CHANNELS; ++channel)
-	for (row = 0; row < height; row++)
-	{
-	    memset (val_p, 0, width * sizeof (double));
-	    memset (val_m, 0, width * sizeof (double));
+/* Filters a block of lines in place.  Element k of a line is at
+   k * elem_stride. */
+static void
+iir_filter_block (float *data, int n, int elem_stride, int line_stride, int num_lines,
+		  const iir_constants_t *c, iir_vec_t *val_p, iir_vec_t *val_m)
+{
+    iir_vec_t initial_p = iir_load(data, line_stride, num_lines);
+    iir_vec_t initial_m = iir_load(data + (n - 1) * elem_stride, line_stride, num_lines);
+    iir_vec_t src_p[5], src_m[5];	/* the last five input values */
+    int i, j, k;
 
-	    floatmap_get_channel_row(src, out, row, channel);
+    for (i = 0; i <= 4; ++i)
+	src_p[i] = src_m[i] = iir_splat(0.0);
 
-	    sp_p = src;
-	    sp_m = src + (width - 1);
-	    vp = val_p;
-	    vm = val_m + (width - 1);
+    for (k = 0; k < n; ++k)
+    {
+	int terms = (k < 4) ? k : 4;
+	iir_vec_t *vp = val_p + k;
+	iir_vec_t *vm = val_m + (n - 1 - k);
+	iir_vec_t sum_p = iir_splat(0.0);
+	iir_vec_t sum_m = iir_splat(0.0);
 
-	    /*  Set up the first vals  */
-	    initial_p = sp_p[0];
-	    initial_m = sp_m[0];
+	for (i = 4; i > 0; --i)
+	{
+	    src_p[i] = src_p[i - 1];
+	    src_m[i] = src_m[i - 1];
+	}
+	src_p[0] = iir_load(data + k * elem_stride, line_stride, num_lines);
+	src_m[0] = iir_load(data + (n - 1 - k) * elem_stride, line_stride, num_lines);
 
-	    for (col = 0; col < width; col++)
-	    {
-		double *vpptr, *vmptr;
+	for (i = 0; i <= terms; i++)
+	{
+	    sum_p += c->n_p[i] * src_p[i] - c->d_p[i] * (i == 0 ? sum_p : vp[-i]);
+	    sum_m += c->n_m[i] * src_m[i] - c->d_m[i] * (i == 0 ? sum_m : vm[i]);
+	}
+	for (j = i; j <= 4; j++)
+	{
+	    sum_p += c->i_p[j] * initial_p;
+	    sum_m += c->i_m[j] * initial_m;
+	}
 
-		terms = (col < 4) ? col : 4;
+	*vp = sum_p;
+	*vm = sum_m;
+    }
 
-		vpptr = vp;
-		vmptr = vm;
+    for (k = 0; k < n; ++k)
+	iir_store(data + k * elem_stride, line_stride, num_lines, val_p[k] + val_m[k]);
+}
+
+static iir_vec_t*
+alloc_iir_values (int n, gpointer *mem)
+{
+    /* Vectors may need more alignment than g_malloc() guarantees. */
+    *mem = g_malloc((n + 1) * sizeof(iir_vec_t));
+    return (iir_vec_t*)(((gsize)*mem + sizeof(iir_vec_t) - 1) & ~(gsize)(sizeof(iir_vec_t) - 1));
+}
 
-		for (i = 0; i <= terms; i++)
-		{
-		    *vpptr += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
-		    *vmptr += n_m[i] * sp_m[i] - d_m[i] * vm[i];
-		}
-		for (j = i; j <= 4; j++)
-		{
-		    *vpptr += (n_p[j] - bd_p[j]) * initial_p;
-		    *vmptr += (n_m[j] - bd_m[j]) * initial_m;
-		}
+static void
+iir_tile (parallel_job_t *job, int tile)
+{
+    iir_job_t *data = (iir_job_t*)job->data;
+    image_t *out = data->out;
+    int width = out->pixel_width;
+    int height = out->pixel_height;
+    int num_lines = data->vertical ? width : height;
+    int n = data->vertical ? height : width;
+    int elem_stride = data->vertical ? width * NUM_FLOATMAP_CHANNELS : NUM_FLOATMAP_CHANNELS;
+    int line_stride = data->vertical ? NUM_FLOATMAP_CHANNELS : width * NUM_FLOATMAP_CHANNELS;
+    int first_line = tile * GAUSS_TILE_LINES;
+    int last_line = MIN(first_line + GAUSS_TILE_LINES, num_lines);
+    gpointer mem_p, mem_m;
+    iir_vec_t *val_p = alloc_iir_values(n, &mem_p);
+    iir_vec_t *val_m = alloc_iir_values(n, &mem_m);
+    int line;
+
+    for (line = first_line; line < last_line; line += GAUSS_BLOCK_LINES)
+	iir_filter_block(out->v.floatmap.data + line * line_stride, n, elem_stride, line_stride,
+			 MIN(GAUSS_BLOCK_LINES, last_line - line), &data->constants, val_p, val_m);
+
+    g_free(mem_p);
+    g_free(mem_m);
+}
 
-		sp_p++;
-		sp_m--;
-		vp++;
-		vm--;
-	    }
+static image_t*
+gauss_iir (mathmap_invocation_t *invocation, image_t *floatmap, float horizontal_std_dev, float vertical_std_dev,
+	   mathmap_pools_t *pools)
+{
+    image_t *out;
+    iir_job_t data;
+    parallel_job_t job;
 
-	    transfer_pixels (val_p, val_m, dest, width);
+    out = floatmap_copy(floatmap, pools);
 
-	    floatmap_set_channel_row(out, row, channel, dest);
-	}
+    data.out = out;
+    job.data = &data;
+    job.func = iir_tile;
 
-    /*  free up buffers  */
-    g_free (val_p);
-    g_free (val_m);
+    /*  First the vertical pass  */
+    data.vertical = TRUE;
+    make_iir_constants(&data.constants, vertical_std_dev);
+    job.num_tiles = (out->pixel_width + GAUSS_TILE_LINES - 1) / GAUSS_TILE_LINES;
+    invocation_run_parallel_job(invocation, &job);
 
-    g_free (src);
-    g_free (dest);
+    /*  Now the horizontal pass  */
+    data.vertical = FALSE;
+    make_iir_constants(&data.constants, horizontal_std_dev);
+    job.num_tiles = (out->pixel_height + GAUSS_TILE_LINES - 1) / GAUSS_TILE_LINES;
+    invocation_run_parallel_job(invocation, &job);
 
     return out;
 }
@@ -312,10 +368,12 @@ free_rle_curve (float *curve, int length, float *sum)
     g_free(curve - length);
 }
 
+/* The RLE code works on whole pixels: a run is a sequence of pixels
+   whose channels are all equal.  src and pix are interleaved. */
 static int
 run_length_encode (const float *src, int *rle, float *pix, int dist, int width, int border, gboolean pack)
 {
-    float last;
+    const float *last;
     gint count = 0;
     gint i = width;
     gint same = 0;
@@ -325,16 +383,17 @@ run_length_encode (const float *src, int *rle, float *pix, int dist, int width,
     if (pack)
 	rle += width + border - 1;
 
-    pix += width + border - 1;
+    pix += (width + border - 1) * NUM_FLOATMAP_CHANNELS;
 
-    last  = *src;
+    last  = src;
     count = 0;
 
     /* the 'end' border */
     for (i = 0; i < border; i++)
     {
 	count++;
-	*pix--  = last;
+	memcpy(pix, last, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	pix -= NUM_FLOATMAP_CHANNELS;
 
 	if (pack)
 	    *rle-- = count;
@@ -343,13 +402,14 @@ run_length_encode (const float *src, int *rle, float *pix, int dist, int width,
     /* the real pixels */
     for (i = 0; i < width; i++)
     {
-	float c = *src;
+	const float *c = src;
 	src -= dist;
 
-	if (pack && c==last)
+	if (pack && c[0] == last[0] && c[1] == last[1] && c[2] == last[2] && c[3] == last[3])
         {
 	    count++;
-	    *pix-- = last;
+	    memcpy(pix, last, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	    pix -= NUM_FLOATMAP_CHANNELS;
 	    *rle-- = count;
 	    same++;
         }
@@ -357,7 +417,8 @@ run_length_encode (const float *src, int *rle, float *pix, int dist, int width,
         {
 	    count   = 1;
 	    last    = c;
-	    *pix--  = last;
+	    memcpy(pix, last, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	    pix -= NUM_FLOATMAP_CHANNELS;
 
 	    if (pack)
 		*rle-- = count;
@@ -368,7 +429,8 @@ run_length_encode (const float *src, int *rle, float *pix, int dist, int width,
     for (i = 0; i < border; i++)
     {
 	count++;
-	*pix-- = last;
+	memcpy(pix, last, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	pix -= NUM_FLOATMAP_CHANNELS;
 
 	if (pack)
 	    *rle-- = count;
@@ -379,7 +441,7 @@ run_length_encode (const float *src, int *rle, float *pix, int dist, int width,
 
 static void
 do_encoded_lre (const gint *enc, const float *src, float *dest, int width, int length, int dist,
-		const float *curve, int ctotal, const float *csum)
+		const float *curve, float ctotal, const float *csum)
 {
     int col;
 
@@ -389,12 +451,12 @@ do_encoded_lre (const gint *enc, const float *src, float *dest, int width, int l
 	const float *pix;
 	int nb;
 	float s1;
-	int i;
-	float val = 0.0;
+	int i, c;
+	float val[NUM_FLOATMAP_CHANNELS] = { 0.0, 0.0, 0.0, 0.0 };
 	int start = - length;
 
 	rpt = &enc[col + start];
-	pix = &src[col + start];
+	pix = &src[(col + start) * NUM_FLOATMAP_CHANNELS];
 
 	s1 = csum[start];
 	nb = rpt[0];
@@ -402,20 +464,22 @@ do_encoded_lre (const gint *enc, const float *src, float *dest, int width, int l
 
 	while (i <= length)
         {
-	    int s2 = csum[i];
+	    float s2 = csum[i];
 
-	    val += pix[0] * (s2-s1);
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		val[c] += pix[c] * (s2-s1);
 	    s1 = s2;
 	    rpt = &rpt[nb];
-	    pix = &pix[nb];
+	    pix = &pix[nb * NUM_FLOATMAP_CHANNELS];
 	    nb = rpt[0];
 	    i += nb;
         }
 
-	val += pix[0] * (csum[length] - s1);
-
-	val = val / ctotal;
-	*dest = val;
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	{
+	    val[c] += pix[c] * (csum[length] - s1);
+	    dest[c] = val[c] / ctotal;
+	}
     }
 }
 
@@ -428,212 +492,134 @@ do_full_lre (const float *src, float *dest, int width, int length, int dist, con
     {
 	const float *x1;
 	const float *x2;
-	const float *c = &curve[0];
-	int i;
-	float val = 0.0;
+	int i, c;
+	float val[NUM_FLOATMAP_CHANNELS];
 
-	x1 = x2 = &src[col];
+	x1 = x2 = &src[col * NUM_FLOATMAP_CHANNELS];
 
 	/* The central point is a special case since it should only be
 	 * processed ONCE
 	 */
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    val[c] = 0.0 + x1[c] * curve[0];
 
-	val += x1[0] * c[0];
-
-	c  += 1;
-	x1 += 1;
-	x2 -= 1;
-	i = length;
-
-	/* Processing multiple points in a single iteration should be
-	 * faster but is not strictly required.
-	 * Some precise benchmarking will be needed to figure out
-	 * if this is really interesting.
+	/* process the pixels at the distance i before and after the
+	 * central point. They must have the same coefficient
 	 */
-	while (i >= 8)
-        {
-	    val += (x1[0] + x2[-0]) * c[0];
-	    val += (x1[1] + x2[-1]) * c[1];
-	    val += (x1[2] + x2[-2]) * c[2];
-	    val += (x1[3] + x2[-3]) * c[3];
-	    val += (x1[4] + x2[-4]) * c[4];
-	    val += (x1[5] + x2[-5]) * c[5];
-	    val += (x1[6] + x2[-6]) * c[6];
-	    val += (x1[7] + x2[-7]) * c[7];
-
-	    c  += 8;
-	    x1 += 8;
-	    x2 -= 8;
-	    i  -= 8;
-        }
+	for (i = 1; i <= length; ++i)
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		val[c] += (x1[i * NUM_FLOATMAP_CHANNELS + c] + x2[-i * NUM_FLOATMAP_CHANNELS + c]) * curve[i];
 
-	while (i >= 4)
-        {
-	    val += (x1[0] + x2[-0]) * c[0];
-	    val += (x1[1] + x2[-1]) * c[1];
-	    val += (x1[2] + x2[-2]) * c[2];
-	    val += (x1[3] + x2[-3]) * c[3];
-	    c  += 4;
-	    x1 += 4;
-	    x2 -= 4;
-	    i  -= 4;
-        }
-
-	/* Only that final loop is strictly required */
-	while (i >= 1)
-        {
-	    /* process the pixels at the distance i before and after the
-	     * central point. They must have the same coefficient
-	     */
-	    val += (x1[0] + x2[-0]) * c[0];
-	    c  += 1;
-	    x1 += 1;
-	    x2 -= 1;
-	    i  -= 1;
-        }
-
-	val = val / ctotal;
-	*dest = val;
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    dest[c] = val[c] / ctotal;
     }
 }
 
-static image_t*
-gauss_rle (image_t *floatmap, float horizontal_std_dev, float vertical_std_dev, mathmap_pools_t *pools)
+typedef struct
 {
-    int width = floatmap->pixel_width;
-    int height = floatmap->pixel_height;
     image_t *out;
-    float *dest;
-    float *src;
-    int row, col, b;
-    float total;
+    gboolean vertical;
     float *curve;
     float *sum;
     int length;
+    float total;
+} rle_job_t;
 
-    src  = g_new(float, MAX(width, height) * NUM_FLOATMAP_CHANNELS);
-    dest = g_new(float, MAX(width, height) * NUM_FLOATMAP_CHANNELS);
-
-    out = floatmap_copy(floatmap, pools);
-
-    /*  First the vertical pass  */
-    if (vertical_std_dev > 0.0)
+static void
+rle_tile (parallel_job_t *job, int tile)
+{
+    rle_job_t *data = (rle_job_t*)job->data;
+    image_t *out = data->out;
+    int num_lines = data->vertical ? out->pixel_width : out->pixel_height;
+    int n = data->vertical ? out->pixel_height : out->pixel_width;
+    int first_line = tile * GAUSS_TILE_LINES;
+    int last_line = MIN(first_line + GAUSS_TILE_LINES, num_lines);
+    int length = data->length;
+    float *src, *dest;
+    int *rle;
+    float *pix;
+    int line;
+
+    src = g_new(float, n * NUM_FLOATMAP_CHANNELS);
+    dest = g_new(float, n * NUM_FLOATMAP_CHANNELS);
+
+    rle = g_new (int, n + 2 * length);
+    rle += length; /* rle[] extends from -length to n+length-1 */
+
+    pix = g_new (float, (n + 2 * length) * NUM_FLOATMAP_CHANNELS);
+    pix += length * NUM_FLOATMAP_CHANNELS; /* pix[] extends from -length to n+length-1 */
+
+    for (line = first_line; line < last_line; ++line)
     {
-	int *rle = NULL;
-	float *pix = NULL;
-
-	make_rle_curve (vertical_std_dev, &curve, &length, &sum, &total);
+	int same;
 
-	rle = g_new (int, height + 2 * length);
-	rle += length; /* rle[] extends from -length to height+length-1 */
-
-	pix = g_new (float, height + 2 * length);
-	pix += length; /* pix[] extends from -length to height+length-1 */
+	if (data->vertical)
+	    floatmap_get_column(src, out, line);
+	else
+	    floatmap_get_row(src, out, line);
 
-	for (col = 0; col < width; col++)
-        {
-	    floatmap_get_column(src, out, col);
-
-	    /*
-	    if (has_alpha)
-		multiply_alpha (src, height, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    for (b = 0; b < NUM_FLOATMAP_CHANNELS; b++)
-            {
-		int same = run_length_encode (src + b, rle, pix, NUM_FLOATMAP_CHANNELS,
-					      height, length, TRUE);
-
-		if (same > (3 * height) / 4)
-		{
-		    /* encoded_rle is only fastest if there are a lot of
-		     * repeating pixels
-		     */
-		    do_encoded_lre (rle, pix, dest + b, height, length, NUM_FLOATMAP_CHANNELS,
-				    curve, total, sum);
-		}
-		else
-		{
-		    /* else a full but more simple algorithm is better */
-		    do_full_lre (pix, dest + b, height, length, NUM_FLOATMAP_CHANNELS,
-				 curve, total);
-		}
-            }
-
-	    /*
-	    if (has_alpha)
-		separate_alpha (dest, height, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    floatmap_set_column(out, col, dest);
-        }
+	same = run_length_encode (src, rle, pix, NUM_FLOATMAP_CHANNELS, n, length, TRUE);
 
-	g_free(rle - length);
-	g_free(pix - length);
+	if (same > (3 * n) / 4)
+	{
+	    /* encoded_rle is only fastest if there are a lot of
+	     * repeating pixels
+	     */
+	    do_encoded_lre (rle, pix, dest, n, length, NUM_FLOATMAP_CHANNELS,
+			    data->curve, data->total, data->sum);
+	}
+	else
+	{
+	    /* else a full but more simple algorithm is better */
+	    do_full_lre (pix, dest, n, length, NUM_FLOATMAP_CHANNELS,
+			 data->curve, data->total);
+	}
 
-	free_rle_curve(curve, length, sum);
+	if (data->vertical)
+	    floatmap_set_column(out, line, dest);
+	else
+	    floatmap_set_row(out, line, dest);
     }
 
-    /*  Now the horizontal pass  */
-    if (horizontal_std_dev > 0.0)
-    {
-	int *rle = NULL;
-	float *pix = NULL;
+    g_free(rle - length);
+    g_free(pix - length * NUM_FLOATMAP_CHANNELS);
+
+    g_free(src);
+    g_free(dest);
+}
 
-	make_rle_curve(horizontal_std_dev, &curve, &length, &sum, &total);
+static void
+gauss_rle_pass (mathmap_invocation_t *invocation, image_t *out, gboolean vertical, float std_dev)
+{
+    rle_job_t data;
+    parallel_job_t job;
+    int num_lines = vertical ? out->pixel_width : out->pixel_height;
 
-	rle = g_new (int, width+2*length);
-	rle += length; /* so rle[] extends from -width to width+length-1 */
+    data.out = out;
+    data.vertical = vertical;
+    make_rle_curve(std_dev, &data.curve, &data.length, &data.sum, &data.total);
 
-	pix = g_new (float, width+2*length);
-	pix += length; /* so pix[] extends from -width to width+length-1 */
+    job.data = &data;
+    job.func = rle_tile;
+    job.num_tiles = (num_lines + GAUSS_TILE_LINES - 1) / GAUSS_TILE_LINES;
+    invocation_run_parallel_job(invocation, &job);
 
-	for (row = 0; row < height; row++)
-        {
-	    floatmap_get_row(src, out, row);
-
-	    /*
-	    if (has_alpha)
-		multiply_alpha (src, width, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    for (b = 0; b < NUM_FLOATMAP_CHANNELS; b++)
-            {
-		int same = run_length_encode (src + b, rle, pix, NUM_FLOATMAP_CHANNELS,
-					      width, length, TRUE);
-
-		if (same > (3 * width) / 4)
-		{
-		    /* encoded_rle is only fastest if there are a lot of
-		     * repeating pixels
-		     */
-		    do_encoded_lre (rle, pix, dest + b, width, length, NUM_FLOATMAP_CHANNELS,
-				    curve, total, sum);
-		}
-		else
-		{
-		    /* else a full but more simple algorithm is better */
-		    do_full_lre (pix, dest + b, width, length, NUM_FLOATMAP_CHANNELS,
-				 curve, total);
-		}
-            }
-
-	    /*
-	    if (has_alpha)
-		separate_alpha (dest, width, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    floatmap_set_row(out, row, dest);
-        }
+    free_rle_curve(data.curve, data.length, data.sum);
+}
 
-	g_free (rle - length);
-	g_free (pix - length);
+static image_t*
+gauss_rle (mathmap_invocation_t *invocation, image_t *floatmap, float horizontal_std_dev, float vertical_std_dev,
+	   mathmap_pools_t *pools)
+{
+    image_t *out = floatmap_copy(floatmap, pools);
 
-	free_rle_curve (curve, length, sum);
-    }
+    /*  First the vertical pass  */
+    if (vertical_std_dev > 0.0)
+	gauss_rle_pass(invocation, out, TRUE, vertical_std_dev);
 
-    g_free(src);
-    g_free(dest);
+    /*  Now the horizontal pass  */
+    if (horizontal_std_dev > 0.0)
+	gauss_rle_pass(invocation, out, FALSE, horizontal_std_dev);
 
     return out;
 }
@@ -660,9 +646,9 @@ native_filter_gaussian_blur (mathmap_invocation_t *invocation, userval_t *args,
     vertical_std_dev = fabs(vertical_std_dev * floatmap->v.floatmap.ay);
 
     if (horizontal_std_dev < 0.5 || vertical_std_dev < 0.5)
-	result = gauss_rle(floatmap, horizontal_std_dev, vertical_std_dev, &invocation->pools);
+	result = gauss_rle(invocation, floatmap, horizontal_std_dev, vertical_std_dev, &cache_entry->pools);
     else
-	result = gauss_iir(floatmap, horizontal_std_dev, vertical_std_dev, &invocation->pools);
+	result = gauss_iir(invocation, floatmap, horizontal_std_dev, vertical_std_dev, &cache_entry->pools);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, result);
 
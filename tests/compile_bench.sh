@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Measures how long the compiler's optimizer takes on large scripts.
+# The backend is not run and there is no time limit, so the times are
+# comparable between versions.
+
+OUTFILE=/tmp/mathbench_$$.png
+
+bench_compile () {
+    SCRIPT=$1
+
+    echo "Compiling $SCRIPT"
+    /usr/bin/time -f "%e s" ../mathmap --bench-no-backend --bench-no-compile-time-limit \
+	-f "$SCRIPT" "$OUTFILE" >/dev/null
+}
+
+bench_compile "../examples/Map/Droste.mm"
+bench_compile "../examples/Map/Droste9.mm"
+bench_compile "../examples/Map/Escher_Balkon.mm"
+bench_compile "../examples/Map/IFS Functional.mm"
+bench_compile "../examples/Map/IFS Iterative.mm"
+bench_compile "../examples/Render/Fancy Mandelbrot.mm"
+bench_compile "../examples/Distorts/Enhanced Pond.mm"
+
+rm -f "$OUTFILE"
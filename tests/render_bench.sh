@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Measures how long rendering takes with the C backend.  Set MATHMAP
+# to the binary to measure, and BASELINE to a build without the change
+# under test to time that one, too, for every filter.  Each filter is
+# rendered once before it is timed, so the module cache saves compiling
+# it again, and the timed run renders it several times without writing
+# the output.  tests/run_tests.sh takes MATHMAP as well.
+
+MATHMAP=${MATHMAP:-../mathmap}
+OUTFILE=/tmp/mathbench_$$.png
+SIZE=2048x2048
+COUNT=5
+
+time_render () {
+    BINARY=$1
+    SCRIPT=$2
+    ARGS=$3
+    LABEL=$4
+
+    "$BINARY" -f "$SCRIPT" -s $SIZE $ARGS "$OUTFILE" >/dev/null
+    /usr/bin/time -f "$LABEL%e s" "$BINARY" --bench-no-output --bench-render-count=$COUNT \
+	-f "$SCRIPT" -s $SIZE $ARGS "$OUTFILE" >/dev/null
+}
+
+bench_render () {
+    echo "Rendering $1"
+    if [ -n "$BASELINE" ] ; then
+	time_render "$BASELINE" "$1" "$2" "  baseline: "
+	time_render "$MATHMAP" "$1" "$2" "  this:     "
+    else
+	time_render "$MATHMAP" "$1" "$2" ""
+    fi
+}
+
+bench_modify () {
+    bench_render "$1" "-Din=marlene.png $2"
+}
+
+# straight-line pixel code
+bench_modify "../examples/Utilities/Ident.mm"
+bench_modify "../examples/Distorts/Rotation.mm"
+bench_modify "../examples/Distorts/Twirl.mm"
+bench_modify "../examples/Distorts/Sea.mm"
+bench_render "../examples/Render/Moire 1.mm"
+
+# if and while in the pixel code
+bench_render "../examples/Render/Mandelbrot.mm"
+bench_render "../examples/Render/Fancy Mandelbrot.mm"
+bench_render "../examples/Render/Disco.mm"
+
+# tuples and loops over the input image
+bench_modify "../examples/Blur/Gaussian Blur.mm" "-Ddev=0.1"
+bench_modify "../examples/Blur/Mosaic.mm"
+
+rm -f "$OUTFILE"
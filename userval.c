@@ -452,8 +452,9 @@ free_uservals (userval_t *uservals, userval_info_t *infos)
 		break;
 
 	    case USERVAL_IMAGE :
-		g_assert(uservals[info->index].v.image != NULL);
-		if (uservals[info->index].v.image->type == IMAGE_DRAWABLE) {
+		/* images which were never assigned have no value */
+		if (uservals[info->index].v.image != NULL
+		    && uservals[info->index].v.image->type == IMAGE_DRAWABLE) {
 		    g_assert(uservals[info->index].v.image->v.drawable);
 		    free_input_drawable(uservals[info->index].v.image->v.drawable);
 		}
@@ -512,7 +513,7 @@ copy_userval (userval_t *dst, userval_t *src, int type)
 		{
 		    input_drawable_t *copy = copy_input_drawable(src->v.image->v.drawable);
 
-		    dst->v.image = &copy->image;
+		    dst->v.image = copy != NULL ? &copy->image : NULL;
 		}
 		else
 		    dst->v.image = 0;
@@ -567,7 +568,7 @@ userval_int_update (GtkAdjustment *adjustment, userval_t *userval)
 {
     userval->v.int_const = (int)lrint(adjustment->value);
 
-    user_value_changed();
+    user_value_changed(userval);
 }
 
 static void
@@ -575,7 +576,7 @@ userval_float_update (GtkAdjustment *adjustment, userval_t *userval)
 {
     userval->v.float_const = adjustment->value;
 
-    user_value_changed();
+    user_value_changed(userval);
 }
 
 static void
@@ -586,7 +587,7 @@ userval_bool_update (GtkToggleButton *button, userval_t *userval)
     else
 	userval->v.bool_const = 0.0;
 
-    user_value_changed();
+    user_value_changed(userval);
 }
 
 static void
@@ -598,7 +599,7 @@ userval_color_update (GtkWidget *color_well, userval_t *userval)
 						   userval->v.color.button_value.b,
 						   userval->v.color.button_value.a);
 
-    user_value_changed();
+    user_value_changed(userval);
 }
 
 static void
@@ -618,9 +619,12 @@ user_image_update (gint32 id, void **user_data)
     drawable = gimp_drawable_get(id);
     assert(drawable != 0);
 
+    /* the old drawable is freed, so it must not be rendering */
+    cancel_preview();
+
     assign_image_userval_drawable(info, userval, alloc_gimp_input_drawable(drawable, FALSE));
 
-    user_value_changed();
+    user_value_changed(userval);
 }
 
 static void
@@ -651,8 +655,11 @@ update_curve (curve_t *curve_val, GeglCurve *curve)
 static void
 userval_curve_update (GtkWidget *curve_widget, userval_t *userval)
 {
+    /* the curve's values are shared with the rendering closure */
+    cancel_preview();
+
     update_curve(userval->v.curve, curve_widget_get_curve(curve_widget));
-    user_value_changed();
+    user_value_changed(userval);
 }
 
 static int
@@ -49,11 +49,19 @@
 #define USERVAL_IMAGE       7
 /* END */
 
+/* How the compiled code uses a userval, i.e., what has to be done
+   again when it changes. */
+#define USERVAL_USE_UNKNOWN	0	/* not analyzed - assume frame */
+#define USERVAL_USE_NONE	1
+#define USERVAL_USE_PIXEL	2	/* only read by the pixel code */
+#define USERVAL_USE_FRAME	3	/* computed in init_frame */
+
 typedef struct _userval_info_t
 {
     char *name;
     int type;
     int index;
+    int use;			/* set by the compiler */
 
     union
     {
@@ -31,7 +31,6 @@ variable_t*
 alloc_variable (tuple_info_t type)
 {
     variable_t *var;
-    int i;
 
     var = (variable_t*)malloc(sizeof(variable_t));
 
@@ -39,18 +38,6 @@ alloc_variable (tuple_info_t type)
     var->type = type;
     var->next = 0;
 
-    var->compvar = (struct _compvar_t**)malloc(sizeof(struct _compvar_t*) * type.length);
-    assert(var->compvar != 0);
-
-    var->last_index = (int*)malloc(sizeof(int) * type.length);
-    assert(var->last_index != 0);
-
-    for (i = 0; i < type.length; ++i)
-    {
-	var->compvar[i] = 0;
-	var->last_index[i] = 0;
-    }
-
     return var;
 }
 
@@ -111,23 +98,6 @@ new_temporary_variable (variable_t **vars, tuple_info_t type)
     return var;
 }
 
-void
-compiler_reset_variables (variable_t *vars)
-{
-    while (vars != 0)
-    {
-	int i;
-
-	for (i = 0; i < vars->type.length; ++i)
-	{
-	    vars->compvar[i] = 0;
-	    vars->last_index[i] = 0;
-	}
-
-	vars = vars->next;
-    }
-}
-
 void
 free_variables (variable_t *vars)
 {
@@ -136,8 +106,6 @@ free_variables (variable_t *vars)
 	variable_t *next = vars->next;
 
 	free(vars->name);
-	free(vars->compvar);
-	free(vars->last_index);
 	free(vars);
 
 	vars = next;